@@ -0,0 +1,337 @@
+
+#include <src/colour_gradient.h>
+#include <algorithm>
+#include <cstring>
+#include <functional>
+
+// Microbenchmarks of the functions every sample goes through, and a full fixed seed frame of the random scene.
+// Each benchmark runs batches of calls until a batch takes long enough to time, repeats that a few times and
+// reports the median, so the numbers are comparable between runs on the same machine. It exits with 1 if the
+// objects and data layouts of the instanced mesh scene find different hits.
+//
+// Options: --output FILE (JSON results, stdout if not given), --min-time SECONDS per benchmark,
+// --frame-width N, --frame-height N, --frame-samples N, --threads N (frame only, 0 uses every core)
+
+struct benchmark_result {
+    string name;
+    double ns_per_op;
+    uint64_t iterations;
+    // What one op is, and how many of those a second the median time works out to. The JSON names the rate
+    // after the unit, so the intersection and traversal benchmarks report rays_per_second
+    string unit;
+    double per_second;
+    // Extra figure for benchmarks where one op does several things, such as ns per sphere test
+    string extra_name;
+    double extra = 0;
+};
+
+// Results end up in here so the compiler cannot drop the work
+static volatile float benchmark_sink;
+
+struct benchmark_runner {
+    double min_time = 0.2;
+    vector<benchmark_result> results;
+
+    // op(i) does one unit of work for iteration i and returns something to feed the sink
+    template<typename Op>
+    benchmark_result &run(const string &name, const string &unit, Op &&op) {
+        // Grow the batch until it takes a tenth of the time budget, then time five batches of that size
+        uint64_t batch = 1;
+        while (true) {
+            double seconds = time_batch(op, batch);
+            if (seconds >= min_time / 10 || batch >= (uint64_t(1) << 32)) {
+                break;
+            }
+            batch *= seconds > 0 ? std::min<uint64_t>(100, std::max<uint64_t>(2, uint64_t(min_time / 10 / seconds))) : 100;
+        }
+        vector<double> ns;
+        for (int repeat = 0; repeat < 5; repeat++) {
+            ns.push_back(time_batch(op, batch) * 1e9 / double(batch));
+        }
+        sort(ns.begin(), ns.end());
+        benchmark_result result;
+        result.name = name;
+        result.ns_per_op = ns[ns.size() / 2];
+        result.iterations = batch * 5;
+        result.unit = unit;
+        result.per_second = 1e9 / result.ns_per_op;
+        results.push_back(result);
+        cerr << name << ": " << result.ns_per_op << " ns per " << unit << ", " << result.per_second / 1e6
+             << " million " << unit << "s per second\n";
+        return results.back();
+    }
+
+    template<typename Op>
+    static double time_batch(Op &op, uint64_t batch) {
+        float sink = 0;
+        auto start = chrono::steady_clock::now();
+        for (uint64_t i = 0; i < batch; i++) {
+            sink += op(i);
+        }
+        auto end = chrono::steady_clock::now();
+        benchmark_sink = sink;
+        return chrono::duration<double>(end - start).count();
+    }
+};
+
+// Rays from the random scene camera, so the intersection benchmarks see the same mix of hits and misses as a render
+static vector<ray> camera_rays(const camera &cam, int count, uint64_t seed) {
+    sampler rng(sampler_kind::independent, seed, 0, 0, 1, 0);
+    vector<ray> rays;
+    for (int i = 0; i < count; i++) {
+        rays.push_back(cam.get_ray(rng.next_float(), rng.next_float(), rng));
+    }
+    return rays;
+}
+
+static void write_json(FILE *file, const vector<benchmark_result> &results, const char *simd, int threads,
+                       int width, int height, int samples, double frame_seconds, double build_seconds) {
+    // Whether the render counters were compiled in, since they slow down what they count
+#ifdef RT_ENABLE_STATS
+    const char *stats = "true";
+#else
+    const char *stats = "false";
+#endif
+    fprintf(file, "{\n  \"simd\": \"%s\",\n  \"stats\": %s,\n  \"benchmarks\": [\n", simd, stats);
+    for (size_t i = 0; i < results.size(); i++) {
+        const benchmark_result &r = results[i];
+        fprintf(file, "    {\"name\": \"%s\", \"ns_per_op\": %.3f, \"unit\": \"%s\", \"%ss_per_second\": %.1f, "
+                      "\"iterations\": %llu",
+                r.name.c_str(), r.ns_per_op, r.unit.c_str(), r.unit.c_str(), r.per_second,
+                (unsigned long long) r.iterations);
+        if (!r.extra_name.empty()) {
+            fprintf(file, ", \"%s\": %.3f", r.extra_name.c_str(), r.extra);
+        }
+        fprintf(file, "}%s\n", i + 1 < results.size() ? "," : "");
+    }
+    double samples_total = double(width) * double(height) * double(samples);
+    fprintf(file, "  ],\n  \"frame\": {\"width\": %d, \"height\": %d, \"samples_per_pixel\": %d, \"threads\": %d, "
+                  "\"scene_build_seconds\": %.4f, \"seconds\": %.4f, \"samples_per_second\": %.1f}\n}\n",
+            width, height, samples, threads, build_seconds, frame_seconds, samples_total / frame_seconds);
+}
+
+int main(int argc, char **argv) {
+    string output;
+    benchmark_runner runner;
+    int frame_width = 400;
+    int frame_height = 200;
+    int frame_samples = 8;
+    int threads = 0;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--output") == 0) {
+            output = argv[i + 1];
+        } else if (strcmp(argv[i], "--min-time") == 0) {
+            runner.min_time = atof(argv[i + 1]);
+        } else if (strcmp(argv[i], "--frame-width") == 0) {
+            frame_width = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--frame-height") == 0) {
+            frame_height = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--frame-samples") == 0) {
+            frame_samples = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            threads = atoi(argv[i + 1]);
+        }
+    }
+
+    colour_gradient gradient(frame_width, frame_height, frame_samples);
+    gradient.settings.threads = threads;
+    camera cam = gradient.random_scene_camera();
+    const int ray_count = 4096;
+    const size_t mask = ray_count - 1;
+    vector<ray> rays = camera_rays(cam, ray_count, 7);
+
+    // A single sphere in the middle of the view, about half the rays hit it
+    sphere single(vec3(0, 0, 0), 1.5, nullptr);
+    runner.run("sphere_hit", "ray", [&](uint64_t i) {
+        hit_record record;
+        return single.hit(rays[i & mask], 0.001, MAX_FLOAT, record) ? record.t : 0.0f;
+    });
+
+    scene_arena arena;
+    pcg32 scene_rng(gradient.settings.seed, SCENE_STREAM);
+    hittable_list *list = random_scene(scene_rng, arena);
+    benchmark_result &linear = runner.run("hittable_list_hit", "ray", [&](uint64_t i) {
+        hit_record record;
+        return list->hit(rays[i & mask], 0.001, MAX_FLOAT, record) ? record.t : 0.0f;
+    });
+    linear.extra_name = "ns_per_intersection";
+    linear.extra = linear.ns_per_op / list->list_size;
+
+    bvh tree(list->list, list->list_size);
+    runner.run("bvh_hit", "ray", [&](uint64_t i) {
+        hit_record record;
+        return tree.hit(rays[i & mask], 0.001, MAX_FLOAT, record) ? record.t : 0.0f;
+    });
+
+    scene_data data;
+    data.add_hittables(list->list, list->list_size);
+    runner.run("scene_data_intersect", "ray", [&](uint64_t i) {
+        surface_hit hit;
+        return data.intersect(rays[i & mask], 0.001, MAX_FLOAT, hit) ? hit.t : 0.0f;
+    });
+
+    // Shadow ray style queries through the same scene, which stop at the first sphere in the way
+    runner.run("scene_data_occluded", "ray", [&](uint64_t i) {
+        return data.occluded(rays[i & mask], 0.001, MAX_FLOAT) ? 1.0f : 0.0f;
+    });
+
+    // The single sphere again as a triangle mesh of a quarter million triangles with vertex normals, built here
+    // rather than read from a file. The extra figure is what the mesh takes in memory
+    triangle_mesh ball;
+    const int rings = 256;
+    const int segments = 512;
+    for (int i = 0; i <= rings; i++) {
+        for (int j = 0; j < segments; j++) {
+            float theta = float(M_PI) * float(i) / rings;
+            float phi = 2 * float(M_PI) * float(j) / segments;
+            vec3 n(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+            ball.add_vertex(1.5f * n, n);
+        }
+    }
+    for (int i = 0; i < rings; i++) {
+        for (int j = 0; j < segments; j++) {
+            uint32_t a = uint32_t(i * segments + j);
+            uint32_t b = uint32_t(i * segments + (j + 1) % segments);
+            ball.add_triangle(a, b, a + segments);
+            ball.add_triangle(b, b + segments, a + segments);
+        }
+    }
+    ball.build();
+    benchmark_result &mesh = runner.run("mesh_intersect", "ray", [&](uint64_t i) {
+        float t = MAX_FLOAT;
+        uint32_t triangle;
+        float b1, b2;
+        return ball.intersect(rays[i & mask], 0.001, t, triangle, b1, b2) ? t : 0.0f;
+    });
+    mesh.extra_name = "bytes_per_triangle";
+    mesh.extra = double(ball.memory_bytes()) / double(ball.triangle_count());
+
+    // Ten thousand small copies of that mesh on a grid across the ground, through a scene_data's two level bvh.
+    // The extra figure is what each copy costs on top of the one shared mesh
+    scene_data copies;
+    material_id grey = copies.add_lambertian(vec3(0.5, 0.5, 0.5));
+    int shared = copies.add_mesh(std::shared_ptr<const triangle_mesh>(&ball, [](const triangle_mesh *) {}));
+    for (int i = 0; i < 100; i++) {
+        for (int j = 0; j < 100; j++) {
+            vec3 position(0.2f * float(i - 50), 0.075f, 0.2f * float(j - 50));
+            copies.add_instance(shared, affine_transform::translate(position) *
+                                        affine_transform::rotate(vec3(0, 1, 0), float(i * 100 + j)) *
+                                        affine_transform::scale(vec3(0.05f, 0.05f, 0.05f)), grey);
+        }
+    }
+    copies.build();
+    benchmark_result &instanced = runner.run("instanced_mesh_intersect", "ray", [&](uint64_t i) {
+        surface_hit hit;
+        return copies.intersect(rays[i & mask], 0.001, MAX_FLOAT, hit) ? hit.t : 0.0f;
+    });
+    instanced.extra_name = "bytes_per_instance";
+    instanced.extra = double(copies.instances.capacity() * sizeof(mesh_instance) +
+                             copies.instance_nodes.capacity() * sizeof(bvh_node)) / double(copies.instances.size());
+    runner.run("instanced_mesh_occluded", "ray", [&](uint64_t i) {
+        return copies.occluded(rays[i & mask], 0.001, MAX_FLOAT) ? 1.0f : 0.0f;
+    });
+
+    // The same copies as instance hittables under a bvh, the objects layout of that scene. Every ray has to
+    // find the same hit both ways, up to the rounding of the transforms being inverted back and forth
+    scene_arena object_arena;
+    hittable *object_copies = object_world(copies, object_arena);
+    int mismatches = 0;
+    for (const ray &r : rays) {
+        surface_hit expected;
+        hit_record found;
+        bool in_data = copies.intersect(r, 0.001, MAX_FLOAT, expected);
+        bool in_objects = object_copies->hit(r, 0.001, MAX_FLOAT, found);
+        if (in_data != in_objects || (in_data && std::fabs(found.t - expected.t) > 1e-4f * expected.t)) {
+            mismatches++;
+        }
+    }
+    if (mismatches > 0) {
+        cerr << "instance hittables and scene_data disagree on " << mismatches << " of " << ray_count << " rays\n";
+    }
+    runner.run("instanced_objects_hit", "ray", [&](uint64_t i) {
+        hit_record record;
+        return object_copies->hit(rays[i & mask], 0.001, MAX_FLOAT, record) ? record.t : 0.0f;
+    });
+
+    // Scatter off the records of rays that hit the scene, each material sees the same hits
+    vector<ray> hit_rays;
+    vector<hit_record> records;
+    for (const ray &r : rays) {
+        hit_record record;
+        if (tree.hit(r, 0.001, MAX_FLOAT, record)) {
+            hit_rays.push_back(r);
+            records.push_back(record);
+        }
+    }
+    size_t hit_count = records.size();
+    lambertian diffuse(vec3(0.5, 0.5, 0.5));
+    metal shiny(vec3(0.7, 0.6, 0.5), 0.3);
+    dielectric glass(1.5);
+    sampler rng(sampler_kind::independent, 1, 0, 0, 1, 0);
+    auto scatter_benchmark = [&](const string &name, const material &m) {
+        runner.run(name, "scatter", [&](uint64_t i) {
+            ray scattered;
+            vec3 attenuation;
+            size_t j = i % hit_count;
+            return m.scatter(hit_rays[j], records[j], attenuation, scattered, rng) ? scattered.direction()[0] : 0.0f;
+        });
+    };
+    // A camera that sees none of the scene leaves nothing to scatter off
+    if (hit_count > 0) {
+        scatter_benchmark("lambertian_scatter", diffuse);
+        scatter_benchmark("metal_scatter", shiny);
+        scatter_benchmark("dielectric_scatter", glass);
+    } else {
+        cerr << "No camera ray hits the scene, skipping the scatter benchmarks\n";
+    }
+
+    runner.run("camera_get_ray", "ray", [&](uint64_t i) {
+        return cam.get_ray(float(i & 1023) / 1024.0f, float((i >> 10) & 1023) / 1024.0f, rng).direction()[0];
+    });
+
+    runner.run("random_in_unit_sphere", "sample", [&](uint64_t) {
+        return random_in_unit_sphere(rng)[0];
+    });
+
+    // One number from each kind of sampler, walking through the dimensions of a path a few bounces long.
+    // The blue noise mask is built first, outside the timing
+    const pair<const char *, sampler_kind> sampler_kinds[] = {{"sampler_independent", sampler_kind::independent},
+                                                              {"sampler_sobol", sampler_kind::sobol},
+                                                              {"sampler_halton", sampler_kind::halton},
+                                                              {"sampler_blue_noise", sampler_kind::blue_noise}};
+    blue_noise();
+    for (const auto &kind : sampler_kinds) {
+        sampler numbers(kind.second, 1, 0, 0, 1, 0);
+        runner.run(kind.first, "number", [&](uint64_t i) {
+            if ((i & 31) == 0) {
+                numbers = sampler(kind.second, 1, int(i >> 5) & 63, int(i >> 11) & 63, 64, uint32_t(i >> 5));
+            }
+            return numbers.next_float();
+        });
+    }
+
+    // Full frame at a fixed seed. The scene build is timed on its own first, which also sizes the arena,
+    // the frame time includes building it again
+    auto build_start = chrono::steady_clock::now();
+    gradient.build_random_scene();
+    double build_seconds = chrono::duration<double>(chrono::steady_clock::now() - build_start).count();
+    auto frame_start = chrono::steady_clock::now();
+    framebuffer image = gradient.render_random_scene();
+    double frame_seconds = chrono::duration<double>(chrono::steady_clock::now() - frame_start).count();
+    benchmark_sink = image.pixels[0][0];
+    cerr << "frame: " << frame_seconds << " s\n";
+
+    thread_pool pool(threads);
+    int thread_count = pool.size();
+    FILE *file = output.empty() ? stdout : fopen(output.c_str(), "w");
+    if (!file) {
+        cerr << "Could not open " << output << "\n";
+        return 1;
+    }
+    write_json(file, runner.results, simd_level_name(detect_simd_level()), thread_count, frame_width, frame_height,
+               frame_samples, frame_seconds, build_seconds);
+    if (file != stdout) {
+        fclose(file);
+    }
+    return mismatches > 0 ? 1 : 0;
+}
@@ -0,0 +1,370 @@
+#include <src/colour_gradient.h>
+#include <src/render_server.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <sstream>
+
+// Equal time convergence of the renderer against stored reference images. Each scene is rendered one sample
+// per pixel per pass, the error of the image against the scene's reference is measured after every pass (off
+// the clock), and the error curve is read off at a few time budgets. Faster rays and better samples both show
+// up as a lower error at the same time, a biased change as an error that stops going down.
+//
+// Options: --references DIR (where the reference images are, references/ by default),
+// --scenes DIR (the directory scene files are found relative to, . by default),
+// --make-references (render the references instead, with --reference-samples N per pixel),
+// --budgets S,S,... (seconds, 0.25,0.5,1,2 by default), --repeats N (runs to take the quickest time of, 3 by default),
+// --output FILE (JSON curves, stdout if not given),
+// --baseline FILE (output of an earlier run with the same scenes and budgets: exit with 1 if the relMSE of any
+// scene at any budget is more than --tolerance X, 0.2 by default, worse than it was, or if the baseline has no
+// entry for it. relMSE is a squared error, so 0.2 lets the RMSE get up to about 10% worse, sqrt(1.2) = 1.095),
+// and any renderer option (--sampler, --integrator, --light-sampling, --threads, ...), applied to every scene
+
+struct convergence_scene {
+    const char *name;
+    // Scene file relative to --scenes, empty for the random scene of seed 1
+    const char *file;
+    int width;
+    int height;
+};
+
+const convergence_scene CONVERGENCE_SCENES[] = {{"random", "", 128, 64},
+                                                {"three_spheres", "scenes/three_spheres.txt", 128, 64},
+                                                {"lights", "scenes/lights.txt", 96, 96}};
+
+// Added to the squared reference value in the relative error, so that black pixels do not dominate it
+const float RELMSE_EPSILON = 0.01f;
+
+// References are rendered with independent samples from this pass on, so that they share no samples with the
+// runs they are compared to
+const uint64_t REFERENCE_FIRST_PASS = 1ULL << 24;
+
+// A run stops after this many passes even if it is still under its largest budget
+const int CONVERGENCE_MAX_PASSES = 1 << 16;
+
+struct convergence_point {
+    double seconds;
+    double spp;
+    double rmse;
+    double relmse;
+};
+
+struct budget_result {
+    string scene;
+    double seconds;
+    double spp;
+    double rmse;
+    double relmse;
+};
+
+static void image_error(const framebuffer &image, const framebuffer &reference, double &rmse, double &relmse) {
+    double squared = 0, relative = 0;
+    for (size_t i = 0; i < image.pixels.size(); i++) {
+        for (int c = 0; c < 3; c++) {
+            double d = double(image.pixels[i][c]) - double(reference.pixels[i][c]);
+            double r = reference.pixels[i][c];
+            squared += d * d;
+            relative += d * d / (r * r + RELMSE_EPSILON);
+        }
+    }
+    double values = 3.0 * double(image.pixels.size());
+    rmse = std::sqrt(squared / values);
+    relmse = relative / values;
+}
+
+static convergence_point at_time(const vector<convergence_point> &curve, double seconds) {
+    // The curve read at `seconds`, interpolating between the passes either side of it in log-log space,
+    // where error against time is close to a straight line. Before the first pass it is the first pass, after
+    // the last it carries on at the Monte Carlo rate, the squared error falling with one over time
+    if (seconds <= curve.front().seconds) {
+        return curve.front();
+    }
+    for (size_t i = 1; i < curve.size(); i++) {
+        if (curve[i].seconds >= seconds) {
+            const convergence_point &a = curve[i - 1];
+            const convergence_point &b = curve[i];
+            double f = std::log(seconds / a.seconds) / std::log(b.seconds / a.seconds);
+            auto lerp = [f](double x, double y) { return std::exp(std::log(x) + f * (std::log(y) - std::log(x))); };
+            return {seconds, a.spp + f * (b.spp - a.spp), lerp(a.rmse, b.rmse), lerp(a.relmse, b.relmse)};
+        }
+    }
+    const convergence_point &last = curve.back();
+    double longer = seconds / last.seconds;
+    return {seconds, last.spp * longer, last.rmse / std::sqrt(longer), last.relmse / longer};
+}
+
+static bool setup_scene(colour_gradient &gradient, const convergence_scene &scene, const string &scenes_dir) {
+    // load_scene() takes the image size from the file, the table's size wins
+    if (scene.file[0] && !gradient.load_scene(scenes_dir + "/" + scene.file)) {
+        return false;
+    }
+    gradient.x_pixels = scene.width;
+    gradient.y_pixels = scene.height;
+    return true;
+}
+
+static bool make_reference(const convergence_scene &scene, const string &scenes_dir, const string &path,
+                           int samples, int threads) {
+    // Default settings but for the sampler, so the reference is of the renderer as it is meant to converge
+    colour_gradient gradient(scene.width, scene.height, samples);
+    gradient.settings.threads = threads;
+    gradient.settings.sampler = sampler_kind::independent;
+    if (!setup_scene(gradient, scene, scenes_dir)) {
+        return false;
+    }
+    hittable *world = gradient.build_scene();
+    camera cam = gradient.scene_camera();
+    thread_pool pool(gradient.settings.threads);
+    accumulation_buffer accumulated(scene.width, scene.height);
+    auto start = chrono::steady_clock::now();
+    for (int pass = 0; pass < samples; pass += 16) {
+        gradient.render_pass(&pool, cam, world, accumulated, REFERENCE_FIRST_PASS + uint64_t(pass),
+                             std::min(16, samples - pass));
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cerr << scene.name << ": " << samples << " samples per pixel in " << seconds << " s\n";
+    return write_pfm(accumulated.resolve(), path);
+}
+
+static vector<convergence_point> measure(colour_gradient &gradient, hittable *world, const camera &cam,
+                                         const framebuffer &reference, double max_seconds, int &threads) {
+    thread_pool pool(gradient.settings.threads);
+    threads = pool.size();
+    accumulation_buffer accumulated(gradient.x_pixels, gradient.y_pixels);
+    int per_pass = gradient.settings.samples_per_pass > 0 ? gradient.settings.samples_per_pass : 1;
+    vector<convergence_point> curve;
+    double seconds = 0;
+    for (int pass = 0; pass < CONVERGENCE_MAX_PASSES && seconds < max_seconds; pass++) {
+        auto start = chrono::steady_clock::now();
+        gradient.render_pass(&pool, cam, world, accumulated, accumulated.next_pass, per_pass);
+        seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        convergence_point point{seconds, double(accumulated.samples), 0, 0};
+        image_error(accumulated.resolve(), reference, point.rmse, point.relmse);
+        curve.push_back(point);
+    }
+    return curve;
+}
+
+static bool parse_budgets(const string &value, vector<double> &budgets) {
+    budgets.clear();
+    std::istringstream list(value);
+    string item;
+    while (std::getline(list, item, ',')) {
+        double seconds = atof(item.c_str());
+        if (!(seconds > 0)) {
+            return false;
+        }
+        budgets.push_back(seconds);
+    }
+    std::sort(budgets.begin(), budgets.end());
+    return !budgets.empty();
+}
+
+static bool read_baseline(const string &path, vector<budget_result> &baseline) {
+    // Only the budget lines of the JSON that write_results() writes are read back, one result per line
+    std::ifstream in(path);
+    if (!in) {
+        return false;
+    }
+    string line;
+    while (std::getline(in, line)) {
+        char scene[64] = {};
+        budget_result r;
+        if (sscanf(line.c_str(), " {\"scene\": \"%63[^\"]\", \"seconds\": %lf, \"spp\": %lf, \"rmse\": %lf, "
+                                 "\"relmse\": %lf", scene, &r.seconds, &r.spp, &r.rmse, &r.relmse) == 5) {
+            r.scene = scene;
+            baseline.push_back(r);
+        }
+    }
+    return true;
+}
+
+static void write_results(FILE *file, const string &options, int threads,
+                          const vector<pair<string, vector<convergence_point>>> &curves,
+                          const vector<budget_result> &results) {
+    fprintf(file, "{\n  \"simd\": \"%s\",\n  \"threads\": %d,\n  \"options\": %s,\n  \"curves\": {\n",
+            simd_level_name(detect_simd_level()), threads, json_string(options).c_str());
+    for (size_t s = 0; s < curves.size(); s++) {
+        fprintf(file, "    \"%s\": [", curves[s].first.c_str());
+        const vector<convergence_point> &curve = curves[s].second;
+        for (size_t i = 0; i < curve.size(); i++) {
+            fprintf(file, "%s[%.5f, %g, %.6g, %.6g]", i ? ", " : "", curve[i].seconds, curve[i].spp, curve[i].rmse,
+                    curve[i].relmse);
+        }
+        fprintf(file, "]%s\n", s + 1 < curves.size() ? "," : "");
+    }
+    fprintf(file, "  },\n  \"budgets\": [\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const budget_result &r = results[i];
+        // Efficiency is the usual figure of merit, one over error times time
+        fprintf(file, "    {\"scene\": \"%s\", \"seconds\": %g, \"spp\": %.2f, \"rmse\": %.6g, \"relmse\": %.6g, "
+                      "\"efficiency\": %.6g}%s\n", r.scene.c_str(), r.seconds, r.spp, r.rmse, r.relmse,
+                1.0 / (r.relmse * r.seconds), i + 1 < results.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+}
+
+int main(int argc, char **argv) {
+    string references_dir = "references";
+    string scenes_dir = ".";
+    string output;
+    string baseline_path;
+    bool make_references = false;
+    int reference_samples = 4096;
+    vector<double> budgets = {0.25, 0.5, 1, 2};
+    int repeats = 3;
+    double tolerance = 0.2;
+    // Renderer options, applied to every scene before it is measured
+    vector<pair<string, string>> options;
+    string option_text;
+    for (int i = 1; i < argc; i++) {
+        string name = argv[i];
+        if (name == "--make-references") {
+            make_references = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            cerr << "Missing a value for " << name << "\n";
+            return 1;
+        }
+        string value = argv[++i];
+        if (name == "--references") {
+            references_dir = value;
+        } else if (name == "--scenes") {
+            scenes_dir = value;
+        } else if (name == "--output") {
+            output = value;
+        } else if (name == "--baseline") {
+            baseline_path = value;
+        } else if (name == "--reference-samples") {
+            reference_samples = atoi(value.c_str());
+        } else if (name == "--budgets") {
+            if (!parse_budgets(value, budgets)) {
+                cerr << "Bad budgets " << value << ", expected a list of positive seconds such as 0.5,1,2\n";
+                return 1;
+            }
+        } else if (name == "--repeats") {
+            repeats = std::max(1, atoi(value.c_str()));
+        } else if (name == "--tolerance") {
+            tolerance = atof(value.c_str());
+        } else {
+            colour_gradient probe(1, 1, 1);
+            if (probe.set_option(name, value) != option_status::applied) {
+                cerr << "Unknown or bad option " << name << " " << value << "\n";
+                return 1;
+            }
+            options.push_back({name, value});
+            option_text += (option_text.empty() ? "" : " ") + name + " " + value;
+        }
+    }
+
+    if (make_references) {
+        int threads = 0;
+        for (const auto &option : options) {
+            if (option.first == "--threads") {
+                threads = atoi(option.second.c_str());
+            }
+        }
+        for (const convergence_scene &scene : CONVERGENCE_SCENES) {
+            string path = references_dir + "/" + scene.name + ".pfm";
+            if (!make_reference(scene, scenes_dir, path, reference_samples, threads)) {
+                cerr << "Could not render or write " << path << "\n";
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    vector<budget_result> baseline;
+    if (!baseline_path.empty() && !read_baseline(baseline_path, baseline)) {
+        cerr << "Could not read baseline " << baseline_path << "\n";
+        return 1;
+    }
+
+    vector<pair<string, vector<convergence_point>>> curves;
+    vector<budget_result> results;
+    int threads = 0;
+    for (const convergence_scene &scene : CONVERGENCE_SCENES) {
+        framebuffer reference;
+        string reference_path = references_dir + "/" + scene.name + ".pfm";
+        if (!read_pfm(reference_path, reference) || reference.width != scene.width ||
+            reference.height != scene.height) {
+            cerr << "No usable reference " << reference_path << ", make them with --make-references\n";
+            return 1;
+        }
+        colour_gradient gradient(scene.width, scene.height, 1);
+        gradient.settings.progressive = true;
+        if (!setup_scene(gradient, scene, scenes_dir)) {
+            return 1;
+        }
+        for (const auto &option : options) {
+            gradient.set_option(option.first, option.second);
+        }
+        hittable *world = gradient.build_scene();
+        camera cam = gradient.scene_camera();
+
+        // Every repeat renders the same samples and so gets the same errors pass for pass, only the times differ.
+        // Each pass keeps the quickest time any repeat reached it in, the least disturbed by the rest of the machine
+        vector<convergence_point> curve;
+        for (int repeat = 0; repeat < repeats; repeat++) {
+            vector<convergence_point> run = measure(gradient, world, cam, reference, budgets.back(), threads);
+            if (repeat == 0) {
+                curve = run;
+                continue;
+            }
+            curve.resize(std::min(curve.size(), run.size()));
+            for (size_t i = 0; i < curve.size(); i++) {
+                curve[i].seconds = std::min(curve[i].seconds, run[i].seconds);
+            }
+        }
+        curves.push_back({scene.name, curve});
+        for (double budget : budgets) {
+            convergence_point point = at_time(curve, budget);
+            results.push_back({scene.name, budget, point.spp, point.rmse, point.relmse});
+        }
+    }
+
+    // The table, and the verdict against the baseline
+    bool worse = false;
+    int unmatched = 0;
+    fprintf(stderr, "%-14s %8s %9s %10s %10s %12s\n", "scene", "seconds", "spp", "rmse", "relmse", "vs baseline");
+    for (const budget_result &r : results) {
+        string change;
+        bool matched = false;
+        for (const budget_result &b : baseline) {
+            if (b.scene == r.scene && std::fabs(b.seconds - r.seconds) < 1e-9) {
+                bool got_worse = r.relmse > b.relmse * (1 + tolerance);
+                char text[32];
+                snprintf(text, sizeof(text), "%+.1f%%%s", b.relmse > 0 ? (r.relmse / b.relmse - 1) * 100 : 0.0,
+                         got_worse ? " WORSE" : "");
+                change = text;
+                worse = worse || got_worse;
+                matched = true;
+            }
+        }
+        // A result the baseline says nothing about cannot be shown to be no worse
+        if (!baseline_path.empty() && !matched) {
+            change = "MISSING";
+            unmatched++;
+        }
+        fprintf(stderr, "%-14s %8g %9.1f %10.5f %10.6f %12s\n", r.scene.c_str(), r.seconds, r.spp, r.rmse, r.relmse,
+                change.c_str());
+    }
+
+    FILE *file = output.empty() ? stdout : fopen(output.c_str(), "w");
+    if (!file) {
+        cerr << "Could not open " << output << "\n";
+        return 1;
+    }
+    write_results(file, option_text, threads, curves, results);
+    if (file != stdout) {
+        fclose(file);
+    }
+    if (unmatched > 0) {
+        cerr << unmatched << " results have no entry in the baseline, compare runs with the same scenes and budgets\n";
+    }
+    if (worse) {
+        cerr << "Error at equal time is more than " << tolerance * 100 << "% worse than the baseline\n";
+    }
+    return worse || unmatched > 0 ? 1 : 0;
+}
@@ -1,8 +1,89 @@
 
 #include <src/colour_gradient.h>
+#include <src/render_server.h>
+#include <cstring>
 
-int main() {
-    auto * gradient = new colour_gradient(1600, 800, 10);
-//    gradient->draw_diagonal_gradient("Gradient.ppm", 255);
-    gradient->draw_random_scene("Random Scene.ppm");
-}
\ No newline at end of file
+int main(int argc, char **argv) {
+    colour_gradient gradient(1600, 800, 10);
+    string output = "Random Scene.ppm";
+    string compiled_scene;
+    string serve;
+    string scene_path;
+
+    // --scene FILE renders a text scene or a scene cache instead of the random scene. It is loaded before the
+    // other options so that they can override the image size, samples and seed it sets
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--scene") == 0) {
+            scene_path = argv[i + 1];
+            if (!gradient.load_scene(scene_path)) {
+                return 1;
+            }
+        }
+    }
+
+    // Optional overrides: --width N, --height N, --samples N,
+    // --threads N (0 uses every core), --workers N (worker processes, 0 for none), --tile-size N, --seed N,
+    // --output FILE (.ppm, .pfm or .png),
+    // --progressive 1, --samples-per-pass N, --preview-every N, --checkpoint FILE, --checkpoint-interval SECONDS,
+    // --resume 1, --integrator recursive|wavefront, --max-depth N, --roulette-depth N (0 for no Russian roulette),
+    // --light-sampling 0 (leave lights to the paths that hit them), --matte 1, --scene-layout data|objects,
+    // --sampler sobol|halton|blue-noise|independent,
+    // --adaptive 1, --min-spp N, --max-spp N, --noise-threshold X,
+    // --denoise 1, --aovs 1 (write the normal, albedo and depth buffers next to the image),
+    // --frames N (render an animated sequence, the output name gets the frame number, see frame_filename()),
+    // --crop X,Y,WIDTH,HEIGHT (render and write only that part of the image, counted from its top left corner),
+    // --compile-scene FILE (write the scene as a scene cache and exit instead of rendering),
+    // --serve SOCKET (keep running and render jobs sent over a Unix domain socket, or stdin for -, see
+    // render_server)
+    for (int i = 1; i < argc; i += 2) {
+        if (i + 1 >= argc) {
+            cerr << "Missing a value for " << argv[i] << "\n";
+            return 1;
+        }
+        if (strcmp(argv[i], "--scene") == 0) {
+            continue;
+        } else if (strcmp(argv[i], "--output") == 0) {
+            output = argv[i + 1];
+        } else if (strcmp(argv[i], "--compile-scene") == 0) {
+            compiled_scene = argv[i + 1];
+        } else if (strcmp(argv[i], "--serve") == 0) {
+            serve = argv[i + 1];
+        } else {
+            option_status status = gradient.set_option(argv[i], argv[i + 1]);
+            if (status == option_status::unknown) {
+                cerr << "Unknown option " << argv[i] << "\n";
+            }
+            if (status != option_status::applied) {
+                return 1;
+            }
+        }
+    }
+
+    int x_begin, y_begin, x_end, y_end;
+    if (!gradient.crop_bounds(x_begin, y_begin, x_end, y_end)) {
+        cerr << "The crop window does not fit in the " << gradient.x_pixels << "x" << gradient.y_pixels << " image\n";
+        return 1;
+    }
+
+    if (!serve.empty()) {
+        render_server server(gradient, scene_path);
+        return (serve == "-" ? server.serve_stdio() : server.serve_socket(serve)) ? 0 : 1;
+    }
+
+    if (!compiled_scene.empty()) {
+        if (!gradient.compile_scene(compiled_scene)) {
+            cerr << "Could not write scene cache " << compiled_scene << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+//    gradient.draw_diagonal_gradient("Gradient.ppm", 255);
+    if (gradient.sequence_frames() > 0) {
+        gradient.draw_sequence(output);
+    } else if (!gradient.draw_random_scene(output)) {
+        return 1;
+    }
+    // Images are written in the background, wait for them so that a write that failed fails the run
+    return gradient.wait_for_writes() ? 0 : 1;
+}
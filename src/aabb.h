@@ -0,0 +1,74 @@
+
+#ifndef RAY_TRACING_AABB_H
+#define RAY_TRACING_AABB_H
+
+#include <limits>
+#include "ray.h"
+
+class aabb {
+    // Axis aligned bounding box, stored as its minimum and maximum corners.
+    // A default constructed box is empty (inverted), so that expanding it by anything gives that thing's box
+public:
+    aabb() : minimum(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(),
+                     std::numeric_limits<float>::max()),
+             maximum(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(),
+                     -std::numeric_limits<float>::max()) {}
+
+    aabb(const vec3 &a, const vec3 &b) : minimum(a), maximum(b) {}
+
+    vec3 min() const { return minimum; }
+    vec3 max() const { return maximum; }
+
+    inline void expand(const vec3 &p);
+
+    inline void expand(const aabb &box);
+
+    vec3 centroid() const { return 0.5f * (minimum + maximum); }
+
+    inline float surface_area() const;
+
+    // Slab test: clip the ray's parameter range against the three pairs of planes of the box.
+    // inv_direction is 1 / r.direction() per component, computed once per ray by the caller
+    inline bool hit(const vec3 &origin, const vec3 &inv_direction, float t_min, float t_max) const;
+
+    vec3 minimum;
+    vec3 maximum;
+};
+
+inline void aabb::expand(const vec3 &p) {
+    minimum = min_components(p, minimum);
+    maximum = max_components(p, maximum);
+}
+
+inline void aabb::expand(const aabb &box) {
+    minimum = min_components(box.minimum, minimum);
+    maximum = max_components(box.maximum, maximum);
+}
+
+inline float aabb::surface_area() const {
+    vec3 d = maximum - minimum;
+    if (d[0] < 0 || d[1] < 0 || d[2] < 0) {
+        return 0;
+    }
+    return 2 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+}
+
+inline bool aabb::hit(const vec3 &origin, const vec3 &inv_direction, float t_min, float t_max) const {
+    // All three slabs at once, one lane each
+    vec3 t0 = (minimum - origin) * inv_direction;
+    vec3 t1 = (maximum - origin) * inv_direction;
+    vec3 near(lanes_select_negative(inv_direction.v, t1.v, t0.v));
+    vec3 far(lanes_select_negative(inv_direction.v, t0.v, t1.v));
+    // Written so that a NaN (ray parallel to and lying on a slab plane) keeps the old bounds
+    near = max_components(near, vec3(t_min, t_min, t_min));
+    far = min_components(far, vec3(t_max, t_max, t_max));
+    return lanes_max3(near.v) <= lanes_min3(far.v);
+}
+
+inline aabb surrounding_box(const aabb &box0, const aabb &box1) {
+    aabb box = box0;
+    box.expand(box1);
+    return box;
+}
+
+#endif //RAY_TRACING_AABB_H
@@ -0,0 +1,221 @@
+
+#ifndef RAY_TRACING_ACCUMULATION_BUFFER_H
+#define RAY_TRACING_ACCUMULATION_BUFFER_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+#include "framebuffer.h"
+
+// Written at the start of every checkpoint so that a file from another version or a machine
+// with a different byte order is rejected instead of being misread
+const char CHECKPOINT_MAGIC[8] = {'R', 'T', 'C', 'K', 'P', 'T', '0', '3'};
+const uint32_t CHECKPOINT_BYTE_ORDER = 0x01020304u;
+
+// What load_checkpoint() made of a checkpoint file: loaded, not there (or unreadable), or the checkpoint of a
+// render that cannot be carried on with these settings
+enum class checkpoint_status { loaded, missing, rejected };
+
+struct checkpoint_header {
+    char magic[8];
+    uint32_t byte_order;
+    int32_t width;
+    int32_t height;
+    // Samples per pixel of each pass. Pass p takes the sample indices from p times this on, so a resume with
+    // another value would take samples that are already in the buffer again
+    uint32_t samples_per_pass;
+    // Seed of the scene and of the pixel streams
+    uint64_t seed;
+    // Random number state: the samplers of pass p follow from the seed, the sampler kind and p
+    // (colour_gradient::pass_sampling()), so with the samples per pass those and the index of the next pass are
+    // all that is needed to carry on with the same numbers
+    uint64_t next_pass;
+    // Samples per pixel accumulated by passes that covered every pixel
+    uint64_t samples;
+    // The sampler_kind the samples were taken with
+    uint32_t sampler;
+    uint32_t pad;
+};
+
+struct pixel_stats {
+    // Number of samples of this pixel, with the running mean and sum of squared deviations of their
+    // luminance (Welford's method), which give the variance used by the adaptive sampler
+    uint32_t samples = 0;
+    float mean = 0;
+    float m2 = 0;
+
+    void add(float luminance) {
+        samples++;
+        float delta = luminance - mean;
+        mean += delta / float(samples);
+        m2 += delta * (luminance - mean);
+    }
+
+    // Combine with the statistics of a separate set of samples of the same pixel (Chan et al.)
+    void merge(const pixel_stats &other) {
+        if (other.samples == 0) {
+            return;
+        }
+        if (samples == 0) {
+            *this = other;
+            return;
+        }
+        uint32_t total = samples + other.samples;
+        float delta = other.mean - mean;
+        mean += delta * float(other.samples) / float(total);
+        m2 += other.m2 + delta * delta * float(samples) * float(other.samples) / float(total);
+        samples = total;
+    }
+
+    // Standard error of the mean relative to the mean, infinite until there are two samples.
+    // The small floor keeps near black pixels from looking endlessly noisy
+    float relative_error() const {
+        if (samples < 2) {
+            return std::numeric_limits<float>::infinity();
+        }
+        float variance = m2 / float(samples - 1);
+        return std::sqrt(variance / float(samples)) / (mean > 0.01f ? mean : 0.01f);
+    }
+};
+
+inline float luminance(const vec3 &col) {
+    return 0.2126f * col[0] + 0.7152f * col[1] + 0.0722f * col[2];
+}
+
+inline uint64_t pass_seed(uint64_t seed, uint64_t pass) {
+    // Pass 0 uses the plain seed, so a one pass render matches a non-progressive one
+    return seed + pass * 0x9E3779B97F4A7C15ULL;
+}
+
+class accumulation_buffer {
+    // Running per pixel sums of every sample rendered so far, in float, along with per pixel sample counts
+    // and luminance statistics. Progressive renders add one pass at a time and divide by the sample counts
+    // whenever they want an image; adaptive renders also use the statistics to choose which pixels to sample
+public:
+    accumulation_buffer(int w, int h)
+            : width(w), height(h), sum(size_t(w) * size_t(h), vec3(0, 0, 0)), stats(size_t(w) * size_t(h)) {}
+
+    // Same layout as framebuffer: rows from the top, x left to right and y bottom to top
+    size_t index(int x, int y) const { return size_t(height - 1 - y) * width + x; }
+    vec3 &at(int x, int y) { return sum[index(x, y)]; }
+
+    inline framebuffer resolve() const;
+
+    // Copy of the pixels in [x_begin, x_end) x [y_begin, y_end), for rendering a crop window
+    inline accumulation_buffer window(int x_begin, int y_begin, int x_end, int y_end) const;
+
+    // The seed, samples per pass and sampler kind are stored with the buffer, and load_checkpoint() rejects a
+    // checkpoint that does not have the same ones, reporting to cerr why
+    inline bool save_checkpoint(const std::string &path, uint64_t seed, uint32_t samples_per_pass,
+                                uint32_t sampler) const;
+
+    inline checkpoint_status load_checkpoint(const std::string &path, uint64_t seed, uint32_t samples_per_pass,
+                                             uint32_t sampler);
+
+    int width;
+    int height;
+    std::vector<vec3> sum;
+    std::vector<pixel_stats> stats;
+    uint64_t samples = 0;
+    uint64_t next_pass = 0;
+};
+
+inline framebuffer accumulation_buffer::resolve() const {
+    framebuffer image(width, height);
+    for (size_t i = 0; i < sum.size(); i++) {
+        image.pixels[i] = stats[i].samples > 0 ? sum[i] / float(stats[i].samples) : vec3(0, 0, 0);
+    }
+    return image;
+}
+
+inline accumulation_buffer accumulation_buffer::window(int x_begin, int y_begin, int x_end, int y_end) const {
+    accumulation_buffer part(x_end - x_begin, y_end - y_begin);
+    part.samples = samples;
+    part.next_pass = next_pass;
+    for (int y = y_begin; y < y_end; y++) {
+        for (int x = x_begin; x < x_end; x++) {
+            size_t from = index(x, y);
+            size_t to = part.index(x - x_begin, y - y_begin);
+            part.sum[to] = sum[from];
+            part.stats[to] = stats[from];
+        }
+    }
+    return part;
+}
+
+inline bool accumulation_buffer::save_checkpoint(const std::string &path, uint64_t seed, uint32_t samples_per_pass,
+                                                 uint32_t sampler) const {
+    // Write to a temporary file and rename it over the old checkpoint, so a job killed half way
+    // through a write still leaves the previous checkpoint intact
+    checkpoint_header header{};
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.byte_order = CHECKPOINT_BYTE_ORDER;
+    header.width = width;
+    header.height = height;
+    header.samples_per_pass = samples_per_pass;
+    header.seed = seed;
+    header.next_pass = next_pass;
+    header.samples = samples;
+    header.sampler = sampler;
+
+    std::string temp_path = path + ".tmp";
+    FILE *file = fopen(temp_path.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (size_t i = 0; ok && i < sum.size(); i++) {
+        float values[3] = {sum[i][0], sum[i][1], sum[i][2]};
+        ok = fwrite(values, sizeof(float), 3, file) == 3 && fwrite(&stats[i], sizeof(pixel_stats), 1, file) == 1;
+    }
+    ok = fclose(file) == 0 && ok;
+    return ok && rename(temp_path.c_str(), path.c_str()) == 0;
+}
+
+inline checkpoint_status accumulation_buffer::load_checkpoint(const std::string &path, uint64_t seed,
+                                                              uint32_t samples_per_pass, uint32_t sampler) {
+    // Only accept a checkpoint of the same image size, seed, samples per pass and sampler, anything else would
+    // mix two different renders or take the same samples twice
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file) {
+        return checkpoint_status::missing;
+    }
+    checkpoint_header header{};
+    bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+              memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) == 0 &&
+              header.byte_order == CHECKPOINT_BYTE_ORDER;
+    const char *mismatch = !ok ? "it is not a checkpoint of this version"
+                         : header.width != width || header.height != height ? "the image size differs"
+                         : header.seed != seed ? "the seed differs"
+                         : header.samples_per_pass != samples_per_pass ? "the samples per pass differ"
+                         : header.sampler != sampler ? "the sampler differs" : nullptr;
+    if (mismatch) {
+        std::cerr << "Not resuming from " << path << ": " << mismatch << "\n";
+        fclose(file);
+        return checkpoint_status::rejected;
+    }
+    std::vector<vec3> loaded(sum.size());
+    std::vector<pixel_stats> loaded_stats(stats.size());
+    for (size_t i = 0; ok && i < loaded.size(); i++) {
+        float values[3];
+        ok = fread(values, sizeof(float), 3, file) == 3 && fread(&loaded_stats[i], sizeof(pixel_stats), 1, file) == 1;
+        loaded[i] = vec3(values[0], values[1], values[2]);
+    }
+    fclose(file);
+    if (!ok) {
+        std::cerr << "Not resuming from " << path << ": it is cut short\n";
+        return checkpoint_status::rejected;
+    }
+    sum = std::move(loaded);
+    stats = std::move(loaded_stats);
+    samples = header.samples;
+    next_pass = header.next_pass;
+    return checkpoint_status::loaded;
+}
+
+#endif //RAY_TRACING_ACCUMULATION_BUFFER_H
@@ -0,0 +1,126 @@
+
+#ifndef RAY_TRACING_ANIMATION_H
+#define RAY_TRACING_ANIMATION_H
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "camera.h"
+
+struct camera_keyframe {
+    // Where the camera is at a frame. The up vector stays the one of the still camera
+    float frame;
+    vec3 lookfrom;
+    vec3 lookat;
+    float vertical_fov;
+    float aperture;
+    float focus_dist;
+};
+
+struct position_keyframe {
+    float frame;
+    vec3 center;
+};
+
+struct object_track {
+    // Path of one sphere, which is picked by its position in the order the scene added its spheres
+    int object;
+    std::vector<position_keyframe> keys;
+};
+
+template<typename T>
+inline T catmull_rom(const T &p0, const T &p1, const T &p2, const T &p3, float t) {
+    // Curve through p1 at t = 0 and p2 at t = 1 whose tangents there point from p0 to p2 and from p1 to p3,
+    // so a path through a row of keys has no kinks at the keys
+    float t2 = t * t;
+    float t3 = t2 * t;
+    return 0.5f * ((2.0f * p1) + (p2 - p0) * t + (2.0f * p0 - 5.0f * p1 + 4.0f * p2 - p3) * t2 +
+                   (3.0f * p1 - p0 - 3.0f * p2 + p3) * t3);
+}
+
+template<typename Key, typename T>
+inline T sample_keys(const std::vector<Key> &keys, float frame, T Key::*value) {
+    // Value of one field of a list of keys sorted by frame. Before the first key and after the last one
+    // it holds still, in between it follows a Catmull-Rom curve through the keys
+    if (frame <= keys.front().frame) {
+        return keys.front().*value;
+    }
+    if (frame >= keys.back().frame) {
+        return keys.back().*value;
+    }
+    size_t i = 0;
+    while (keys[i + 1].frame <= frame) {
+        i++;
+    }
+    size_t before = i > 0 ? i - 1 : i;
+    size_t after = i + 2 < keys.size() ? i + 2 : i + 1;
+    float t = (frame - keys[i].frame) / (keys[i + 1].frame - keys[i].frame);
+    return catmull_rom(keys[before].*value, keys[i].*value, keys[i + 1].*value, keys[after].*value, t);
+}
+
+struct animation {
+    // Keyframed camera and sphere motion of a sequence. Frames are numbered from 0 and keys can sit
+    // at any frame, including between two frames
+    int frames = 0;
+    // Sorted by frame
+    std::vector<camera_keyframe> camera_keys;
+    // One track per moving sphere, each sorted by frame
+    std::vector<object_track> tracks;
+
+    bool empty() const {
+        return camera_keys.empty() && tracks.empty();
+    }
+
+    // Sort the keys by frame, as sample_keys() needs them
+    void sort_keys() {
+        auto by_frame = [](const camera_keyframe &a, const camera_keyframe &b) { return a.frame < b.frame; };
+        std::stable_sort(camera_keys.begin(), camera_keys.end(), by_frame);
+        for (object_track &track : tracks) {
+            std::stable_sort(track.keys.begin(), track.keys.end(),
+                             [](const position_keyframe &a, const position_keyframe &b) { return a.frame < b.frame; });
+        }
+    }
+
+    // The camera at a frame, or the still one if the camera has no keys
+    camera_settings camera_at(float frame, const camera_settings &still) const {
+        if (camera_keys.empty()) {
+            return still;
+        }
+        camera_settings view = still;
+        view.lookfrom = sample_keys(camera_keys, frame, &camera_keyframe::lookfrom);
+        view.lookat = sample_keys(camera_keys, frame, &camera_keyframe::lookat);
+        view.vertical_fov = sample_keys(camera_keys, frame, &camera_keyframe::vertical_fov);
+        view.aperture = std::max(0.0f, sample_keys(camera_keys, frame, &camera_keyframe::aperture));
+        view.focus_dist = sample_keys(camera_keys, frame, &camera_keyframe::focus_dist);
+        return view;
+    }
+
+    vec3 position_at(const object_track &track, float frame) const {
+        return sample_keys(track.keys, frame, &position_keyframe::center);
+    }
+};
+
+inline std::string frame_filename(const std::string &pattern, int frame) {
+    // A run of # in the pattern becomes the frame number padded with zeros to its length, as in frame_###.png.
+    // Without one, four digits go in front of the extension: shot.png becomes shot_0007.png
+    size_t first = pattern.find('#');
+    char digits[32];
+    if (first == std::string::npos) {
+        size_t slash = pattern.find_last_of('/');
+        size_t dot = pattern.find_last_of('.');
+        if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+            dot = pattern.size();
+        }
+        snprintf(digits, sizeof(digits), "_%04d", frame);
+        return pattern.substr(0, dot) + digits + pattern.substr(dot);
+    }
+    size_t last = pattern.find_first_not_of('#', first);
+    if (last == std::string::npos) {
+        last = pattern.size();
+    }
+    snprintf(digits, sizeof(digits), "%0*d", int(last - first), frame);
+    return pattern.substr(0, first) + digits + pattern.substr(last);
+}
+
+#endif //RAY_TRACING_ANIMATION_H
@@ -0,0 +1,137 @@
+
+#ifndef RAY_TRACING_AOV_H
+#define RAY_TRACING_AOV_H
+
+#include <limits>
+#include <string>
+#include <vector>
+#include "framebuffer.h"
+#include "sampler.h"
+#include "ray.h"
+#include "sky.h"
+
+// Camera rays per pixel for the feature buffers. They only go as far as the first hit, so a few of them
+// cost little next to the paths, and they are enough to anti-alias the edges the denoiser stops at
+const int AOV_SAMPLES = 2;
+// Mirrors a feature ray follows before it settles for what it hits
+const int AOV_SPECULAR_BOUNCES = 4;
+
+struct aov_buffers {
+    // Arbitrary output variables: what the camera rays of each pixel see, averaged over the samples and laid
+    // out like a framebuffer. Rays that miss everything add a zero normal, the sky colour as albedo and a
+    // depth of 0
+    aov_buffers() = default;
+
+    aov_buffers(int w, int h) : width(w), height(h), normal(size_t(w) * size_t(h), vec3(0, 0, 0)),
+                                albedo(size_t(w) * size_t(h), vec3(0, 0, 0)), depth(size_t(w) * size_t(h), 0.0f) {}
+
+    size_t index(int x, int y) const { return size_t(height - 1 - y) * width + x; }
+
+    // Copy of the pixels in [x_begin, x_end) x [y_begin, y_end), see accumulation_buffer::window()
+    inline aov_buffers window(int x_begin, int y_begin, int x_end, int y_end) const;
+
+    // Normals mapped from -1 to 1 onto 0 to 1, written without gamma
+    inline framebuffer normal_image() const;
+
+    inline framebuffer albedo_image() const;
+
+    // Distances divided by the largest one, so that 8 bit formats can show them, written without gamma
+    inline framebuffer depth_image() const;
+
+    int width = 0;
+    int height = 0;
+    std::vector<vec3> normal;
+    std::vector<vec3> albedo;
+    // Distance from the camera along the ray
+    std::vector<float> depth;
+};
+
+template<typename Scene>
+inline void first_hit_features(const ray &camera_ray, const Scene &world, sampler &rng, vec3 &normal, vec3 &albedo,
+                               float &depth) {
+    // Normal facing the camera, albedo and distance of what a camera ray sees first. Mirrors have nothing
+    // to show of their own, so the ray follows them, up to AOV_SPECULAR_BOUNCES times, to the surface they
+    // show, tinting its albedo with theirs. The depth stays the distance to the first hit
+    ray r = camera_ray;
+    vec3 tint(1, 1, 1);
+    normal = vec3(0, 0, 0);
+    depth = 0;
+    for (int bounce = 0;; bounce++) {
+        typename Scene::record_type record;
+        if (!world.intersect(r, 0.001, std::numeric_limits<float>::max(), record)) {
+            normal = vec3(0, 0, 0);
+            albedo = tint * sky_color(r);
+            return;
+        }
+        if (bounce == 0) {
+            depth = record.t * r.direction().length();
+        }
+        normal = dot(record.normal, r.direction()) > 0 ? -record.normal : record.normal;
+        vec3 attenuation;
+        ray scattered;
+        rng.start_bounce(bounce);
+        if (bounce < AOV_SPECULAR_BOUNCES && world.specular(record) &&
+            world.scatter(r, record, attenuation, scattered, rng)) {
+            tint *= attenuation;
+            r = scattered;
+            continue;
+        }
+        albedo = tint * world.albedo(record);
+        return;
+    }
+}
+
+inline aov_buffers aov_buffers::window(int x_begin, int y_begin, int x_end, int y_end) const {
+    aov_buffers part(x_end - x_begin, y_end - y_begin);
+    for (int y = y_begin; y < y_end; y++) {
+        for (int x = x_begin; x < x_end; x++) {
+            size_t from = index(x, y);
+            size_t to = part.index(x - x_begin, y - y_begin);
+            part.normal[to] = normal[from];
+            part.albedo[to] = albedo[from];
+            part.depth[to] = depth[from];
+        }
+    }
+    return part;
+}
+
+inline framebuffer aov_buffers::normal_image() const {
+    framebuffer image(width, height);
+    image.gamma = 1.0f;
+    for (size_t i = 0; i < normal.size(); i++) {
+        image.pixels[i] = 0.5f * (normal[i] + vec3(1, 1, 1));
+    }
+    return image;
+}
+
+inline framebuffer aov_buffers::albedo_image() const {
+    framebuffer image(width, height);
+    image.pixels = albedo;
+    return image;
+}
+
+inline framebuffer aov_buffers::depth_image() const {
+    framebuffer image(width, height);
+    image.gamma = 1.0f;
+    float farthest = 0;
+    for (float d : depth) {
+        farthest = d > farthest ? d : farthest;
+    }
+    for (size_t i = 0; i < depth.size(); i++) {
+        float d = farthest > 0 ? depth[i] / farthest : 0.0f;
+        image.pixels[i] = vec3(d, d, d);
+    }
+    return image;
+}
+
+inline std::string aov_filename(const std::string &image_filename, const std::string &name) {
+    // scene.png with name normal gives scene.normal.png
+    size_t dot = image_filename.find_last_of('.');
+    size_t slash = image_filename.find_last_of('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        return image_filename + "." + name;
+    }
+    return image_filename.substr(0, dot) + "." + name + image_filename.substr(dot);
+}
+
+#endif //RAY_TRACING_AOV_H
@@ -0,0 +1,409 @@
+
+#ifndef RAY_TRACING_BVH_H
+#define RAY_TRACING_BVH_H
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <vector>
+#include "aabb.h"
+#include "hittable.h"
+#include "packed_spheres.h"
+
+struct bvh_node {
+    // 32 bytes, so two nodes share a cache line. The box is kept as six plain floats rather than an aabb, whose
+    // two padded vec3s alone would take 32; box() and set_box() convert
+    float lower[3];
+    float upper[3];
+    // Leaf: position of the first primitive in the leaf ordered primitive list
+    // Interior: index of the second child, the first child always directly follows its parent
+    int32_t offset;
+    // Number of primitives in a leaf, 0 for interior nodes
+    uint16_t count;
+    // Axis the children were split along, used to visit the nearer child first
+    uint8_t axis;
+    uint8_t pad;
+
+    // What traverse_bvh() asks of a node, so that it can also walk nodes stored in other forms
+    bool box_hit(const vec3 &origin, const vec3 &inv_direction, float t_min, float t_max) const {
+        return box().hit(origin, inv_direction, t_min, t_max);
+    }
+    aabb box() const { return aabb(vec3::load(lower), vec3::load(upper)); }
+    void set_box(const aabb &b) {
+        for (int a = 0; a < 3; a++) {
+            lower[a] = b.minimum[a];
+            upper[a] = b.maximum[a];
+        }
+    }
+    int primitives() const { return count; }
+    int link() const { return offset; }
+    int split_axis() const { return axis; }
+};
+
+// Relative costs of visiting a node and of testing a primitive, used by the surface area heuristic
+const float BVH_TRAVERSAL_COST = 1.0f;
+const float BVH_INTERSECTION_COST = 1.0f;
+// Number of buckets the centroids are binned into when looking for the cheapest split
+const int BVH_BIN_COUNT = 16;
+// Beyond this depth splits fall back to halving the primitives, which bounds the traversal stack
+const int BVH_MAX_SAH_DEPTH = 64;
+const int BVH_STACK_SIZE = 128;
+
+class bvh_builder {
+    // Builds a flattened bounding volume hierarchy over a list of boxes with binned SAH splits.
+    // The result is a node array in depth first order plus the order in which leaves reference the
+    // input boxes; the builder knows nothing about what the boxes contain, so any primitive type can use it.
+    // batch_width is how many primitives a leaf tests for the price of one (the SIMD width of packed leaves)
+public:
+    bvh_builder(const std::vector<aabb> &boxes, int max_leaf_size, int batch_width = 1)
+            : leaf_size(max_leaf_size), width(batch_width > 0 ? batch_width : 1) {
+        if (leaf_size < 1) {
+            leaf_size = 1;
+        }
+        if (leaf_size > 255) {
+            leaf_size = 255;
+        }
+        for (int i = 0; i < int(boxes.size()); i++) {
+            items.push_back({boxes[i], boxes[i].centroid(), i});
+        }
+        if (!items.empty()) {
+            nodes.reserve(2 * items.size());
+            build(0, int(items.size()), 0);
+        }
+        for (const build_item &item : items) {
+            order.push_back(item.index);
+        }
+    }
+
+    std::vector<bvh_node> nodes;
+    // order[i] is the index of the input box stored at position i of the leaves
+    std::vector<int> order;
+
+private:
+    struct build_item {
+        aabb box;
+        vec3 centroid;
+        int index;
+    };
+
+    struct bin {
+        aabb box;
+        int count = 0;
+    };
+
+    inline int build(int begin, int end, int depth);
+
+    inline int make_leaf(int node_index, int begin, int end);
+
+    inline int partition_by_bins(int begin, int end, int axis, const aabb &centroid_box, int &split) const;
+
+    // Number of intersection tests needed for n primitives in one leaf
+    int batches(int n) const { return (n + width - 1) / width; }
+
+    std::vector<build_item> items;
+    int leaf_size;
+    int width;
+};
+
+inline int bvh_builder::make_leaf(int node_index, int begin, int end) {
+    nodes[node_index].offset = begin;
+    nodes[node_index].count = uint16_t(end - begin);
+    return node_index;
+}
+
+inline int bvh_builder::partition_by_bins(int begin, int end, int axis, const aabb &centroid_box, int &split) const {
+    // Picks the cheapest bin boundary into split and returns how many items fall right of it,
+    // or -1 if the SAH says a leaf is cheaper than any split
+    float lo = centroid_box.minimum[axis];
+    float extent = centroid_box.maximum[axis] - lo;
+    float scale = BVH_BIN_COUNT / extent;
+
+    bin bins[BVH_BIN_COUNT];
+    for (int i = begin; i < end; i++) {
+        int b = int((items[i].centroid[axis] - lo) * scale);
+        b = b < BVH_BIN_COUNT ? b : BVH_BIN_COUNT - 1;
+        bins[b].count++;
+        bins[b].box.expand(items[i].box);
+    }
+
+    // Sweep from the right to get the area and count of everything right of each split plane,
+    // then sweep from the left and price every plane
+    float right_area[BVH_BIN_COUNT];
+    int right_count[BVH_BIN_COUNT];
+    aabb right_box;
+    int count = 0;
+    for (int b = BVH_BIN_COUNT - 1; b > 0; b--) {
+        right_box.expand(bins[b].box);
+        count += bins[b].count;
+        right_area[b] = right_box.surface_area();
+        right_count[b] = count;
+    }
+
+    aabb node_box;
+    for (int i = begin; i < end; i++) {
+        node_box.expand(items[i].box);
+    }
+    float node_area = node_box.surface_area();
+
+    float best_cost = std::numeric_limits<float>::max();
+    aabb left_box;
+    count = 0;
+    for (int b = 0; b < BVH_BIN_COUNT - 1; b++) {
+        left_box.expand(bins[b].box);
+        count += bins[b].count;
+        if (count == 0 || right_count[b + 1] == 0) {
+            continue;
+        }
+        float cost = left_box.surface_area() * batches(count) + right_area[b + 1] * batches(right_count[b + 1]);
+        if (cost < best_cost) {
+            best_cost = cost;
+            split = b;
+        }
+    }
+
+    int n = end - begin;
+    float leaf_cost = BVH_INTERSECTION_COST * batches(n);
+    float split_cost = node_area > 0 ? BVH_TRAVERSAL_COST + BVH_INTERSECTION_COST * best_cost / node_area
+                                     : BVH_TRAVERSAL_COST + leaf_cost;
+    if (best_cost == std::numeric_limits<float>::max() || (n <= leaf_size && leaf_cost <= split_cost)) {
+        return -1;
+    }
+    return right_count[split + 1];
+}
+
+inline int bvh_builder::build(int begin, int end, int depth) {
+    int node_index = int(nodes.size());
+    nodes.push_back(bvh_node());
+    aabb box;
+    for (int i = begin; i < end; i++) {
+        box.expand(items[i].box);
+    }
+    bvh_node node{};
+    node.set_box(box);
+    nodes[node_index] = node;
+
+    int n = end - begin;
+    if (n == 1) {
+        return make_leaf(node_index, begin, end);
+    }
+
+    aabb centroid_box;
+    for (int i = begin; i < end; i++) {
+        centroid_box.expand(items[i].centroid);
+    }
+    vec3 extent = centroid_box.maximum - centroid_box.minimum;
+    int axis = 0;
+    if (extent[1] > extent[axis]) axis = 1;
+    if (extent[2] > extent[axis]) axis = 2;
+
+    int mid;
+    if (extent[axis] <= 0 || depth >= BVH_MAX_SAH_DEPTH) {
+        // All centroids coincide (or the tree is already very deep): no plane separates them,
+        // so keep small groups together and cut large ones in half by position in the list
+        if (n <= leaf_size) {
+            return make_leaf(node_index, begin, end);
+        }
+        mid = begin + n / 2;
+    } else {
+        int split = 0;
+        int right = partition_by_bins(begin, end, axis, centroid_box, split);
+        if (right < 0) {
+            return make_leaf(node_index, begin, end);
+        }
+        float lo = centroid_box.minimum[axis];
+        float scale = BVH_BIN_COUNT / extent[axis];
+        auto in_left = [&](const build_item &item) {
+            int b = int((item.centroid[axis] - lo) * scale);
+            b = b < BVH_BIN_COUNT ? b : BVH_BIN_COUNT - 1;
+            return b <= split;
+        };
+        mid = int(std::partition(items.begin() + begin, items.begin() + end, in_left) - items.begin());
+        if (mid == begin || mid == end) {
+            mid = begin + n / 2;
+        }
+    }
+
+    build(begin, mid, depth + 1);
+    int second = build(mid, end, depth + 1);
+    nodes[node_index].offset = second;
+    nodes[node_index].count = 0;
+    nodes[node_index].axis = uint8_t(axis);
+    return node_index;
+}
+
+
+template<bool AnyHit = false, typename Node, typename LeafTest>
+inline bool traverse_bvh(const Node *nodes, const ray &r, float t_min, float &t_max, LeafTest &&leaf_test) {
+    // Closest hit walk over a flattened node array. leaf_test(first, count, t_max) tests the primitives of a leaf,
+    // lowers t_max to the closest hit it finds and returns whether it found one; t_max then prunes the rest of
+    // the walk. Shared by every structure built with bvh_builder, whatever its primitives are, and by any node
+    // layout with the accessors of bvh_node, such as the quantized nodes of a triangle_mesh.
+    // With AnyHit the walk ends at the first leaf that reports a hit, for occlusion queries
+    vec3 origin = r.origin();
+    vec3 direction = r.direction();
+    vec3 inv_direction(1.0f / direction[0], 1.0f / direction[1], 1.0f / direction[2]);
+
+    bool hit_anything = false;
+    int stack[BVH_STACK_SIZE];
+    int stack_size = 0;
+    int current = 0;
+    while (true) {
+        const Node &node = nodes[current];
+        RT_STAT(thread_stats().node_tests++);
+        if (node.box_hit(origin, inv_direction, t_min, t_max)) {
+            int count = node.primitives();
+            if (count > 0) {
+                if (leaf_test(node.link(), count, t_max)) {
+                    if (AnyHit) {
+                        return true;
+                    }
+                    hit_anything = true;
+                }
+            } else {
+                // Descend into the child on the side the ray comes from and come back for the other one,
+                // so that closer hits are found first and shrink t_max for the far subtree
+                if (direction[node.split_axis()] < 0) {
+                    stack[stack_size++] = current + 1;
+                    current = node.link();
+                } else {
+                    stack[stack_size++] = node.link();
+                    current = current + 1;
+                }
+                continue;
+            }
+        }
+        if (stack_size == 0) {
+            break;
+        }
+        current = stack[--stack_size];
+    }
+    return hit_anything;
+}
+
+
+class bvh : public hittable {
+    // Bounding volume hierarchy over a list of hittables.
+    // Rays walk the flattened node array front to back with a small explicit stack, skipping every
+    // subtree whose box they miss, so the number of primitives tested grows with the log of the scene size.
+    // When every primitive is a sphere they are also packed in leaf order into a packed_spheres, and each
+    // leaf is tested with one call to its SIMD kernel instead of a virtual hit per sphere
+public:
+    // max_leaf_size of 0 picks a leaf size to suit the primitives (the SIMD width for packed spheres)
+    bvh(hittable **list, int n, int max_leaf_size = 0) {
+        std::vector<aabb> boxes;
+        std::vector<hittable *> bounded;
+        aabb box;
+        for (int i = 0; i < n; i++) {
+            if (list[i]->bounding_box(box)) {
+                boxes.push_back(box);
+                bounded.push_back(list[i]);
+            } else {
+                unbounded.push_back(list[i]);
+            }
+        }
+
+        bool all_spheres = !bounded.empty();
+        for (hittable *object : bounded) {
+            all_spheres = all_spheres && dynamic_cast<sphere *>(object) != nullptr;
+        }
+        int width = all_spheres ? int(detect_simd_level()) : 1;
+        if (max_leaf_size <= 0) {
+            max_leaf_size = width > 4 ? width : 4;
+        }
+
+        bvh_builder builder(boxes, max_leaf_size, width);
+        nodes = std::move(builder.nodes);
+        for (int index : builder.order) {
+            primitives.push_back(bounded[index]);
+        }
+
+        if (all_spheres) {
+            std::vector<const sphere *> spheres;
+            for (hittable *object : primitives) {
+                spheres.push_back(static_cast<sphere *>(object));
+            }
+            packed.reset(new packed_spheres(spheres));
+        }
+    }
+
+    bool intersect(const ray &r, float t_min, float &t_max, hit_id &id) const override;
+
+    bool occluded(const ray &r, float t_min, float t_max) const override;
+
+    bool bounding_box(aabb &output_box) const override {
+        if (nodes.empty() || !unbounded.empty()) {
+            return false;
+        }
+        output_box = nodes[0].box();
+        return true;
+    }
+
+    std::vector<bvh_node> nodes;
+    // Primitives in the order the leaves reference them
+    std::vector<hittable *> primitives;
+    // Hittables without a bounding box, tested against every ray
+    std::vector<hittable *> unbounded;
+    // Same spheres as primitives, in the same order, if the bvh holds nothing but spheres
+    std::unique_ptr<packed_spheres> packed;
+};
+
+bool bvh::intersect(const ray &r, float t_min, float &t_max, hit_id &id) const {
+    bool hit_anything = false;
+    for (hittable *object : unbounded) {
+        if (object->intersect(r, t_min, t_max, id)) {
+            hit_anything = true;
+        }
+    }
+    if (nodes.empty()) {
+        return hit_anything;
+    }
+
+    if (packed) {
+        // Packed leaves only report the index of the closest sphere, the packed spheres fill in its record
+        return traverse_bvh(nodes.data(), r, t_min, t_max, [&](int first, int count, float &t) {
+            int index = packed->closest_hit(r, first, count, t_min, t);
+            if (index < 0) {
+                return false;
+            }
+            id.object = packed.get();
+            id.inner = nullptr;
+            id.primitive = uint32_t(index);
+            return true;
+        }) || hit_anything;
+    }
+
+    return traverse_bvh(nodes.data(), r, t_min, t_max, [&](int first, int count, float &t) {
+        bool hit_leaf = false;
+        for (int i = first; i < first + count; i++) {
+            if (primitives[i]->intersect(r, t_min, t, id)) {
+                hit_leaf = true;
+            }
+        }
+        return hit_leaf;
+    }) || hit_anything;
+}
+
+bool bvh::occluded(const ray &r, float t_min, float t_max) const {
+    for (hittable *object : unbounded) {
+        if (object->occluded(r, t_min, t_max)) {
+            return true;
+        }
+    }
+    if (nodes.empty()) {
+        return false;
+    }
+    return traverse_bvh<true>(nodes.data(), r, t_min, t_max, [&](int first, int count, float &t) {
+        if (packed) {
+            return packed->closest_hit(r, first, count, t_min, t) >= 0;
+        }
+        for (int i = first; i < first + count; i++) {
+            if (primitives[i]->occluded(r, t_min, t)) {
+                return true;
+            }
+        }
+        return false;
+    });
+}
+
+#endif //RAY_TRACING_BVH_H
@@ -3,13 +3,27 @@
 #define RAY_TRACING_CAMERA_H
 
 #include "ray.h"
+#include "render_stats.h"
+#include "sampler.h"
 
-vec3 random_in_unit_disk() {
-    vec3 p;
-    do {
-        p = 2.0 * vec3(get_random_number_0_to_1(), get_random_number_0_to_1(), 0) - vec3(1, 1, 0);
-    } while (dot(p, p) >= 1.0);
-    return p;
+vec3 random_in_unit_disk(sampler &rng) {
+    // Concentric map of Shirley and Chiu from the square onto the disk: squares around the centre become rings,
+    // so points that are spread out evenly over the square stay spread out evenly over the disk
+    RT_STAT(thread_stats().unit_disk_calls++);
+    float a = 2 * rng.next_float() - 1;
+    float b = 2 * rng.next_float() - 1;
+    if (a == 0 && b == 0) {
+        return vec3(0, 0, 0);
+    }
+    float r, phi;
+    if (a * a > b * b) {
+        r = a;
+        phi = float(M_PI / 4) * (b / a);
+    } else {
+        r = b;
+        phi = float(M_PI / 2) - float(M_PI / 4) * (a / b);
+    }
+    return vec3(r * std::cos(phi), r * std::sin(phi), 0);
 }
 
 
@@ -31,8 +45,8 @@ public:
         vertical = 2 * half_height * focus_dist * v;
     }
 
-    ray get_ray(float s, float t) {
-        vec3 rd = lens_radius * random_in_unit_disk();
+    ray get_ray(float s, float t, sampler &rng) const {
+        vec3 rd = lens_radius * random_in_unit_disk(rng);
         vec3 offset = u * rd.x() + v * rd.y();
         return ray(origin + offset, lower_left_corner + s * horizontal + t * vertical - origin - offset);
     }
@@ -45,4 +59,18 @@ public:
     float lens_radius;
 };
 
+struct camera_settings {
+    // The values a camera is built from, as scene files and keyframes give them
+    vec3 lookfrom = vec3(13, 2, 3);
+    vec3 lookat = vec3(0, 0, 0);
+    vec3 vup = vec3(0, 1, 0);
+    float vertical_fov = 20;
+    float aperture = 0.1f;
+    float focus_dist = 10;
+
+    camera make_camera(float aspect) const {
+        return camera(lookfrom, lookat, vup, vertical_fov, aspect, aperture, focus_dist);
+    }
+};
+
 #endif //RAY_TRACING_CAMERA_H
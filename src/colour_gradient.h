@@ -1,14 +1,32 @@
 
+#include <chrono>
 #include <iostream>
 #include <fstream>
 #include "vec3.h"
 #include "ray.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "bvh.h"
 #include <limits>
 #include "camera.h"
 #include "material.h"
 #include "create_scene.h"
+#include "denoiser.h"
+#include "accumulation_buffer.h"
+#include "animation.h"
+#include "aov.h"
+#include "framebuffer.h"
+#include "image_writer.h"
+#include "integrator.h"
+#include "render_settings.h"
+#include "render_stats.h"
+#include "scene_arena.h"
+#include "scene_data.h"
+#include "scene_file.h"
+#include "thread_pool.h"
+#include "tile_coordinator.h"
+#include "tile.h"
+#include "wavefront.h"
 
 using namespace std;
 
@@ -29,112 +47,854 @@ public:
     int x_pixels;
     int y_pixels;
     int ns;
+    render_settings settings;
+    // Finished images are encoded and written on this thread while the next one renders
+    mutable async_image_writer writer;
+    // Images queued on writer whose write has not been checked yet, see wait_for_writes()
+    mutable vector<pair<string, future<bool>>> pending_writes;
+    // Set when a write checked before wait_for_writes() was called failed
+    mutable bool write_failed = false;
+    // Owns the objects of the current scene, each build_random_scene() releases the previous one
+    mutable scene_arena arena;
+    // Scene loaded from a file, rendered instead of the random scene when there is one
+    std::unique_ptr<scene_data> loaded_scene;
+    scene_description loaded_description;
+    // Scene to render instead of the loaded or random one, and the camera to see it with. The render server
+    // sets them for each job to one of the scenes it keeps in memory
+    hittable *world_override = nullptr;
+    camera_settings view_override;
 
     inline void draw_diagonal_gradient(const string &filename, float default_blue) const;
 
-    inline void draw_random_scene(const string &filename) const;
+    // Apply a command line style option, such as name "--width" with value "800", to the image size, samples or
+    // settings. Options that name files or pick what to do (--scene, --output, ...) are left to the caller
+    inline option_status set_option(const string &name, const string &value);
 
-    static vec3 color(const ray &r, hittable *world, int depth);
+    // Render the random scene and queue it for writing, the format follows the extension (.ppm, .pfm or .png).
+    // Returns false without rendering if settings.resume names a checkpoint of a render it cannot carry on
+    inline bool draw_random_scene(const string &filename) const;
 
-    static vec3 matte_color(const ray &r, hittable *world);
+    // Queue an image for writing and keep its result for wait_for_writes()
+    inline void queue_image(framebuffer image, const string &filename) const;
+
+    // Wait for every queued image to be written. Returns false if any of the writes since the last call failed,
+    // each of which is reported to cerr
+    inline bool wait_for_writes() const;
+
+    // With settings.write_aovs, the feature buffers are queued for writing next to filename
+    inline framebuffer render_random_scene(const string &filename = string()) const;
+
+    // With RT_ENABLE_STATS, write the merged counters of the render that started at `start` next to the image
+    inline void write_stats(const string &image_filename, chrono::steady_clock::time_point start) const;
+
+    // Render every frame of the scene's animation, or the default one of the random scene, to files named
+    // by frame_filename(pattern, frame). The scene is built once and moved from frame to frame with a bvh
+    // refit, and each frame is written in the background while the next one renders
+    inline void draw_sequence(const string &pattern) const;
+
+    // Frames a sequence render makes: settings.frames if set, otherwise the frame count of the loaded scene.
+    // 0 means a single still image
+    inline int sequence_frames() const;
+
+    // Camera fly around and three hopping spheres for the random scene, spread over `frames` frames
+    inline animation random_scene_animation(int frames, int sphere_count) const;
+
+    // Render the random scene a few samples per pixel at a time, writing a preview to filename every
+    // settings.preview_every passes and a checkpoint every settings.checkpoint_interval seconds.
+    // With settings.resume it carries on from the checkpoint instead of starting over.
+    // With settings.adaptive, every pixel gets min_spp samples and the rest of the ns per pixel budget
+    // goes to the pixels whose error estimate is still above settings.noise_threshold.
+    // Returns false, leaving the checkpoint alone, if it was made with another size, seed, samples per pass or
+    // sampler
+    inline bool draw_random_scene_progressive(const string &filename) const;
+
+    // Load a text scene or a scene cache to render, taking the image size, samples and seed from it where given
+    inline bool load_scene(const string &path);
+
+    // Write the loaded scene, or the random scene if nothing was loaded, as a scene cache
+    inline bool compile_scene(const string &path) const;
+
+    // The loaded scene if there is one, otherwise the random scene, in settings.layout
+    inline hittable *build_scene() const;
+
+    inline camera scene_camera() const;
+
+    // The returned scene lives in arena until the next call
+    inline hittable *build_random_scene() const;
+
+    // The random scene of settings.seed in settings.layout, kept in the given arena
+    inline hittable *build_random_scene(scene_arena &into) const;
+
+    inline camera random_scene_camera() const;
+
+    // Colour of one camera ray, from trace_path() on the scene, or on its matte version with settings.matte
+    template<typename Scene>
+    inline vec3 color(const ray &r, const Scene &world, sampler &rng) const;
+
+    // Add `samples` samples of pass `pass` to the accumulation buffer, one task per tile.
+    // If active is given, only pixels with a non-zero entry in it are sampled.
+    // If remote is given, the tiles go to its worker processes instead of the pool, which may then be null
+    inline void render_pass(thread_pool *pool, const camera &cam, hittable *world, accumulation_buffer &accumulated,
+                            uint64_t pass, int samples, const vector<unsigned char> *active = nullptr,
+                            tile_coordinator *remote = nullptr) const;
+
+    // settings.crop as a pixel rectangle [x_begin, x_end) x [y_begin, y_end) with y counted from the bottom, like
+    // the buffers count it. Without a crop window, or with one that is empty or reaches outside the image, it is
+    // the whole image, and in the latter case the function returns false
+    inline bool crop_bounds(int &x_begin, int &y_begin, int &x_end, int &y_end) const;
+
+    // Tiles of every pass: the whole image, or only the crop window
+    inline vector<tile> pass_tiles() const;
+
+    // The accumulated image of the pixels inside the crop window
+    inline framebuffer resolve_window(const accumulation_buffer &accumulated) const;
+
+    // With settings.workers, fork the worker processes for a frame of this scene, otherwise return nullptr
+    inline std::unique_ptr<tile_coordinator> start_workers(const camera &cam, hittable *world) const;
+
+    inline void render_tile(const tile &t, const camera &cam, hittable *world, accumulation_buffer &accumulated,
+                            uint64_t pass, int samples, const vector<unsigned char> *active) const;
+
+    // Seed of the samplers of pass `pass` and the sample index its first sample of a pixel takes. The passes of a
+    // progressive render take the next settings.samples_per_pass indices of one sequence each, so that low
+    // discrepancy samplers spread the samples of a pixel out over the whole render, not just within a pass.
+    // A still image or a frame of a sequence is a single pass with a seed of its own
+    inline void pass_sampling(uint64_t pass, uint64_t &seed, uint32_t &first_sample) const;
+
+    // Trace AOV_SAMPLES camera rays per pixel and average what they see, see first_hit_features()
+    inline aov_buffers render_aovs(thread_pool &pool, const camera &cam, hittable *world) const;
+
+    template<typename Scene>
+    inline void render_aov_tile(const tile &t, const camera &cam, const Scene &world, aov_buffers &aovs) const;
+
+    // The image to write for a finished render: the accumulated one as it is, or denoised with settings.denoise.
+    // With settings.write_aovs the feature buffers are also queued for writing next to filename.
+    // If pool is null, one is started for the feature buffers and the denoiser
+    inline framebuffer finish_image(const accumulation_buffer &accumulated, thread_pool *pool, const camera &cam,
+                                    hittable *world, const string &filename) const;
+
+    // Pick the pixels the next adaptive pass should sample, returns how many there are
+    inline size_t select_adaptive_pixels(const accumulation_buffer &accumulated, uint64_t budget_left, int samples,
+                                         vector<unsigned char> &active) const;
 };
 
 inline void colour_gradient::draw_diagonal_gradient(const string &filename, float default_blue) const {
-// Create then open text file
-    ofstream File(filename);
-
-    File << "P3\n" << x_pixels << " " << y_pixels << "\n255\n";
+    // The gradient is already in display values, so it is written without gamma
+    framebuffer image(x_pixels, y_pixels);
+    image.gamma = 1.0f;
 
     for (int y_ind = y_pixels - 1; y_ind >= 0; y_ind--) {
         for (int x_ind = 0; x_ind < x_pixels; x_ind++) {
-            vec3 colour(float(x_ind) / float(x_pixels), float(y_ind) / float(y_pixels), 0);
-            int r = int(255.99 * colour[0]);
-            int g = int(255.99 * colour[1]);
-            int b = int(default_blue);
+            image.at(x_ind, y_ind) = vec3(float(x_ind) / float(x_pixels), float(y_ind) / float(y_pixels),
+                                          default_blue / 255.0f);
+        }
+    }
+    queue_image(std::move(image), filename);
+}
 
-            File << r << " " << g << " " << b << "\n";
+
+inline option_status colour_gradient::set_option(const string &name, const string &value) {
+    const char *v = value.c_str();
+    if (name == "--width") {
+        x_pixels = atoi(v);
+    } else if (name == "--height") {
+        y_pixels = atoi(v);
+    } else if (name == "--samples") {
+        ns = atoi(v);
+    } else if (name == "--threads") {
+        settings.threads = atoi(v);
+    } else if (name == "--workers") {
+        settings.workers = atoi(v);
+    } else if (name == "--tile-size") {
+        settings.tile_size = atoi(v);
+    } else if (name == "--seed") {
+        settings.seed = (unsigned int) strtoul(v, nullptr, 10);
+    } else if (name == "--progressive") {
+        settings.progressive = atoi(v) != 0;
+    } else if (name == "--samples-per-pass") {
+        settings.samples_per_pass = atoi(v);
+    } else if (name == "--preview-every") {
+        settings.preview_every = atoi(v);
+    } else if (name == "--checkpoint") {
+        settings.checkpoint_path = value;
+    } else if (name == "--checkpoint-interval") {
+        settings.checkpoint_interval = float(atof(v));
+    } else if (name == "--resume") {
+        settings.resume = atoi(v) != 0;
+    } else if (name == "--integrator") {
+        settings.integrator = value == "wavefront" ? integrator_kind::wavefront : integrator_kind::recursive;
+    } else if (name == "--max-depth") {
+        settings.max_depth = atoi(v);
+    } else if (name == "--roulette-depth") {
+        settings.roulette_depth = atoi(v);
+    } else if (name == "--light-sampling") {
+        settings.light_sampling = atoi(v) != 0;
+    } else if (name == "--matte") {
+        settings.matte = atoi(v) != 0;
+    } else if (name == "--sampler") {
+        if (!parse_sampler_kind(v, settings.sampler)) {
+            cerr << "Unknown sampler " << value << ", expected sobol, halton, blue-noise or independent" << endl;
+            return option_status::invalid;
+        }
+    } else if (name == "--scene-layout") {
+        settings.layout = value == "objects" ? scene_layout::objects : scene_layout::data;
+    } else if (name == "--adaptive") {
+        settings.adaptive = atoi(v) != 0;
+    } else if (name == "--min-spp") {
+        settings.min_spp = atoi(v);
+    } else if (name == "--max-spp") {
+        settings.max_spp = atoi(v);
+    } else if (name == "--noise-threshold") {
+        settings.noise_threshold = float(atof(v));
+    } else if (name == "--denoise") {
+        settings.denoise = atoi(v) != 0;
+    } else if (name == "--aovs") {
+        settings.write_aovs = atoi(v) != 0;
+    } else if (name == "--frames") {
+        settings.frames = atoi(v);
+    } else if (name == "--crop") {
+        crop_window crop;
+        char end;
+        if (sscanf(v, "%d,%d,%d,%d%c", &crop.x, &crop.y, &crop.width, &crop.height, &end) != 4) {
+            cerr << "Bad crop window " << value << ", expected x,y,width,height" << endl;
+            return option_status::invalid;
         }
+        settings.crop = crop;
+    } else {
+        return option_status::unknown;
+    }
+    return option_status::applied;
+}
+
+
+template<typename Scene>
+inline vec3 colour_gradient::color(const ray &r, const Scene &world, sampler &rng) const {
+    if (settings.matte) {
+        return trace_path(r, matte_scene<Scene>{world}, settings, rng);
     }
-    File.close();
+    return trace_path(r, world, settings, rng);
 }
 
 
-vec3 colour_gradient::color(const ray &r, hittable *world, int depth) {
-    hit_record record;
-    if (world->hit(r, 0.001, MAX_FLOAT, record)) {
-        ray scattered;
-        vec3 attenuation;
-        if (depth < 50 && record.mat_ptr->scatter(r, record, attenuation, scattered)) {
-            return attenuation * color(scattered, world, depth + 1);
+inline void colour_gradient::render_tile(const tile &t, const camera &cam, hittable *world,
+                                         accumulation_buffer &accumulated, uint64_t pass, int samples,
+                                         const vector<unsigned char> *active) const {
+    uint64_t seed;
+    uint32_t first_sample;
+    pass_sampling(pass, seed, first_sample);
+    if (settings.integrator == integrator_kind::wavefront) {
+        // One set of queues per worker thread, reused from tile to tile
+        static thread_local wavefront_integrator wavefront;
+        wavefront.render_tile(t, x_pixels, y_pixels, cam, world, seed, first_sample, samples, accumulated, active,
+                              settings);
+        return;
+    }
+    // A scene_data is traced through its own intersect and scatter, without virtual calls
+    const scene_data *data = dynamic_cast<const scene_data *>(world);
+    object_scene objects{world};
+    for (int y_ind = t.y_end - 1; y_ind >= t.y_begin; y_ind--) {
+        for (int x_ind = t.x_begin; x_ind < t.x_end; x_ind++) {
+            size_t index = accumulated.index(x_ind, y_ind);
+            if (active && !(*active)[index]) {
+                continue;
+            }
+            // Every sample of a pixel has its own sampler from the pass seed, so the image does not depend on
+            // the number of threads, the tile size or the order in which tiles are rendered
+            vec3 col(0, 0, 0);
+            for (int s = 0; s < samples; s++) {
+                sampler rng(settings.sampler, seed, x_ind, y_ind, x_pixels, first_sample + uint32_t(s));
+                float u = float(x_ind + rng.next_float())/ float(x_pixels);
+                float v = float(y_ind + rng.next_float())/ float(y_pixels);
+                ray ry = cam.get_ray(u, v, rng);
+                vec3 sample = data ? color(ry, *data, rng) : color(ry, objects, rng);
+                accumulated.stats[index].add(luminance(sample));
+                col += sample;
+            }
+            accumulated.sum[index] += col;
         }
-        else {
-            return vec3(0, 0, 0);
+    }
+}
+
+
+inline void colour_gradient::pass_sampling(uint64_t pass, uint64_t &seed, uint32_t &first_sample) const {
+    // Every pass of draw_random_scene_progressive() has at most samples_per_pass samples. Pass 0 is the same
+    // either way, so a one pass render matches a non-progressive one
+    if ((settings.progressive || settings.adaptive) && sequence_frames() == 0) {
+        seed = settings.seed;
+        first_sample = uint32_t(pass * uint64_t(settings.samples_per_pass > 0 ? settings.samples_per_pass : 1));
+    } else {
+        seed = pass_seed(settings.seed, pass);
+        first_sample = 0;
+    }
+}
+
+
+inline void colour_gradient::render_pass(thread_pool *pool, const camera &cam, hittable *world,
+                                         accumulation_buffer &accumulated, uint64_t pass, int samples,
+                                         const vector<unsigned char> *active, tile_coordinator *remote) const {
+    if (remote) {
+        remote->render_pass(pass_tiles(), pass, samples, active, accumulated);
+        if (!active) {
+            accumulated.samples += samples;
         }
+        accumulated.next_pass = pass + 1;
+        return;
+    }
+    for (const tile &t : pass_tiles()) {
+        pool->submit([this, t, &cam, world, &accumulated, pass, samples, active] {
+            tile_timer timer(t.index);
+            render_tile(t, cam, world, accumulated, pass, samples, active);
+        });
     }
-    else {
-        vec3 unit_direction = unit_vector(r.direction());
-        float t = 0.5 * (unit_direction.y() + 1.0);
-        return (1.0 - t) * vec3(1.0, 1.0, 1.0) + t * vec3(0.5, 0.7, 1.0);
+    pool->wait();
+    if (!active) {
+        accumulated.samples += samples;
     }
+    accumulated.next_pass = pass + 1;
 }
 
 
-vec3 colour_gradient::matte_color(const ray &r, hittable *world) {
-    ray cur_ray = r;
-    float cur_attenuation = 1.0;
-    for (int i = 0; i < 50; i++) {
-        hit_record record;
-        if (world->hit(cur_ray, 0.001, MAX_FLOAT, record)) {
-            vec3 target = record.point + record.normal + random_in_unit_sphere();
-            cur_ray = ray(record.point, target - record.point);
-            cur_attenuation *= 0.5;
-        } else {
-            vec3 unit_direction = unit_vector(cur_ray.direction());
-            float t = 0.5 * (unit_direction.y() + 1.0);
-            vec3 c = (1.0 - t) * vec3(1.0, 1.0, 1.0) + t * vec3(0.5, 0.7, 1.0);
-            return cur_attenuation * c;
+inline bool colour_gradient::crop_bounds(int &x_begin, int &y_begin, int &x_end, int &y_end) const {
+    const crop_window &crop = settings.crop;
+    x_begin = 0;
+    y_begin = 0;
+    x_end = x_pixels;
+    y_end = y_pixels;
+    if (crop.width == 0 && crop.height == 0) {
+        return true;
+    }
+    if (crop.x < 0 || crop.y < 0 || crop.width <= 0 || crop.height <= 0 || crop.x + crop.width > x_pixels ||
+        crop.y + crop.height > y_pixels) {
+        return false;
+    }
+    x_begin = crop.x;
+    x_end = crop.x + crop.width;
+    y_begin = y_pixels - (crop.y + crop.height);
+    y_end = y_pixels - crop.y;
+    return true;
+}
+
+
+inline vector<tile> colour_gradient::pass_tiles() const {
+    int x_begin, y_begin, x_end, y_end;
+    crop_bounds(x_begin, y_begin, x_end, y_end);
+    return make_tiles(x_begin, y_begin, x_end, y_end, settings.tile_size);
+}
+
+
+inline framebuffer colour_gradient::resolve_window(const accumulation_buffer &accumulated) const {
+    int x_begin, y_begin, x_end, y_end;
+    crop_bounds(x_begin, y_begin, x_end, y_end);
+    if (x_end - x_begin == accumulated.width && y_end - y_begin == accumulated.height) {
+        return accumulated.resolve();
+    }
+    return accumulated.window(x_begin, y_begin, x_end, y_end).resolve();
+}
+
+
+inline std::unique_ptr<tile_coordinator> colour_gradient::start_workers(const camera &cam, hittable *world) const {
+    if (settings.workers <= 0) {
+        return nullptr;
+    }
+    return std::unique_ptr<tile_coordinator>(new tile_coordinator(
+            settings.workers, x_pixels, y_pixels,
+            [this, &cam, world](const tile &t, uint64_t pass, int samples, const vector<unsigned char> *active,
+                                accumulation_buffer &buffer) {
+                render_tile(t, cam, world, buffer, pass, samples, active);
+            }));
+}
+
+
+inline aov_buffers colour_gradient::render_aovs(thread_pool &pool, const camera &cam, hittable *world) const {
+    aov_buffers aovs(x_pixels, y_pixels);
+    const scene_data *data = dynamic_cast<const scene_data *>(world);
+    object_scene objects{world};
+    for (const tile &t : pass_tiles()) {
+        pool.submit([this, t, &cam, data, &objects, &aovs] {
+            if (data && settings.matte) {
+                render_aov_tile(t, cam, matte_scene<scene_data>{*data}, aovs);
+            } else if (data) {
+                render_aov_tile(t, cam, *data, aovs);
+            } else if (settings.matte) {
+                render_aov_tile(t, cam, matte_scene<object_scene>{objects}, aovs);
+            } else {
+                render_aov_tile(t, cam, objects, aovs);
+            }
+        });
+    }
+    pool.wait();
+    return aovs;
+}
+
+
+template<typename Scene>
+inline void colour_gradient::render_aov_tile(const tile &t, const camera &cam, const Scene &world,
+                                             aov_buffers &aovs) const {
+    for (int y_ind = t.y_end - 1; y_ind >= t.y_begin; y_ind--) {
+        for (int x_ind = t.x_begin; x_ind < t.x_end; x_ind++) {
+            vec3 normal_sum(0, 0, 0), albedo_sum(0, 0, 0);
+            float depth_sum = 0;
+            for (int s = 0; s < AOV_SAMPLES; s++) {
+                sampler rng(settings.sampler, settings.seed + AOV_STREAM, x_ind, y_ind, x_pixels, uint32_t(s));
+                float u = float(x_ind + rng.next_float()) / float(x_pixels);
+                float v = float(y_ind + rng.next_float()) / float(y_pixels);
+                vec3 normal, albedo;
+                float depth;
+                first_hit_features(cam.get_ray(u, v, rng), world, rng, normal, albedo, depth);
+                normal_sum += normal;
+                albedo_sum += albedo;
+                depth_sum += depth;
+            }
+            size_t index = aovs.index(x_ind, y_ind);
+            aovs.normal[index] = normal_sum / float(AOV_SAMPLES);
+            aovs.albedo[index] = albedo_sum / float(AOV_SAMPLES);
+            aovs.depth[index] = depth_sum / float(AOV_SAMPLES);
         }
     }
-    return vec3(0.0, 0.0, 0.0); // exceeded maximum depth of recursion
 }
 
 
-inline void colour_gradient::draw_random_scene(const string &filename) const {
+inline framebuffer colour_gradient::finish_image(const accumulation_buffer &rendered, thread_pool *pool,
+                                                 const camera &cam, hittable *world, const string &filename) const {
+    // A crop window is cut out of the buffers first, so that the denoiser only ever sees rendered pixels
+    int x_begin, y_begin, x_end, y_end;
+    crop_bounds(x_begin, y_begin, x_end, y_end);
+    bool cropped = x_end - x_begin != rendered.width || y_end - y_begin != rendered.height;
+    accumulation_buffer window = cropped ? rendered.window(x_begin, y_begin, x_end, y_end) : accumulation_buffer(0, 0);
+    const accumulation_buffer &accumulated = cropped ? window : rendered;
+    if (!settings.denoise && !(settings.write_aovs && !filename.empty())) {
+        return accumulated.resolve();
+    }
+    std::unique_ptr<thread_pool> own_pool;
+    if (!pool) {
+        own_pool.reset(new thread_pool(settings.threads));
+        pool = own_pool.get();
+    }
+    aov_buffers aovs = render_aovs(*pool, cam, world);
+    if (cropped) {
+        aovs = aovs.window(x_begin, y_begin, x_end, y_end);
+    }
+    if (settings.write_aovs && !filename.empty()) {
+        queue_image(aovs.normal_image(), aov_filename(filename, "normal"));
+        queue_image(aovs.albedo_image(), aov_filename(filename, "albedo"));
+        queue_image(aovs.depth_image(), aov_filename(filename, "depth"));
+    }
+    if (!settings.denoise) {
+        return accumulated.resolve();
+    }
+    if (settings.write_aovs && !filename.empty()) {
+        queue_image(accumulated.resolve(), aov_filename(filename, "noisy"));
+    }
+    return denoise(accumulated, aovs, *pool);
+}
 
-    hittable_list * world = random_scene();
 
-    // Camera
+inline size_t colour_gradient::select_adaptive_pixels(const accumulation_buffer &accumulated, uint64_t budget_left,
+                                                      int samples, vector<unsigned char> &active) const {
+    // A pixel keeps going while its relative error is above the threshold and it is under max_spp.
+    // If the budget cannot cover all of those, it goes to the noisiest ones. Pixels outside the crop window
+    // are never sampled
+    int max_spp = settings.max_spp > 0 ? settings.max_spp : 4 * ns;
+    int x_begin, y_begin, x_end, y_end;
+    crop_bounds(x_begin, y_begin, x_end, y_end);
+    size_t n = accumulated.stats.size();
+    vector<float> errors(n, 0.0f);
+    vector<float> candidates;
+    for (size_t i = 0; i < n; i++) {
+        const pixel_stats &stats = accumulated.stats[i];
+        int x = int(i % size_t(x_pixels));
+        int y = y_pixels - 1 - int(i / size_t(x_pixels));
+        bool inside = x >= x_begin && x < x_end && y >= y_begin && y < y_end;
+        if (inside && stats.samples + samples <= uint32_t(max_spp)) {
+            errors[i] = stats.relative_error();
+        }
+        if (errors[i] > settings.noise_threshold) {
+            candidates.push_back(errors[i]);
+        }
+    }
 
-    vec3 lookfrom(13, 2, 3);
-    vec3 lookat(0, 0, 0);
-    vec3 vup(0, 1, 0);
-    float dist_to_focus = 10.0;
-    float aperture = 0.1;
+    size_t affordable = size_t(budget_left / uint64_t(samples));
+    float cutoff = settings.noise_threshold;
+    bool ties_allowed = true;
+    if (candidates.size() > affordable) {
+        if (affordable == 0) {
+            return 0;
+        }
+        // The affordable-th largest error becomes the cutoff, pixels equal to it only fill what is left
+        nth_element(candidates.begin(), candidates.begin() + (affordable - 1), candidates.end(), greater<float>());
+        cutoff = candidates[affordable - 1];
+        ties_allowed = false;
+    }
 
-    camera cam(lookfrom, lookat, vup, 20, x_pixels / y_pixels, aperture, dist_to_focus);
+    size_t selected = 0;
+    active.assign(n, 0);
+    for (size_t i = 0; i < n; i++) {
+        if (errors[i] > cutoff) {
+            active[i] = 1;
+            selected++;
+        }
+    }
+    for (size_t i = 0; i < n && !ties_allowed && selected < affordable; i++) {
+        if (errors[i] == cutoff) {
+            active[i] = 1;
+            selected++;
+        }
+    }
+    return selected;
+}
 
-    // Render scene
-    ofstream File(filename);
-    File << "P3\n" << x_pixels << " " << y_pixels << "\n255\n";
 
-    for (int y_ind = y_pixels - 1; y_ind >= 0; y_ind--) {
-        for (int x_ind = 0; x_ind < x_pixels; x_ind++) {
-            vec3 col(0, 0, 0);
-            for (int s = 0; s < ns; s++) {
-                float u = float(x_ind + get_random_number_0_to_1())/ float(x_pixels);
-                float v = float(y_ind + get_random_number_0_to_1())/ float(y_pixels);
-                ray ry = cam.get_ray(u, v);
-                col += color(ry, world, 0);
+inline bool colour_gradient::load_scene(const string &path) {
+    std::unique_ptr<scene_data> scene(new scene_data());
+    scene_description description;
+    if (!::load_scene(path, *scene, description)) {
+        return false;
+    }
+    if (description.width > 0) {
+        x_pixels = description.width;
+        y_pixels = description.height;
+        ns = description.samples;
+    }
+    if (description.has_seed) {
+        settings.seed = description.seed;
+    }
+    loaded_scene = std::move(scene);
+    loaded_description = description;
+    return true;
+}
+
+
+inline bool colour_gradient::compile_scene(const string &path) const {
+    if (loaded_scene) {
+        if (!loaded_description.motion.empty()) {
+            cerr << "The scene cache only keeps the still scene, its animation is left out\n";
+        }
+        return save_scene_cache(path, *loaded_scene, loaded_description);
+    }
+    // The random scene with the camera and settings it is rendered with
+    pcg32 scene_rng(settings.seed, SCENE_STREAM);
+    scene_arena scratch;
+    hittable_list *list = random_scene(scene_rng, scratch);
+    scene_data scene;
+    if (!scene.add_hittables(list->list, list->list_size)) {
+        return false;
+    }
+    scene_description description;
+    description.width = x_pixels;
+    description.height = y_pixels;
+    description.samples = ns;
+    description.has_seed = true;
+    description.seed = settings.seed;
+    return save_scene_cache(path, scene, description);
+}
+
+
+inline hittable *colour_gradient::build_scene() const {
+    if (world_override) {
+        return world_override;
+    }
+    if (loaded_scene) {
+        // The objects layout of a scene file is built from its scene_data into the arena, like the random scene
+        if (settings.layout == scene_layout::objects) {
+            arena.reset();
+            return object_world(*loaded_scene, arena);
+        }
+        return loaded_scene.get();
+    }
+    return build_random_scene();
+}
+
+
+inline camera colour_gradient::scene_camera() const {
+    if (world_override) {
+        return view_override.make_camera(float(x_pixels) / float(y_pixels));
+    }
+    if (loaded_scene) {
+        return loaded_description.view.make_camera(float(x_pixels) / float(y_pixels));
+    }
+    return random_scene_camera();
+}
+
+
+inline hittable *colour_gradient::build_random_scene() const {
+    arena.reset();
+    return build_random_scene(arena);
+}
+
+
+inline hittable *colour_gradient::build_random_scene(scene_arena &into) const {
+    pcg32 scene_rng(settings.seed, SCENE_STREAM);
+    hittable_list * scene = random_scene(scene_rng, into);
+    if (settings.layout == scene_layout::data) {
+        scene_data *data = into.create<scene_data>();
+        if (data->add_hittables(scene->list, scene->list_size)) {
+            return data;
+        }
+    }
+    return into.create<bvh>(scene->list, scene->list_size);
+}
+
+
+inline camera colour_gradient::random_scene_camera() const {
+    // The default camera_settings are the random scene's view, so this is the camera the render server and
+    // sequences see it with, at the true aspect ratio rather than a whole number one
+    return camera_settings().make_camera(float(x_pixels) / float(y_pixels));
+}
+
+
+inline bool colour_gradient::draw_random_scene(const string &filename) const {
+    RT_STAT(reset_stats());
+    auto start = chrono::steady_clock::now();
+    if (settings.progressive || settings.adaptive) {
+        if (!draw_random_scene_progressive(filename)) {
+            return false;
+        }
+    } else {
+        queue_image(render_random_scene(filename), filename);
+    }
+    write_stats(filename, start);
+    return true;
+}
+
+
+inline void colour_gradient::queue_image(framebuffer image, const string &filename) const {
+    // Writes that have already finished are checked as new ones come in, so that a long sequence does not
+    // pile up a result for every frame
+    for (size_t i = 0; i < pending_writes.size();) {
+        if (pending_writes[i].second.wait_for(chrono::seconds(0)) != future_status::ready) {
+            i++;
+            continue;
+        }
+        if (!pending_writes[i].second.get()) {
+            cerr << "Could not write " << pending_writes[i].first << "\n";
+            write_failed = true;
+        }
+        pending_writes.erase(pending_writes.begin() + i);
+    }
+    pending_writes.emplace_back(filename, writer.submit(std::move(image), filename));
+}
+
+
+inline bool colour_gradient::wait_for_writes() const {
+    for (pair<string, future<bool>> &pending : pending_writes) {
+        if (!pending.second.get()) {
+            cerr << "Could not write " << pending.first << "\n";
+            write_failed = true;
+        }
+    }
+    pending_writes.clear();
+    bool ok = !write_failed;
+    write_failed = false;
+    return ok;
+}
+
+
+inline void colour_gradient::write_stats(const string &image_filename, chrono::steady_clock::time_point start) const {
+#ifdef RT_ENABLE_STATS
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    string path = stats_filename(image_filename);
+    if (!merged_stats().write_json(path, seconds)) {
+        cerr << "Could not write " << path << "\n";
+    }
+#endif
+}
+
+
+inline framebuffer colour_gradient::render_random_scene(const string &filename) const {
+    hittable * world = build_scene();
+    camera cam = scene_camera();
+
+    // Render scene as a single pass of ns samples into an in-memory image of linear colours
+    accumulation_buffer accumulated(x_pixels, y_pixels);
+    // Workers are forked before the pool starts its threads
+    std::unique_ptr<tile_coordinator> remote = start_workers(cam, world);
+    thread_pool pool(settings.threads);
+    render_pass(&pool, cam, world, accumulated, 0, ns, nullptr, remote.get());
+
+    return finish_image(accumulated, &pool, cam, world, filename);
+}
+
+
+inline int colour_gradient::sequence_frames() const {
+    if (settings.frames > 0) {
+        return settings.frames;
+    }
+    return loaded_scene ? loaded_description.motion.frames : 0;
+}
+
+
+inline animation colour_gradient::random_scene_animation(int frames, int sphere_count) const {
+    // The camera swings a quarter turn around the scene, keeping its height and distance, while the three
+    // big spheres (the last ones the random scene adds) hop one after the other
+    animation motion;
+    motion.frames = frames;
+    float last = float(frames > 1 ? frames - 1 : 1);
+    camera_settings still;
+    for (int k = 0; k <= 4; k++) {
+        float angle = float(M_PI / 2) * k / 4;
+        float c = std::cos(angle), s = std::sin(angle);
+        const vec3 &from = still.lookfrom;
+        camera_keyframe key{};
+        key.frame = last * k / 4;
+        key.lookfrom = vec3(c * from[0] - s * from[2], from[1], s * from[0] + c * from[2]);
+        key.lookat = still.lookat;
+        key.vertical_fov = still.vertical_fov;
+        key.aperture = still.aperture;
+        key.focus_dist = still.focus_dist;
+        motion.camera_keys.push_back(key);
+    }
+    const float xs[3] = {0, -4, 4};
+    for (int i = 0; i < 3 && sphere_count >= 3; i++) {
+        object_track track{sphere_count - 3 + i, {}};
+        float begin = last * i / 4;
+        float end = begin + last / 2;
+        track.keys.push_back({begin, vec3(xs[i], 1, 0)});
+        track.keys.push_back({(begin + end) / 2, vec3(xs[i], 2, 0)});
+        track.keys.push_back({end, vec3(xs[i], 1, 0)});
+        motion.tracks.push_back(track);
+    }
+    return motion;
+}
+
+
+inline void colour_gradient::draw_sequence(const string &pattern) const {
+    RT_STAT(reset_stats());
+    auto start = chrono::steady_clock::now();
+    hittable *world = build_scene();
+    scene_data *data = dynamic_cast<scene_data *>(world);
+    int frames = sequence_frames();
+    camera_settings still;
+    float aspect = float(x_pixels) / float(y_pixels);
+    animation motion;
+    if (loaded_scene) {
+        still = loaded_description.view;
+        motion = loaded_description.motion;
+    } else {
+        motion = random_scene_animation(frames, data ? data->sphere_count : 0);
+    }
+    if (!motion.tracks.empty() && !data) {
+        cerr << "Only the data scene layout can move objects, the spheres stay where they are\n";
+    }
+
+    // Where everything is at a frame: the spheres are moved and the bvh refit, and the camera is returned
+    auto set_frame = [&](int frame) {
+        if (data && !motion.tracks.empty()) {
+            for (const object_track &track : motion.tracks) {
+                data->move_sphere(track.object, motion.position_at(track, float(frame)));
             }
-            col /= float(ns);
-            col = vec3( sqrt(col[0]), sqrt(col[1]), sqrt(col[2]) );
-            int r = int(255.99 * col[0]);
-            int g = int(255.99 * col[1]);
-            int b = int(255.99 * col[2]);
+            data->refit();
+        }
+        return motion.camera_at(float(frame), still).make_camera(aspect);
+    };
+
+    // Worker processes are forked once, before the pool starts and while the writer has nothing to do. Each
+    // frame is its own pass, numbered by the frame, and a worker moves its own copy of the scene to the
+    // frame of the tile it is given
+    writer.flush();
+    std::unique_ptr<tile_coordinator> remote;
+    if (settings.workers > 0) {
+        int worker_frame = -1;
+        camera worker_cam = set_frame(0);
+        remote.reset(new tile_coordinator(
+                settings.workers, x_pixels, y_pixels,
+                [this, world, &set_frame, worker_frame, worker_cam](const tile &t, uint64_t pass, int samples,
+                                                                   const vector<unsigned char> *active,
+                                                                   accumulation_buffer &buffer) mutable {
+                    if (int(pass) != worker_frame) {
+                        worker_cam = set_frame(int(pass));
+                        worker_frame = int(pass);
+                    }
+                    render_tile(t, worker_cam, world, buffer, pass, samples, active);
+                }));
+    }
+    thread_pool pool(settings.threads);
+
+    // Frame n + 1 renders while frame n is written, but no more than two frames wait for the disk
+    size_t queue_limit = writer.max_queued;
+    writer.max_queued = 2;
+    for (int frame = 0; frame < frames; frame++) {
+        camera cam = set_frame(frame);
+        // Each frame is its own pass, so its noise does not repeat from one frame to the next
+        accumulation_buffer accumulated(x_pixels, y_pixels);
+        render_pass(&pool, cam, world, accumulated, uint64_t(frame), ns, nullptr, remote.get());
+        string filename = frame_filename(pattern, frame);
+        queue_image(finish_image(accumulated, &pool, cam, world, filename), filename);
+    }
+    writer.max_queued = queue_limit;
+    write_stats(frame_filename(pattern, 0), start);
+}
 
-            File << r << " " << g << " " << b << "\n";
+
+inline bool colour_gradient::draw_random_scene_progressive(const string &filename) const {
+    hittable * world = build_scene();
+    camera cam = scene_camera();
+
+    accumulation_buffer accumulated(x_pixels, y_pixels);
+    int per_pass = settings.samples_per_pass > 0 ? settings.samples_per_pass : 1;
+    bool checkpoints = !settings.checkpoint_path.empty();
+    if (checkpoints && settings.resume) {
+        checkpoint_status status = accumulated.load_checkpoint(settings.checkpoint_path, settings.seed,
+                                                               uint32_t(per_pass), uint32_t(settings.sampler));
+        if (status == checkpoint_status::loaded) {
+            cerr << "Resuming from " << settings.checkpoint_path << " at " << accumulated.samples << " samples\n";
+        } else if (status == checkpoint_status::missing) {
+            cerr << "No checkpoint at " << settings.checkpoint_path << ", starting from scratch\n";
+        } else {
+            // Starting over would overwrite it, resume with the settings it was made with or remove it
+            return false;
         }
     }
+
+    std::unique_ptr<tile_coordinator> remote = start_workers(cam, world);
+    thread_pool pool(settings.threads);
+    auto last_checkpoint = chrono::steady_clock::now();
+
+    // Uniform passes cover every pixel until they reach ns samples (or min_spp when adaptive)
+    uint64_t uniform_samples = uint64_t(settings.adaptive ? min(settings.min_spp, ns) : ns);
+    int x_begin, y_begin, x_end, y_end;
+    crop_bounds(x_begin, y_begin, x_end, y_end);
+    uint64_t budget = uint64_t(ns) * uint64_t(x_end - x_begin) * uint64_t(y_end - y_begin);
+    vector<unsigned char> active;
+
+    while (true) {
+        int samples;
+        if (accumulated.samples < uniform_samples) {
+            samples = int(uniform_samples - accumulated.samples < uint64_t(per_pass) ? uniform_samples - accumulated.samples
+                                                                                     : uint64_t(per_pass));
+            render_pass(&pool, cam, world, accumulated, accumulated.next_pass, samples, nullptr, remote.get());
+        } else if (settings.adaptive) {
+            uint64_t spent = 0;
+            for (const pixel_stats &stats : accumulated.stats) {
+                spent += stats.samples;
+            }
+            samples = per_pass;
+            if (spent >= budget || select_adaptive_pixels(accumulated, budget - spent, samples, active) == 0) {
+                break;
+            }
+            render_pass(&pool, cam, world, accumulated, accumulated.next_pass, samples, &active, remote.get());
+        } else {
+            break;
+        }
+
+        if (settings.progressive && settings.preview_every > 0 && accumulated.next_pass % settings.preview_every == 0) {
+            queue_image(resolve_window(accumulated), filename);
+        }
+        auto now = chrono::steady_clock::now();
+        if (checkpoints && chrono::duration<float>(now - last_checkpoint).count() >= settings.checkpoint_interval) {
+            if (!accumulated.save_checkpoint(settings.checkpoint_path, settings.seed, uint32_t(per_pass),
+                                             uint32_t(settings.sampler))) {
+                cerr << "Could not write checkpoint " << settings.checkpoint_path << "\n";
+            }
+            last_checkpoint = now;
+        }
+    }
+
+    queue_image(finish_image(accumulated, &pool, cam, world, filename), filename);
+    if (checkpoints && !accumulated.save_checkpoint(settings.checkpoint_path, settings.seed, uint32_t(per_pass),
+                                                    uint32_t(settings.sampler))) {
+        cerr << "Could not write checkpoint " << settings.checkpoint_path << "\n";
+    }
+    return true;
 }
 
 
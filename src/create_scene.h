@@ -5,42 +5,46 @@
 #include "hittable.h"
 #include "material.h"
 #include "hittable_list.h"
+#include "scene_arena.h"
 
-hittable_list *random_scene() {
+// Every object of the scene is created in the arena and lives until the arena is reset
+hittable_list *random_scene(pcg32 &rng, scene_arena &arena) {
     int n = 500;
-    hittable **list = new hittable *[n + 1];
-    list[0] = new sphere(vec3(0, -1000, 0), 1000, new lambertian(vec3(0.5, 0.5, 0.5)));
+    // Reserve room for the whole scene up front so it all ends up in one block
+    size_t material_size = std::max(sizeof(lambertian), std::max(sizeof(metal), sizeof(dielectric)));
+    arena.reserve(sizeof(hittable_list) + (n + 1) * (sizeof(hittable *) + sizeof(sphere) + material_size + 16));
+    hittable **list = arena.create_array<hittable *>(n + 1);
+    list[0] = arena.create<sphere>(vec3(0, -1000, 0), 1000, arena.create<lambertian>(vec3(0.5, 0.5, 0.5)));
     int i = 1;
     for (int a = -11; a < 11; a++) {
         for (int b = -11; b < 11; b++) {
-            float choose_mat = get_random_number_0_to_1();
-            vec3 center(a + 0.9 * get_random_number_0_to_1(), 0.2, b + 0.9 * get_random_number_0_to_1());
+            float choose_mat = rng.next_float();
+            vec3 center(a + 0.9 * rng.next_float(), 0.2, b + 0.9 * rng.next_float());
             if ((center - vec3(4, 0.2, 0)).length() > 0.9) {
                 if (choose_mat < 0.8) { // diffuse
 
-                    list[i++] = new
-                            sphere(center, 0.2, new lambertian(
-                            vec3(get_random_number_0_to_1(), get_random_number_0_to_1(), get_random_number_0_to_1())));
+                    list[i++] = arena.create<sphere>(center, 0.2, arena.create<lambertian>(
+                            vec3(rng.next_float(), rng.next_float(), rng.next_float())));
                 } else if (choose_mat < 0.95) {   // metal
 
-                    list[i++] = new sphere(center, 0.2,
-                                           new metal(vec3(0.5 * (1 + get_random_number_0_to_1()),
-                                                          0.5 * (1 + get_random_number_0_to_1()),
-                                                          0.5 * (1 + get_random_number_0_to_1())),
-                                                     0.5 * (1 + get_random_number_0_to_1())));
+                    list[i++] = arena.create<sphere>(center, 0.2,
+                                                     arena.create<metal>(vec3(0.5 * (1 + rng.next_float()),
+                                                                              0.5 * (1 + rng.next_float()),
+                                                                              0.5 * (1 + rng.next_float())),
+                                                                         0.5 * (1 + rng.next_float())));
 
                 } else {  // glass
-                    list[i++] = new sphere(center, 0.2, new dielectric(1.5));
+                    list[i++] = arena.create<sphere>(center, 0.2, arena.create<dielectric>(1.5));
                 }
             }
         }
     }
 
-    list[i++] = new sphere(vec3(0, 1, 0), 1.0, new dielectric(1.5));
-    list[i++] = new sphere(vec3(-4, 1, 0), 1.0, new lambertian(vec3(0.4, 0.2, 0.1)));
-    list[i++] = new sphere(vec3(4, 1, 0), 1.0, new metal(vec3(0.7, 0.6, 0.5), 0.0));
+    list[i++] = arena.create<sphere>(vec3(0, 1, 0), 1.0, arena.create<dielectric>(1.5));
+    list[i++] = arena.create<sphere>(vec3(-4, 1, 0), 1.0, arena.create<lambertian>(vec3(0.4, 0.2, 0.1)));
+    list[i++] = arena.create<sphere>(vec3(4, 1, 0), 1.0, arena.create<metal>(vec3(0.7, 0.6, 0.5), 0.0));
 
-    return new hittable_list(list, i);
+    return arena.create<hittable_list>(list, i);
 }
 
 #endif //RAY_TRACING_CREATE_SCENE_H
@@ -0,0 +1,175 @@
+
+#ifndef RAY_TRACING_DENOISER_H
+#define RAY_TRACING_DENOISER_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "accumulation_buffer.h"
+#include "aov.h"
+#include "framebuffer.h"
+#include "thread_pool.h"
+
+// Passes of the filter, pass i spreads its taps 2^i pixels apart, so 3 passes reach 2 * 4 pixels out.
+// More passes smooth out wider blotches but blur away more of the image, at 4 spp 3 came out best
+const int DENOISE_ITERATIONS = 3;
+// How many standard deviations of a pixel's noise a neighbour's luminance may differ by and still count
+const float DENOISE_SIGMA_LUMINANCE = 4.0f;
+// Power of the cosine between two normals, low enough to let the filter run across the small spheres.
+// A power of two, so that it is a few multiplications
+const int DENOISE_NORMAL_POWER = 8;
+// Squared albedo difference at which a neighbour's weight falls to 1/e
+const float DENOISE_SIGMA_ALBEDO = 0.01f;
+// Relative depth difference per pixel of distance at which a neighbour's weight falls to 1/e
+const float DENOISE_SIGMA_DEPTH = 0.02f;
+// Rows per task
+const int DENOISE_BAND = 16;
+
+class atrous_denoiser {
+    // Edge avoiding à-trous wavelet filter (Dammertz et al.), with the luminance weight scaled by each pixel's
+    // own noise as in SVGF (Schied et al.). Every pass blurs with a 5 x 5 B3 spline whose taps spread out
+    // twice as far as in the previous pass, so a few cheap passes cover a wide footprint. Each tap is weighted
+    // down where the normal, albedo or depth of the first hit differs, which keeps edges and the boundaries
+    // between materials sharp, and where the luminance differs by more than the pixel's noise explains,
+    // which keeps shadows and highlights. The noise estimate is filtered along with the colour, so later
+    // passes, working on a smoother image, get stricter about luminance
+public:
+    atrous_denoiser(const accumulation_buffer &accumulated, const aov_buffers &features)
+            : width(accumulated.width), height(accumulated.height), aovs(features) {
+        framebuffer noisy = accumulated.resolve();
+        colour = std::move(noisy.pixels);
+        variance.resize(colour.size());
+        for (size_t i = 0; i < colour.size(); i++) {
+            // Variance of the mean luminance of the pixel's samples
+            const pixel_stats &stats = accumulated.stats[i];
+            variance[i] = stats.samples > 1 ? stats.m2 / float(stats.samples - 1) / float(stats.samples) : 0.0f;
+        }
+    }
+
+    // Run every pass, splitting the rows between the threads of the pool, and return the filtered image
+    inline framebuffer run(thread_pool &pool);
+
+private:
+    inline void filter_rows(int row_begin, int row_end, int step);
+
+    // Variance around a pixel blurred with a 3 x 3 gaussian, the estimate of a single pixel from a few
+    // samples is too rough to judge its neighbours by
+    inline float local_variance(int x, int row) const;
+
+    int width;
+    int height;
+    const aov_buffers &aovs;
+    // Rows from the top of the image down, like the framebuffer
+    std::vector<vec3> colour;
+    std::vector<float> variance;
+    std::vector<float> luminances;
+    std::vector<vec3> next_colour;
+    std::vector<float> next_variance;
+};
+
+inline framebuffer atrous_denoiser::run(thread_pool &pool) {
+    next_colour.resize(colour.size());
+    next_variance.resize(variance.size());
+    luminances.resize(colour.size());
+    for (int iteration = 0; iteration < DENOISE_ITERATIONS; iteration++) {
+        int step = 1 << iteration;
+        for (size_t i = 0; i < colour.size(); i++) {
+            luminances[i] = luminance(colour[i]);
+        }
+        for (int row = 0; row < height; row += DENOISE_BAND) {
+            int end = std::min(row + DENOISE_BAND, height);
+            pool.submit([this, row, end, step] { filter_rows(row, end, step); });
+        }
+        pool.wait();
+        colour.swap(next_colour);
+        variance.swap(next_variance);
+    }
+    framebuffer image(width, height);
+    image.pixels = colour;
+    return image;
+}
+
+inline float atrous_denoiser::local_variance(int x, int row) const {
+    static const float gaussian[3] = {0.25f, 0.5f, 0.25f};
+    float sum = 0;
+    float weights = 0;
+    for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+            int qx = x + dx, qy = row + dy;
+            if (qx < 0 || qx >= width || qy < 0 || qy >= height) {
+                continue;
+            }
+            float w = gaussian[dx + 1] * gaussian[dy + 1];
+            sum += w * variance[size_t(qy) * width + qx];
+            weights += w;
+        }
+    }
+    return sum / weights;
+}
+
+inline void atrous_denoiser::filter_rows(int row_begin, int row_end, int step) {
+    static const float kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+    for (int row = row_begin; row < row_end; row++) {
+        for (int x = 0; x < width; x++) {
+            size_t p = size_t(row) * width + x;
+            float lp = luminances[p];
+            float luminance_scale = DENOISE_SIGMA_LUMINANCE * std::sqrt(local_variance(x, row)) + 1e-4f;
+            const vec3 &np = aovs.normal[p];
+            const vec3 &ap = aovs.albedo[p];
+            float zp = aovs.depth[p];
+            bool sky = np.squared_length() < 0.01f;
+
+            vec3 sum_colour(0, 0, 0);
+            float sum_variance = 0;
+            float sum_weight = 0;
+            for (int dy = -2; dy <= 2; dy++) {
+                int qy = row + dy * step;
+                if (qy < 0 || qy >= height) {
+                    continue;
+                }
+                for (int dx = -2; dx <= 2; dx++) {
+                    int qx = x + dx * step;
+                    if (qx < 0 || qx >= width) {
+                        continue;
+                    }
+                    size_t q = size_t(qy) * width + qx;
+                    float w = kernel[dx + 2] * kernel[dy + 2];
+                    if (q != p) {
+                        const vec3 &nq = aovs.normal[q];
+                        if (!sky || nq.squared_length() >= 0.01f) {
+                            float cosine = dot(np, nq);
+                            if (cosine <= 0) {
+                                continue;
+                            }
+                            for (int power = 1; power < DENOISE_NORMAL_POWER; power *= 2) {
+                                cosine *= cosine;
+                            }
+                            w *= cosine;
+                        }
+                        // Add up the other exponents and take one exp for all of them
+                        float exponent = -std::fabs(lp - luminances[q]) / luminance_scale;
+                        vec3 da = ap - aovs.albedo[q];
+                        exponent -= dot(da, da) / DENOISE_SIGMA_ALBEDO;
+                        float zq = aovs.depth[q];
+                        exponent -= std::fabs(zp - zq) / (DENOISE_SIGMA_DEPTH * float(step) * std::max(zp, zq) + 1e-4f);
+                        w *= std::exp(exponent);
+                    }
+                    sum_colour += w * colour[q];
+                    sum_variance += w * w * variance[q];
+                    sum_weight += w;
+                }
+            }
+            // The centre tap always has a positive weight
+            next_colour[p] = sum_colour / sum_weight;
+            next_variance[p] = sum_variance / (sum_weight * sum_weight);
+        }
+    }
+}
+
+// Filter the image in accumulated, guided by the feature buffers of the same view
+inline framebuffer denoise(const accumulation_buffer &accumulated, const aov_buffers &aovs, thread_pool &pool) {
+    atrous_denoiser denoiser(accumulated, aovs);
+    return denoiser.run(pool);
+}
+
+#endif //RAY_TRACING_DENOISER_H
@@ -0,0 +1,27 @@
+
+#ifndef RAY_TRACING_FRAMEBUFFER_H
+#define RAY_TRACING_FRAMEBUFFER_H
+
+#include <vector>
+#include "vec3.h"
+
+class framebuffer {
+    // In-memory image of linear colours, stored row by row starting from the top row of the image.
+    // Renders fill it in and then hand it to the image writer in one piece
+public:
+    framebuffer() = default;
+
+    framebuffer(int w, int h) : width(w), height(h), pixels(size_t(w) * size_t(h), vec3(0, 0, 0)) {}
+
+    // x goes left to right and y goes bottom to top, matching the u, v of the camera
+    vec3 &at(int x, int y) { return pixels[size_t(height - 1 - y) * width + x]; }
+    const vec3 &at(int x, int y) const { return pixels[size_t(height - 1 - y) * width + x]; }
+
+    int width = 0;
+    int height = 0;
+    // Gamma that 8 bit outputs encode the linear values with, float outputs are written as they are
+    float gamma = 2.0f;
+    std::vector<vec3> pixels;
+};
+
+#endif //RAY_TRACING_FRAMEBUFFER_H
@@ -2,11 +2,13 @@
 #ifndef RAY_TRACING_HITTABLE_H
 #define RAY_TRACING_HITTABLE_H
 
+#include <cmath>
 #include "ray.h"
-#include <random>
+#include "aabb.h"
+#include "render_stats.h"
+#include "sampler.h"
 
-float get_random_number_0_to_1();
-vec3 random_in_unit_sphere();
+vec3 random_in_unit_sphere(sampler &rng);
 
 class hittable;
 class sphere;
@@ -22,12 +24,72 @@ struct hit_record {
     // Normal vector to point
     vec3 normal;
     material *mat_ptr;
+    // Index of the light that was hit in the scene's light list, -1 for anything else. Only scene_data has
+    // a light list, for other hittables emissive surfaces only light what happens to bounce into them
+    int light = -1;
+};
+
+struct hit_id {
+    // What the first phase of an intersection keeps of the closest hit so far: which primitive it is on, and
+    // nothing worked out about the hit itself. Walks only carry this and the hit distance, and fill_record()
+    // turns the one that is left at the end into a hit_record
+    // The hittable whose fill_record() finishes the hit: the primitive itself, or the instance it is seen through
+    const hittable *object = nullptr;
+    // The primitive behind an instance, whose fill_record() the instance calls
+    const hittable *inner = nullptr;
+    // Whatever the object needs to find its hit again, such as a triangle and its barycentric coordinates
+    uint32_t primitive = 0;
+    float b1 = 0;
+    float b2 = 0;
+    // t_min of the query, for hittables that only implement hit() and find the hit again from scratch
+    float t_min = 0;
 };
 
 class hittable {
+    // A hittable implements either hit(), or intersect() and fill_record(); each one's default is written
+    // in terms of the other(s)
 public:
-    // pure virtual function for determining whether a hittable has been hit
-    virtual bool hit(const ray &r, float t_min, float t_max, hit_record &rec) const = 0;
+    // Closest hit in [t_min, t_max] with everything about it worked out
+    virtual bool hit(const ray &r, float t_min, float t_max, hit_record &rec) const {
+        hit_id id;
+        if (!intersect(r, t_min, t_max, id)) {
+            return false;
+        }
+        return id.object->fill_record(r, id, t_max, rec);
+    }
+
+    // First phase of hit(): find the closest hit in [t_min, t_max], lower t_max to its distance and note
+    // what was hit in id, without working out its point, normal or material. On a miss both are left alone
+    virtual bool intersect(const ray &r, float t_min, float &t_max, hit_id &id) const {
+        hit_record record;
+        if (!hit(r, t_min, t_max, record)) {
+            return false;
+        }
+        t_max = record.t;
+        id = hit_id();
+        id.object = this;
+        id.t_min = t_min;
+        return true;
+    }
+
+    // Second phase: the hit_record of the hit that intersect() left in id, at distance t. Returns false if the
+    // hit could not be found again, and the record is then left alone
+    virtual bool fill_record(const ray &r, const hit_id &id, float t, hit_record &record) const {
+        // hit() is found again from scratch. Tests such as the triangle one only take hits strictly before
+        // t_max, so the range has to reach just past t to include the hit at t itself
+        return hit(r, id.t_min, std::nextafter(t, INFINITY), record);
+    }
+
+    // Whether anything at all is hit in [t_min, t_max]. Stops at the first hit found, so shadow and
+    // visibility rays do not pay for finding the closest one
+    virtual bool occluded(const ray &r, float t_min, float t_max) const {
+        hit_id id;
+        return intersect(r, t_min, t_max, id);
+    }
+
+    // Box containing the whole hittable, used to build acceleration structures
+    // Returns false if the hittable has no finite bounds
+    virtual bool bounding_box(aabb &output_box) const = 0;
 };
 
 
@@ -37,7 +99,22 @@ public:
 
     sphere(vec3 c, float r, material* m) : center(c), radius(r), mat(m) {};
 
-    bool hit(const ray &r, float t_min, float t_max, hit_record &record) const override;
+    // Only finds the distance, the point and normal are left to fill_record()
+    bool intersect(const ray &r, float t_min, float &t_max, hit_id &id) const override;
+
+    bool fill_record(const ray &r, const hit_id &id, float t, hit_record &record) const override {
+        record.t = t;
+        record.point = r.point_given_parameter(t);
+        record.normal = (record.point - center) / radius;
+        record.mat_ptr = mat;
+        return true;
+    }
+
+    bool bounding_box(aabb &output_box) const override {
+        vec3 extent(radius, radius, radius);
+        output_box = aabb(center - extent, center + extent);
+        return true;
+    }
 
     vec3 center{};
     float radius{};
@@ -45,7 +122,7 @@ public:
 };
 
 
-bool sphere::hit(const ray &r, float t_min, float t_max, hit_record &record) const {
+bool sphere::intersect(const ray &r, float t_min, float &t_max, hit_id &id) const {
     // Because the result of the dot product of oc and r.direction times 2 is b in the quadratic equation,
     // we say that the dot product of oc and r.direction is 1/2 b, so that the discriminant can be
     // written as 4 * half_b * half_b - 4 * a * c
@@ -55,6 +132,7 @@ bool sphere::hit(const ray &r, float t_min, float t_max, hit_record &record) con
     // so that the "discriminant" is half_b * half_b - a * c, and the denominator is a
     // Note that this simplification does not effect whether a certain equation gives 1, 2, or no solutions
 
+    RT_STAT(thread_stats().primitive_tests++);
     vec3 oc = r.origin() - center;
     float a = dot(r.direction(), r.direction());
     float half_b = dot(oc, r.direction());
@@ -69,7 +147,7 @@ bool sphere::hit(const ray &r, float t_min, float t_max, hit_record &record) con
     // If there are 1 or 2 solutions t to the quadratic equation (the ray intersects with the sphere)
     // Find the nearest root that is in the the range of view (between t_min and t_max)
 
-    double sqrt_discriminant = sqrt(discriminant);
+    float sqrt_discriminant = std::sqrt(discriminant);
 
     // Start by seeing if -half_b - sqrt_discriminant is valid in the field of view
     // If valid, that means that it is the smallest valid root
@@ -81,29 +159,23 @@ bool sphere::hit(const ray &r, float t_min, float t_max, hit_record &record) con
             return false;
         }
     }
-    // set the parameter of the hit record
-    record.t = root;
-    // set the point at which the sphere was hit
-    record.point = r.point_given_parameter(record.t);
-    // set the normal vector of that point
-    record.normal = (record.point - center) / radius;
-    record.mat_ptr = mat;
+    // Only the distance is kept, a closer hit further on may still replace this one
+    t_max = root;
+    id.object = this;
+    id.inner = nullptr;
     return true;
 }
 
-float get_random_number_0_to_1() {
-    return rand() / (RAND_MAX+ 1.0);
-}
-
-vec3 random_in_unit_sphere() {
-    // Get a random vector with length less than 1
-    vec3 point;
-    do {
-        point = (2.0 * vec3(get_random_number_0_to_1(),
-                            get_random_number_0_to_1(),
-                            get_random_number_0_to_1())) - vec3(1, 1, 1);
-    } while (point.squared_length() >= 1.0);
-    return point;
+vec3 random_in_unit_sphere(sampler &rng) {
+    // Get a random vector with length less than 1, straight from three numbers rather than by rejection, so that
+    // it takes the same dimensions of the sampler every time: a direction from the first two (z is uniform on a
+    // sphere) and a length from the cube root of the third, as the volume within length r grows with r^3
+    RT_STAT(thread_stats().unit_sphere_calls++);
+    float z = 1 - 2 * rng.next_float();
+    float phi = float(2 * M_PI) * rng.next_float();
+    float r = std::cbrt(rng.next_float());
+    float ring = r * std::sqrt(1 - z * z > 0 ? 1 - z * z : 0.0f);
+    return vec3(ring * std::cos(phi), ring * std::sin(phi), r * z);
 }
 
 
@@ -13,33 +13,55 @@ public:
         list = lst;
         list_size = n;
     }
-    virtual bool hit(const ray& r, float tmin, float tmax, hit_record& record) const;
+    virtual bool intersect(const ray &r, float t_min, float &t_max, hit_id &id) const;
+    virtual bool occluded(const ray &r, float t_min, float t_max) const;
+    virtual bool bounding_box(aabb &output_box) const;
     hittable **list;
     int list_size;
 };
 
-bool hittable_list::hit(const ray& r, float t_min, float t_max, hit_record& record) const {
-    // Given the maximum t, minimum t, the ray and and hit record passed by reference
-    // Find whether something is hit, and if so, update the record to only consider the closest hit
+bool hittable_list::intersect(const ray &r, float t_min, float &t_max, hit_id &id) const {
+    // Given the maximum t, minimum t, the ray and the hit id passed by reference
+    // Find whether something is hit, and if so, keep only the closest hit in id. Every member that is hit
+    // lowers t_max, so that the members after it only look for closer hits; none of them works out a point
+    // or a normal, hit() does that once for the hit that is left at the end
 
-    hit_record temp_rec;
     bool hit_anything = false;
-    double closest_so_far = t_max;
 
     // For each hittable in the hittable_list
     for (int i = 0; i < list_size; i++) {
-        // If the ray hits the hittable
-        if (list[i]->hit(r, t_min, closest_so_far, temp_rec)) {
-            // Use closest_so_far, starting at t_max, to continually limit upper bound of the range of t
-            // that we consider, so that we end up with a minimum solution
+        if (list[i]->intersect(r, t_min, t_max, id)) {
             hit_anything = true;
-            // Update closest to far if a solution t that is within the bounds t_min and closest_so_far is found
-            closest_so_far = temp_rec.t;
-            record = temp_rec;
         }
     }
     return hit_anything;
 }
 
+bool hittable_list::occluded(const ray &r, float t_min, float t_max) const {
+    // Any member that is hit will do, so stop at the first one
+    for (int i = 0; i < list_size; i++) {
+        if (list[i]->occluded(r, t_min, t_max)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool hittable_list::bounding_box(aabb &output_box) const {
+    // The box of a list is the box surrounding all of its members, if every member has one
+    if (list_size < 1) {
+        return false;
+    }
+    aabb temp_box;
+    output_box = aabb();
+    for (int i = 0; i < list_size; i++) {
+        if (!list[i]->bounding_box(temp_box)) {
+            return false;
+        }
+        output_box.expand(temp_box);
+    }
+    return true;
+}
+
 
 #endif //RAY_TRACING_HITTABLE_LIST_H
@@ -0,0 +1,299 @@
+
+#ifndef RAY_TRACING_IMAGE_WRITER_H
+#define RAY_TRACING_IMAGE_WRITER_H
+
+#include <array>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "framebuffer.h"
+
+enum class image_format { p6, pfm, png };
+
+inline image_format format_from_filename(const std::string &filename) {
+    // Pick the format from the extension, anything unknown (including .ppm) gets binary P6
+    auto ends_with = [&filename](const char *extension) {
+        std::string e(extension);
+        return filename.size() >= e.size() && filename.compare(filename.size() - e.size(), e.size(), e) == 0;
+    };
+    if (ends_with(".pfm") || ends_with(".PFM")) {
+        return image_format::pfm;
+    }
+    if (ends_with(".png") || ends_with(".PNG")) {
+        return image_format::png;
+    }
+    return image_format::p6;
+}
+
+inline unsigned char to_byte(float linear, float gamma) {
+    // Gamma encode a linear value into 0 - 255, the render uses gamma 2 so this is usually a square root
+    float encoded = gamma == 2.0f ? std::sqrt(linear) : (gamma == 1.0f ? linear : std::pow(linear, 1.0f / gamma));
+    int value = int(255.99f * encoded);
+    return (unsigned char) (value < 0 ? 0 : (value > 255 ? 255 : value));
+}
+
+inline std::vector<unsigned char> to_rgb8(const framebuffer &image) {
+    std::vector<unsigned char> bytes(image.pixels.size() * 3);
+    for (size_t i = 0; i < image.pixels.size(); i++) {
+        for (int c = 0; c < 3; c++) {
+            bytes[3 * i + c] = to_byte(image.pixels[i][c], image.gamma);
+        }
+    }
+    return bytes;
+}
+
+inline bool write_p6(const framebuffer &image, const std::string &filename) {
+    // Binary PPM: a short text header, then 3 bytes per pixel written in a single call
+    std::vector<unsigned char> bytes = to_rgb8(image);
+    FILE *file = fopen(filename.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+    fprintf(file, "P6\n%d %d\n255\n", image.width, image.height);
+    bool ok = fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+    return fclose(file) == 0 && ok;
+}
+
+inline bool write_pfm(const framebuffer &image, const std::string &filename) {
+    // Portable float map: linear 32 bit floats, no gamma or clamping, for HDR pipelines.
+    // A negative scale marks the data as little endian, and rows go from the bottom of the image up
+    std::vector<float> values(image.pixels.size() * 3);
+    for (int y = 0; y < image.height; y++) {
+        for (int x = 0; x < image.width; x++) {
+            const vec3 &col = image.at(x, y);
+            size_t i = 3 * (size_t(y) * image.width + x);
+            values[i] = col[0];
+            values[i + 1] = col[1];
+            values[i + 2] = col[2];
+        }
+    }
+    FILE *file = fopen(filename.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+    uint16_t probe = 1;
+    bool little_endian = *(unsigned char *) &probe == 1;
+    fprintf(file, "PF\n%d %d\n%s\n", image.width, image.height, little_endian ? "-1.0" : "1.0");
+    bool ok = fwrite(values.data(), sizeof(float), values.size(), file) == values.size();
+    return fclose(file) == 0 && ok;
+}
+
+inline bool read_pfm(const std::string &filename, framebuffer &image) {
+    // The inverse of write_pfm, for reference images. Only colour maps of either byte order are accepted
+    FILE *file = fopen(filename.c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+    char kind[3] = {};
+    int width = 0, height = 0;
+    float scale = 0;
+    bool ok = fscanf(file, "%2s %d %d %f", kind, &width, &height, &scale) == 4 && fgetc(file) != EOF &&
+              std::string(kind) == "PF" && width > 0 && height > 0 && scale != 0;
+    std::vector<float> values(ok ? size_t(width) * size_t(height) * 3 : 0);
+    ok = ok && fread(values.data(), sizeof(float), values.size(), file) == values.size();
+    fclose(file);
+    if (!ok) {
+        return false;
+    }
+    uint16_t probe = 1;
+    bool little_endian = *(unsigned char *) &probe == 1;
+    if ((scale < 0) != little_endian) {
+        for (float &value : values) {
+            unsigned char *bytes = reinterpret_cast<unsigned char *>(&value);
+            std::swap(bytes[0], bytes[3]);
+            std::swap(bytes[1], bytes[2]);
+        }
+    }
+    image = framebuffer(width, height);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            size_t i = 3 * (size_t(y) * width + x);
+            image.at(x, y) = vec3(values[i], values[i + 1], values[i + 2]);
+        }
+    }
+    return true;
+}
+
+inline uint32_t crc32(const unsigned char *data, size_t length, uint32_t crc = 0) {
+    static const std::array<uint32_t, 256> table = [] {
+        std::array<uint32_t, 256> t{};
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            t[n] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+inline void append_be32(std::vector<unsigned char> &out, uint32_t value) {
+    out.push_back((unsigned char) (value >> 24));
+    out.push_back((unsigned char) (value >> 16));
+    out.push_back((unsigned char) (value >> 8));
+    out.push_back((unsigned char) value);
+}
+
+inline void append_png_chunk(std::vector<unsigned char> &out, const char *type, const std::vector<unsigned char> &data) {
+    append_be32(out, uint32_t(data.size()));
+    size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data.begin(), data.end());
+    append_be32(out, crc32(&out[start], out.size() - start));
+}
+
+inline bool write_png(const framebuffer &image, const std::string &filename) {
+    // 8 bit RGB PNG without any dependency: the pixel rows go into a zlib stream made of stored
+    // (uncompressed) deflate blocks, so the file is about the size of a P6 but opens in any viewer
+    std::vector<unsigned char> bytes = to_rgb8(image);
+    size_t row_size = size_t(image.width) * 3;
+
+    std::vector<unsigned char> raw;
+    raw.reserve((row_size + 1) * image.height);
+    for (int row = 0; row < image.height; row++) {
+        raw.push_back(0); // filter type none
+        raw.insert(raw.end(), bytes.begin() + row * row_size, bytes.begin() + (row + 1) * row_size);
+    }
+
+    std::vector<unsigned char> zlib = {0x78, 0x01};
+    const size_t max_block = 65535;
+    size_t offset = 0;
+    do {
+        size_t length = raw.size() - offset < max_block ? raw.size() - offset : max_block;
+        bool last = offset + length == raw.size();
+        zlib.push_back(last ? 1 : 0);
+        zlib.push_back((unsigned char) (length & 0xFF));
+        zlib.push_back((unsigned char) (length >> 8));
+        zlib.push_back((unsigned char) (~length & 0xFF));
+        zlib.push_back((unsigned char) ((~length >> 8) & 0xFF));
+        zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + length);
+        offset += length;
+    } while (offset < raw.size());
+    uint32_t a = 1, b = 0;
+    for (unsigned char c : raw) {
+        a = (a + c) % 65521;
+        b = (b + a) % 65521;
+    }
+    append_be32(zlib, (b << 16) | a);
+
+    std::vector<unsigned char> header;
+    append_be32(header, uint32_t(image.width));
+    append_be32(header, uint32_t(image.height));
+    header.insert(header.end(), {8, 2, 0, 0, 0}); // 8 bits per channel, RGB, default compression/filter, no interlace
+
+    std::vector<unsigned char> out = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    append_png_chunk(out, "IHDR", header);
+    append_png_chunk(out, "IDAT", zlib);
+    append_png_chunk(out, "IEND", std::vector<unsigned char>());
+
+    FILE *file = fopen(filename.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+    bool ok = fwrite(out.data(), 1, out.size(), file) == out.size();
+    return fclose(file) == 0 && ok;
+}
+
+inline bool write_image(const framebuffer &image, const std::string &filename) {
+    switch (format_from_filename(filename)) {
+        case image_format::pfm: return write_pfm(image, filename);
+        case image_format::png: return write_png(image, filename);
+        default: return write_p6(image, filename);
+    }
+}
+
+
+class async_image_writer {
+    // Writer stage that runs on its own thread: the renderer hands over a finished framebuffer and goes
+    // straight on to the next frame while this thread encodes and writes the previous one
+public:
+    async_image_writer() : worker(&async_image_writer::run, this) {}
+
+    ~async_image_writer() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        job_ready.notify_one();
+        worker.join();
+    }
+
+    async_image_writer(const async_image_writer &) = delete;
+    async_image_writer &operator=(const async_image_writer &) = delete;
+
+    // Queue an image to be written, the future tells whether the write succeeded.
+    // With max_queued set, waits while that many images are already waiting to be written
+    std::future<bool> submit(framebuffer image, const std::string &filename) {
+        job j;
+        j.image = std::move(image);
+        j.filename = filename;
+        std::future<bool> result = j.done.get_future();
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            room.wait(guard, [this] { return max_queued == 0 || jobs.size() < max_queued; });
+            jobs.push_back(std::move(j));
+        }
+        job_ready.notify_one();
+        return result;
+    }
+
+    // Most images waiting to be written before submit() blocks, 0 for no limit. A sequence renders its frames
+    // faster than a slow disk takes them, and each queued frame holds a whole framebuffer
+    size_t max_queued = 0;
+
+    // Block until every queued image has been written
+    void flush() {
+        std::unique_lock<std::mutex> guard(lock);
+        idle.wait(guard, [this] { return jobs.empty() && !busy; });
+    }
+
+private:
+    struct job {
+        framebuffer image;
+        std::string filename;
+        std::promise<bool> done;
+    };
+
+    void run() {
+        std::unique_lock<std::mutex> guard(lock);
+        while (true) {
+            job_ready.wait(guard, [this] { return stopping || !jobs.empty(); });
+            if (jobs.empty()) {
+                return;
+            }
+            job j = std::move(jobs.front());
+            jobs.pop_front();
+            room.notify_all();
+            busy = true;
+            guard.unlock();
+            j.done.set_value(write_image(j.image, j.filename));
+            guard.lock();
+            busy = false;
+            idle.notify_all();
+        }
+    }
+
+    std::mutex lock;
+    std::condition_variable job_ready;
+    std::condition_variable idle;
+    std::condition_variable room;
+    std::deque<job> jobs;
+    bool busy = false;
+    bool stopping = false;
+    std::thread worker;
+};
+
+#endif //RAY_TRACING_IMAGE_WRITER_H
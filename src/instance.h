@@ -0,0 +1,101 @@
+
+#ifndef RAY_TRACING_INSTANCE_H
+#define RAY_TRACING_INSTANCE_H
+
+#include "hittable.h"
+#include "transform.h"
+
+class instance : public hittable {
+    // A copy of a shared hittable placed in the world by an affine transform, optionally with its own material.
+    // The geometry is not copied: any number of instances can point at one mesh or one bvh, each costing only
+    // the instance itself. A bvh over instances then makes the top level of a two level hierarchy whose bottom
+    // levels are the shared geometries' own structures.
+    // Rays are moved into the geometry's space rather than the geometry into the world's, so only the world
+    // to object transform is kept; normals come back through its transpose
+public:
+    // Returns an instance that is never hit if the transform cannot be inverted, check valid()
+    instance(const hittable *shared, const affine_transform &object_to_world, material *override_material = nullptr)
+            : geometry(shared), mat(override_material) {
+        if (!object_to_world.invert(to_object)) {
+            geometry = nullptr;
+            return;
+        }
+        aabb object_box;
+        bounded = geometry->bounding_box(object_box);
+        if (bounded) {
+            box = object_to_world.apply(object_box);
+        }
+    }
+
+    bool valid() const { return geometry != nullptr; }
+
+    bool intersect(const ray &r, float t_min, float &t_max, hit_id &id) const override {
+        if (!geometry) {
+            return false;
+        }
+        hit_id inside;
+        if (!geometry->intersect(to_object.apply(r), t_min, t_max, inside)) {
+            return false;
+        }
+        id = inside;
+        if (inside.inner) {
+            // An instance of an instance: id has room for one level of them, so this one is finished from
+            // scratch by hittable::fill_record() instead
+            id = hit_id();
+            id.t_min = t_min;
+            id.object = this;
+            return true;
+        }
+        id.object = this;
+        id.inner = inside.object;
+        return true;
+    }
+
+    bool fill_record(const ray &r, const hit_id &id, float t, hit_record &record) const override {
+        if (!id.inner) {
+            return hittable::fill_record(r, id, t, record);
+        }
+        hit_id inside = id;
+        inside.object = id.inner;
+        inside.inner = nullptr;
+        if (!id.inner->fill_record(to_object.apply(r), inside, t, record)) {
+            return false;
+        }
+        record.point = r.point_given_parameter(t);
+        record.normal = unit_vector(to_object.apply_transposed(record.normal));
+        if (mat) {
+            record.mat_ptr = mat;
+        }
+        return true;
+    }
+
+    bool hit(const ray &r, float t_min, float t_max, hit_record &record) const override {
+        if (!geometry || !geometry->hit(to_object.apply(r), t_min, t_max, record)) {
+            return false;
+        }
+        record.point = r.point_given_parameter(record.t);
+        record.normal = unit_vector(to_object.apply_transposed(record.normal));
+        if (mat) {
+            record.mat_ptr = mat;
+        }
+        return true;
+    }
+
+    bool occluded(const ray &r, float t_min, float t_max) const override {
+        return geometry && geometry->occluded(to_object.apply(r), t_min, t_max);
+    }
+
+    bool bounding_box(aabb &output_box) const override {
+        output_box = box;
+        return bounded;
+    }
+
+    const hittable *geometry;
+    affine_transform to_object{};
+    // Replaces the geometry's own material when set
+    material *mat;
+    aabb box;
+    bool bounded = false;
+};
+
+#endif //RAY_TRACING_INSTANCE_H
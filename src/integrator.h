@@ -0,0 +1,212 @@
+
+#ifndef RAY_TRACING_INTEGRATOR_H
+#define RAY_TRACING_INTEGRATOR_H
+
+#include <algorithm>
+#include <limits>
+#include "hittable.h"
+#include "light.h"
+#include "material.h"
+#include "render_settings.h"
+#include "render_stats.h"
+#include "scene_data.h"
+#include "sky.h"
+
+// Lowest survival probability of Russian roulette, so that a path through very dark surfaces is not
+// weighted up by an enormous factor on the rare occasions it survives
+const float ROULETTE_MIN_SURVIVAL = 0.05f;
+
+struct object_scene {
+    // Scene of hittable and material objects in the shape trace_path() expects, with virtual calls for both
+    typedef hit_record record_type;
+
+    bool intersect(const ray &r, float t_min, float t_max, hit_record &record) const {
+        return world->hit(r, t_min, t_max, record);
+    }
+
+    bool occluded(const ray &r, float t_min, float t_max) const {
+        return world->occluded(r, t_min, t_max);
+    }
+
+    bool scatter(const ray &r_in, const hit_record &record, vec3 &attenuation, ray &scattered, sampler &rng) const {
+        return record.mat_ptr->scatter(r_in, record, attenuation, scattered, rng);
+    }
+
+    vec3 albedo(const hit_record &record) const {
+        return record.mat_ptr->surface_albedo(record);
+    }
+
+    bool specular(const hit_record &record) const {
+        return record.mat_ptr->specular();
+    }
+
+    vec3 emitted(const ray &r_in, const hit_record &record) const {
+        return record.mat_ptr->emitted(r_in, record);
+    }
+
+    bool scatter_value(const hit_record &record, const vec3 &direction, vec3 &value, float &pdf) const {
+        return record.mat_ptr->scatter_value(record, direction, value, pdf);
+    }
+
+    // Only a scene_data keeps a light list, which goes through its own scene type
+    const light_list *lights() const {
+        return nullptr;
+    }
+
+    hittable *world;
+};
+
+template<typename Scene>
+struct matte_scene {
+    // The geometry of another scene with every surface replaced by a grey lambertian, a quick preview
+    // of shapes and lighting that ignores the materials. Lights keep shining
+    typedef typename Scene::record_type record_type;
+
+    bool intersect(const ray &r, float t_min, float t_max, record_type &record) const {
+        return scene.intersect(r, t_min, t_max, record);
+    }
+
+    bool occluded(const ray &r, float t_min, float t_max) const {
+        return scene.occluded(r, t_min, t_max);
+    }
+
+    bool scatter(const ray &, const record_type &record, vec3 &attenuation, ray &scattered, sampler &rng) const {
+        vec3 target = record.point + record.normal + random_in_unit_sphere(rng);
+        scattered = ray(record.point, target - record.point);
+        attenuation = vec3(0.5, 0.5, 0.5);
+        return true;
+    }
+
+    vec3 albedo(const record_type &) const {
+        return vec3(0.5, 0.5, 0.5);
+    }
+
+    bool specular(const record_type &) const {
+        return false;
+    }
+
+    vec3 emitted(const ray &r_in, const record_type &record) const {
+        return scene.emitted(r_in, record);
+    }
+
+    bool scatter_value(const record_type &record, const vec3 &direction, vec3 &value, float &pdf) const {
+        pdf = lambertian_pdf(record.normal, direction);
+        value = pdf * vec3(0.5, 0.5, 0.5);
+        return true;
+    }
+
+    const light_list *lights() const {
+        return scene.lights();
+    }
+
+    const Scene &scene;
+};
+
+inline bool russian_roulette(vec3 &throughput, int bounces, const render_settings &settings, sampler &rng) {
+    // After settings.roulette_depth bounces a path carries on with a probability equal to its largest throughput
+    // component and, when it does, is divided by that probability. The expected value stays the same,
+    // but paths that could only add a little light end early. Returns false if the path ends here
+    if (settings.roulette_depth <= 0 || bounces < settings.roulette_depth) {
+        return true;
+    }
+    rng.start_bounce(bounces - 1, SAMPLER_ROULETTE_DIMENSION);
+    float survival = std::max(throughput[0], std::max(throughput[1], throughput[2]));
+    if (survival >= 1.0f) {
+        return true;
+    }
+    survival = survival > ROULETTE_MIN_SURVIVAL ? survival : ROULETTE_MIN_SURVIVAL;
+    if (rng.next_float() >= survival) {
+        return false;
+    }
+    throughput /= survival;
+    return true;
+}
+
+template<typename ScatterValue>
+inline vec3 sample_direct_light(const light_list &lights, const vec3 &point, ScatterValue &&scatter_value,
+                                sampler &rng, ray &shadow, float &shadow_t_max) {
+    // Next event estimation at a surface whose scatter density is known (scatter_value(direction, value, pdf)
+    // is the surface's scatter_value): pick a point on a light, and return the light it would send back along
+    // the path if nothing is in the way, weighted against the chance that scattering would have found the same
+    // light by the power heuristic. Whether something is in the way is left to the caller, as an occlusion
+    // query along shadow up to shadow_t_max. Returns black, with no shadow ray to trace, when there is nothing
+    // to add
+    light_sample light;
+    vec3 value;
+    float scatter_pdf;
+    if (!lights.sample(point, rng, light) || !scatter_value(light.direction, value, scatter_pdf) ||
+        scatter_pdf <= 0) {
+        return vec3(0, 0, 0);
+    }
+    shadow = ray(point, light.direction);
+    shadow_t_max = light.distance - SHADOW_RAY_EPSILON;
+    return (power_heuristic(light.pdf, scatter_pdf) / light.pdf) * value * light.radiance;
+}
+
+template<typename Scene>
+inline vec3 trace_path(const ray &camera_ray, const Scene &world, const render_settings &settings, sampler &rng) {
+    // Follow one path from the camera, multiplying the attenuation of every surface it scatters off into the
+    // throughput, until it leaves the scene (and picks up the sky), is absorbed, loses at Russian roulette or
+    // hits a surface after settings.max_depth bounces. Emissive surfaces it hits add their light on the way.
+    // In a scene with lights every diffuse bounce also samples a light directly, and light found both ways is
+    // weighed by multiple importance sampling, so that small lights are found by the sampling that suits them
+    ray r = camera_ray;
+    vec3 throughput(1, 1, 1);
+    vec3 radiance(0, 0, 0);
+    const light_list *lights = world.lights();
+    bool sample_lights = settings.light_sampling && lights && !lights->empty();
+    // Density the last bounce picked r's direction with, 0 if light sampling could not have picked it too
+    float scatter_pdf = 0;
+    for (int depth = 0;; depth++) {
+        typename Scene::record_type record;
+        RT_STAT(if (depth == 0) thread_stats().primary_rays++; else thread_stats().secondary_rays++);
+        if (!world.intersect(r, 0.001, std::numeric_limits<float>::max(), record)) {
+            RT_STAT(thread_stats().end_path(depth));
+            return radiance + throughput * sky_color(r);
+        }
+        RT_STAT(thread_stats().ray_hits++);
+        vec3 emitted = world.emitted(r, record);
+        if (emitted[0] > 0 || emitted[1] > 0 || emitted[2] > 0) {
+            float weight = scatter_pdf > 0 && record.light >= 0
+                           ? power_heuristic(scatter_pdf, lights->pdf(r.origin(), record.light)) : 1.0f;
+            radiance += weight * throughput * emitted;
+        }
+        ray scattered;
+        vec3 attenuation;
+        if (depth >= settings.max_depth) {
+            RT_STAT(thread_stats().paths_cut_off++; thread_stats().end_path(depth));
+            return radiance;
+        }
+        if (sample_lights) {
+            rng.start_bounce(depth, SAMPLER_LIGHT_DIMENSION);
+            ray shadow;
+            float shadow_t_max = 0;
+            vec3 direct = sample_direct_light(*lights, record.point, [&](const vec3 &direction, vec3 &value, float &pdf) {
+                return world.scatter_value(record, direction, value, pdf);
+            }, rng, shadow, shadow_t_max);
+            if (direct[0] > 0 || direct[1] > 0 || direct[2] > 0) {
+                RT_STAT(thread_stats().shadow_rays++);
+                if (!world.occluded(shadow, 0.001, shadow_t_max)) {
+                    radiance += throughput * direct;
+                }
+            }
+        }
+        rng.start_bounce(depth);
+        if (!world.scatter(r, record, attenuation, scattered, rng)) {
+            RT_STAT(thread_stats().end_path(depth));
+            return radiance;
+        }
+        vec3 value;
+        if (!sample_lights || !world.scatter_value(record, scattered.direction(), value, scatter_pdf)) {
+            scatter_pdf = 0;
+        }
+        throughput *= attenuation;
+        if (!russian_roulette(throughput, depth + 1, settings, rng)) {
+            RT_STAT(thread_stats().paths_ended_by_roulette++; thread_stats().end_path(depth + 1));
+            return radiance;
+        }
+        r = scattered;
+    }
+}
+
+#endif //RAY_TRACING_INTEGRATOR_H
@@ -0,0 +1,150 @@
+
+#ifndef RAY_TRACING_LIGHT_H
+#define RAY_TRACING_LIGHT_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "accumulation_buffer.h"
+#include "sampler.h"
+#include "vec3.h"
+
+// Offset within a bounce's sampler dimensions of the three numbers next event estimation takes: which light,
+// then two for the direction towards it. They come after the scatter's and Russian roulette's
+const uint32_t SAMPLER_LIGHT_DIMENSION = 5;
+
+// Shadow rays stop this far in front of the light they aim at, so that they do not hit the light itself
+const float SHADOW_RAY_EPSILON = 0.001f;
+
+struct sphere_light {
+    // An emissive sphere of a scene. slot is where it sits in the scene's sphere arrays, which is how a hit on
+    // it is traced back to the light. chance is the probability that sample() picks it
+    int slot;
+    vec3 center;
+    float radius;
+    vec3 emit;
+    float chance;
+};
+
+struct light_sample {
+    // A direction towards a point on a light, the distance to that point and the light's radiance. pdf is the
+    // density of the direction per unit solid angle, with the chance of picking that light included
+    vec3 direction;
+    float distance;
+    vec3 radiance;
+    float pdf;
+};
+
+inline float power_heuristic(float pdf, float other_pdf) {
+    // Veach's power heuristic with an exponent of 2: the weight of a sample taken with density pdf when
+    // other_pdf is the density the other strategy would have taken it with
+    float a = pdf * pdf;
+    float b = other_pdf * other_pdf;
+    return a + b > 0 ? a / (a + b) : 0.0f;
+}
+
+inline float cone_one_minus_cos(const vec3 &point, const vec3 &center, float radius) {
+    // 1 - cos of the half angle of the cone of directions from point that hit the sphere, worked out from the
+    // squared sine so that a small or distant sphere does not lose it all to cancellation. 0 from inside
+    float distance_squared = (center - point).squared_length();
+    float radius_squared = radius * radius;
+    if (distance_squared <= radius_squared) {
+        return 0;
+    }
+    float sin_squared = radius_squared / distance_squared;
+    return sin_squared / (1 + std::sqrt(1 - sin_squared));
+}
+
+class light_list {
+    // The lights of a scene, for next event estimation: at each diffuse bounce a path picks one light with
+    // a chance proportional to its power and aims a shadow ray at it. The direction is drawn uniformly from the
+    // cone the sphere fills as seen from the point, which puts every sample on the light and keeps the
+    // density the same wherever the point is
+public:
+    void clear() {
+        lights.clear();
+        cumulative.clear();
+    }
+
+    // Add lights in increasing slot order, then call finish()
+    void add(int slot, const vec3 &center, float radius, const vec3 &emit) {
+        lights.push_back({slot, center, radius, emit, 0.0f});
+    }
+
+    // Work out the chance of each light from its power, emitted radiance times surface area
+    inline void finish();
+
+    bool empty() const { return lights.empty(); }
+
+    // Index of the light in sphere slot `slot`, or -1 if that sphere is not a light
+    int find(int slot) const {
+        auto found = std::lower_bound(lights.begin(), lights.end(), slot,
+                                      [](const sphere_light &l, int s) { return l.slot < s; });
+        return found != lights.end() && found->slot == slot ? int(found - lights.begin()) : -1;
+    }
+
+    // Pick a light and a direction towards it from point with the next three numbers of rng. Returns false,
+    // having used the same numbers, if point is inside the light it picked
+    inline bool sample(const vec3 &point, sampler &rng, light_sample &out) const;
+
+    // Density sample() has for the direction from origin that hits light `light`
+    float pdf(const vec3 &origin, int light) const {
+        const sphere_light &l = lights[light];
+        float one_minus_cos = cone_one_minus_cos(origin, l.center, l.radius);
+        return one_minus_cos > 0 ? l.chance / (float(2 * M_PI) * one_minus_cos) : 0.0f;
+    }
+
+    std::vector<sphere_light> lights;
+    // Running sum of the chances, the last entry is 1
+    std::vector<float> cumulative;
+};
+
+inline void light_list::finish() {
+    float total = 0;
+    for (const sphere_light &l : lights) {
+        total += luminance(l.emit) * l.radius * l.radius;
+    }
+    cumulative.clear();
+    float sum = 0;
+    for (sphere_light &l : lights) {
+        // Lights too dim to pick are still lights, a path that hits one counts its emission in full
+        l.chance = total > 0 ? luminance(l.emit) * l.radius * l.radius / total : 1.0f / float(lights.size());
+        sum += l.chance;
+        cumulative.push_back(sum);
+    }
+    if (!cumulative.empty()) {
+        cumulative.back() = 1.0f;
+    }
+}
+
+inline bool light_list::sample(const vec3 &point, sampler &rng, light_sample &out) const {
+    float pick = rng.next_float();
+    float u1 = rng.next_float();
+    float u2 = rng.next_float();
+    size_t index = size_t(std::upper_bound(cumulative.begin(), cumulative.end(), pick) - cumulative.begin());
+    const sphere_light &l = lights[std::min(index, lights.size() - 1)];
+    float one_minus_cos = cone_one_minus_cos(point, l.center, l.radius);
+    if (l.chance <= 0 || one_minus_cos <= 0) {
+        return false;
+    }
+    // Uniform in the cone: 1 - cos(theta) is uniform in [0, 1 - cos(theta max)]
+    float one_minus_cos_theta = u1 * one_minus_cos;
+    float cos_theta = 1 - one_minus_cos_theta;
+    float sin_theta = std::sqrt(std::max(0.0f, one_minus_cos_theta * (2 - one_minus_cos_theta)));
+    float phi = float(2 * M_PI) * u2;
+    vec3 to_center = l.center - point;
+    vec3 w = unit_vector(to_center);
+    vec3 u = unit_vector(cross(std::fabs(w[0]) > 0.9f ? vec3(0, 1, 0) : vec3(1, 0, 0), w));
+    vec3 v = cross(w, u);
+    out.direction = (sin_theta * std::cos(phi)) * u + (sin_theta * std::sin(phi)) * v + cos_theta * w;
+    // Nearer of the two points where the direction crosses the sphere, the rounding of a direction on the
+    // rim of the cone can leave it just outside, which is taken as touching
+    float along = dot(out.direction, to_center);
+    float miss = to_center.squared_length() - along * along;
+    out.distance = along - std::sqrt(std::max(0.0f, l.radius * l.radius - miss));
+    out.radiance = l.emit;
+    out.pdf = l.chance / (float(2 * M_PI) * one_minus_cos);
+    return true;
+}
+
+#endif //RAY_TRACING_LIGHT_H
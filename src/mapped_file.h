@@ -0,0 +1,52 @@
+
+#ifndef RAY_TRACING_MAPPED_FILE_H
+#define RAY_TRACING_MAPPED_FILE_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+class mapped_file {
+    // Read only memory mapping of a whole file. Pages are only read from disk when they are first touched,
+    // and a file mapped by several processes is shared between them through the page cache
+public:
+    // Map the file at path, or return nullptr if it cannot be opened or mapped
+    static std::shared_ptr<mapped_file> open(const std::string &path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return nullptr;
+        }
+        struct stat info{};
+        if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+            close(fd);
+            return nullptr;
+        }
+        void *address = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        // The mapping stays valid after the descriptor is closed
+        close(fd);
+        if (address == MAP_FAILED) {
+            return nullptr;
+        }
+        return std::shared_ptr<mapped_file>(new mapped_file(static_cast<const unsigned char *>(address),
+                                                            size_t(info.st_size)));
+    }
+
+    ~mapped_file() {
+        munmap(const_cast<unsigned char *>(data), size);
+    }
+
+    mapped_file(const mapped_file &) = delete;
+    mapped_file &operator=(const mapped_file &) = delete;
+
+    const unsigned char *data;
+    size_t size;
+
+private:
+    mapped_file(const unsigned char *d, size_t s) : data(d), size(s) {}
+};
+
+#endif //RAY_TRACING_MAPPED_FILE_H
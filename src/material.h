@@ -9,11 +9,40 @@ class metal;
 vec3 reflect(const vec3 &v, const vec3 &n);
 float schlick(float cosine, float ref_idx);
 
+// Concrete type of a material, so that batches of hits can be grouped by material and shaded without virtual calls.
+// scene_data keeps the kind in two bits of a material_id, so every kind but other has to stay below 4
+enum class material_kind { lambertian, metal, dielectric, emissive, other };
+
 class material {
 public:
-    virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const = 0;
+    virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, sampler &rng) const = 0;
+    virtual material_kind kind() const { return material_kind::other; }
+    // Colour of the surface itself, without any lighting, for the albedo buffer the denoiser is guided by.
+    // Surfaces that only bend light pass it through unchanged
+    virtual vec3 surface_albedo(const hit_record &rec) const { return vec3(1, 1, 1); }
+    // Whether the surface is a mirror with nothing of its own to see, so that the feature buffers look at
+    // whatever it shows. Glass is not one: a ray picks reflection or refraction at random, so what it shows
+    // comes out as noisy as the image
+    virtual bool specular() const { return false; }
+    // Light the surface gives off towards r_in's origin, added to a path whenever it hits the surface
+    virtual vec3 emitted(const ray &r_in, const hit_record &rec) const { return vec3(0, 0, 0); }
+    // For materials whose scatter() picks directions with a density that can be worked out: the density of
+    // direction, per unit solid angle, and the attenuation scatter() would give it times that density. Next
+    // event estimation needs both to weigh light arriving from a direction it chose itself. Returns false for
+    // the others, which only bounce light around by scatter()
+    virtual bool scatter_value(const hit_record &rec, const vec3 &direction, vec3 &value, float &pdf) const {
+        return false;
+    }
 };
 
+inline float lambertian_pdf(const vec3 &normal, const vec3 &direction) {
+    // Density of the directions lambertian::scatter() picks: normal plus a point in the unit ball. Along a
+    // direction at angle theta to the normal the ball spans a chord of 2 cos(theta) from the origin, so the
+    // density is the volume of that cone over the volume of the ball, 2 cos^3(theta) / pi
+    float cosine = dot(normal, unit_vector(direction));
+    return cosine > 0 ? float(2 / M_PI) * cosine * cosine * cosine : 0.0f;
+}
+
 vec3 reflect(const vec3 &v, const vec3 &n) {
     return v - (2*dot(v, n)*n);
 }
@@ -28,13 +57,23 @@ class lambertian : public material {
 public:
     lambertian(const vec3 &a) : albedo(a) {}
 
-    virtual bool scatter(const ray &r_in, const hit_record &record, vec3 &attenuation, ray &scattered) const {
-        vec3 target = record.point + record.normal + random_in_unit_sphere();
+    material_kind kind() const override { return material_kind::lambertian; }
+
+    vec3 surface_albedo(const hit_record &rec) const override { return albedo; }
+
+    virtual bool scatter(const ray &r_in, const hit_record &record, vec3 &attenuation, ray &scattered, sampler &rng) const {
+        vec3 target = record.point + record.normal + random_in_unit_sphere(rng);
         scattered = ray(record.point, target - record.point);
         attenuation = albedo;
         return true;
     }
 
+    bool scatter_value(const hit_record &rec, const vec3 &direction, vec3 &value, float &pdf) const override {
+        pdf = lambertian_pdf(rec.normal, direction);
+        value = pdf * albedo;
+        return true;
+    }
+
     vec3 albedo;
 };
 
@@ -42,9 +81,15 @@ class metal : public material {
 public:
     metal(const vec3 &a, float f) : albedo(a) {if (f < 1) fuzz = f; else fuzz = 1; }
 
-    virtual bool scatter(const ray &r_in, const hit_record &rec, vec3 &attenuation, ray &scattered) const {
+    material_kind kind() const override { return material_kind::metal; }
+
+    vec3 surface_albedo(const hit_record &rec) const override { return albedo; }
+
+    bool specular() const override { return fuzz == 0; }
+
+    virtual bool scatter(const ray &r_in, const hit_record &rec, vec3 &attenuation, ray &scattered, sampler &rng) const {
         vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-        scattered = ray(rec.point, reflected + fuzz*random_in_unit_sphere());
+        scattered = ray(rec.point, reflected + fuzz*random_in_unit_sphere(rng));
         attenuation = albedo;
         return (dot(scattered.direction(), rec.normal) > 0);
     }
@@ -69,7 +114,8 @@ bool refract(const vec3 &v, const vec3 &n, float ni_over_nt, vec3 &refracted) {
 class dielectric : public material {
 public:
     dielectric(float ri) : ref_idx(ri) {}
-    virtual bool scatter(const ray &r_in, const hit_record &rec, vec3 &attenuation, ray &scattered) const {
+    material_kind kind() const override { return material_kind::dielectric; }
+    virtual bool scatter(const ray &r_in, const hit_record &rec, vec3 &attenuation, ray &scattered, sampler &rng) const {
         vec3 outward_normal;
         vec3 reflected = reflect(r_in.direction(), rec.normal);
         float ni_over_nt;
@@ -97,7 +143,7 @@ public:
             reflect_prob = 1.0;
         }
 
-        if (get_random_number_0_to_1() < reflect_prob) {
+        if (rng.next_float() < reflect_prob) {
             scattered = ray(rec.point, reflected);
         }
         else {
@@ -108,6 +154,24 @@ public:
     float ref_idx;
 };
 
+class diffuse_light : public material {
+    // A surface that gives off emit on its front side, the side its normal points to, and reflects nothing
+public:
+    diffuse_light(const vec3 &e) : emit(e) {}
+
+    material_kind kind() const override { return material_kind::emissive; }
+
+    bool scatter(const ray &r_in, const hit_record &rec, vec3 &attenuation, ray &scattered, sampler &rng) const override {
+        return false;
+    }
+
+    vec3 emitted(const ray &r_in, const hit_record &rec) const override {
+        return dot(r_in.direction(), rec.normal) < 0 ? emit : vec3(0, 0, 0);
+    }
+
+    vec3 emit;
+};
+
 
 
 #endif //RAY_TRACING_MATERIAL_H
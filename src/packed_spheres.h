@@ -0,0 +1,374 @@
+
+#ifndef RAY_TRACING_PACKED_SPHERES_H
+#define RAY_TRACING_PACKED_SPHERES_H
+
+#include <cmath>
+#include <limits>
+#include <vector>
+#include "hittable.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RAY_TRACING_X86_SIMD 1
+#endif
+
+// Instruction sets the sphere kernels can be compiled for, from narrowest to widest
+enum class simd_level { scalar = 1, sse = 4, avx2 = 8, avx512 = 16 };
+
+inline simd_level detect_simd_level() {
+#ifdef RAY_TRACING_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return simd_level::avx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return simd_level::avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return simd_level::sse;
+    }
+#endif
+    return simd_level::scalar;
+}
+
+inline const char *simd_level_name(simd_level level) {
+    switch (level) {
+        case simd_level::avx512: return "avx512";
+        case simd_level::avx2: return "avx2";
+        case simd_level::sse: return "sse";
+        default: return "scalar";
+    }
+}
+
+// Spheres past the real ones so that the widest kernel can always load a full register
+const int PACKED_SPHERES_PADDING = 16;
+
+struct sphere_soa {
+    // Centers and radii of every sphere as separate float arrays ("structure of arrays"),
+    // so that one load brings in the same component of 4, 8 or 16 spheres
+    std::vector<float> center_x;
+    std::vector<float> center_y;
+    std::vector<float> center_z;
+    std::vector<float> radius;
+};
+
+struct sphere_soa_view {
+    // What the kernels read: the same four arrays as plain pointers, so they can point into a sphere_soa
+    // or straight into a memory mapped scene cache
+    const float *center_x;
+    const float *center_y;
+    const float *center_z;
+    const float *radius;
+};
+
+inline sphere_soa_view view_of(const sphere_soa &soa) {
+    return {soa.center_x.data(), soa.center_y.data(), soa.center_z.data(), soa.radius.data()};
+}
+
+// Signature shared by every kernel: find the closest sphere in [first, first + count) that the ray hits
+// with t in [t_min, t_max], lower t_max to its t and return its index, or return -1 if there is none.
+// Every kernel compares the roots before dividing them by a = dot(direction, direction) (against t_min * a and
+// t_max * a), so the one division happens only for the winning sphere
+typedef int (*sphere_kernel)(const sphere_soa_view &spheres, const vec3 &origin, const vec3 &direction,
+                             int first, int count, float t_min, float &t_max);
+
+inline int intersect_spheres_scalar(const sphere_soa_view &spheres, const vec3 &origin, const vec3 &direction,
+                                    int first, int count, float t_min, float &t_max) {
+    // Same quadratic as sphere::hit, one sphere at a time
+    float a = dot(direction, direction);
+    float lo = t_min * a;
+    float best = t_max * a;
+    int closest = -1;
+    for (int i = first; i < first + count; i++) {
+        float oc_x = origin[0] - spheres.center_x[i];
+        float oc_y = origin[1] - spheres.center_y[i];
+        float oc_z = origin[2] - spheres.center_z[i];
+        float half_b = oc_x * direction[0] + oc_y * direction[1] + oc_z * direction[2];
+        float c = (oc_x * oc_x + oc_y * oc_y + oc_z * oc_z) - spheres.radius[i] * spheres.radius[i];
+        float discriminant = half_b * half_b - a * c;
+        if (discriminant < 0) {
+            continue;
+        }
+        float sqrt_discriminant = std::sqrt(discriminant);
+        float root = -half_b - sqrt_discriminant;
+        if (root < lo || best < root) {
+            root = -half_b + sqrt_discriminant;
+            if (root < lo || best < root) {
+                continue;
+            }
+        }
+        best = root;
+        closest = i;
+    }
+    if (closest >= 0) {
+        t_max = best / a;
+    }
+    return closest;
+}
+
+#ifdef RAY_TRACING_X86_SIMD
+
+// The wide kernels all follow the same steps as the scalar one for W spheres at once: every lane keeps
+// its own closest t and index, lanes past the end of the range are masked off, and the lanes are reduced
+// to a single winner at the end. Each kernel is compiled for its own instruction set with a target
+// attribute, so the binary runs everywhere and picks the widest kernel the CPU supports at runtime
+
+inline int reduce_sphere_lanes(const float *lane_t, const int *lane_index, int lanes, float a, float &t_max) {
+    // lane_t holds roots still scaled by a, as are the bounds they are compared with
+    float best = t_max * a;
+    int closest = -1;
+    for (int l = 0; l < lanes; l++) {
+        if (lane_index[l] < 0) {
+            continue;
+        }
+        // Ties go to the lowest index so that every kernel agrees on which sphere was hit
+        if (closest < 0 ? lane_t[l] <= best : (lane_t[l] < best || (lane_t[l] == best && lane_index[l] < closest))) {
+            best = lane_t[l];
+            closest = lane_index[l];
+        }
+    }
+    if (closest >= 0) {
+        t_max = best / a;
+    }
+    return closest;
+}
+
+__attribute__((target("sse2")))
+inline int intersect_spheres_sse(const sphere_soa_view &spheres, const vec3 &origin, const vec3 &direction,
+                                 int first, int count, float t_min, float &t_max) {
+    const __m128 o_x = _mm_set1_ps(origin[0]), o_y = _mm_set1_ps(origin[1]), o_z = _mm_set1_ps(origin[2]);
+    const __m128 d_x = _mm_set1_ps(direction[0]), d_y = _mm_set1_ps(direction[1]), d_z = _mm_set1_ps(direction[2]);
+    const float a_scalar = dot(direction, direction);
+    const __m128 a = _mm_set1_ps(a_scalar);
+    const __m128 lo = _mm_set1_ps(t_min * a_scalar);
+    const __m128 zero = _mm_setzero_ps();
+    __m128 best_t = _mm_set1_ps(t_max * a_scalar);
+    __m128i best_index = _mm_set1_epi32(-1);
+    const __m128i lane = _mm_setr_epi32(0, 1, 2, 3);
+
+    for (int i = first; i < first + count; i += 4) {
+        __m128 oc_x = _mm_sub_ps(o_x, _mm_loadu_ps(&spheres.center_x[i]));
+        __m128 oc_y = _mm_sub_ps(o_y, _mm_loadu_ps(&spheres.center_y[i]));
+        __m128 oc_z = _mm_sub_ps(o_z, _mm_loadu_ps(&spheres.center_z[i]));
+        __m128 r = _mm_loadu_ps(&spheres.radius[i]);
+        __m128 half_b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(oc_x, d_x), _mm_mul_ps(oc_y, d_y)), _mm_mul_ps(oc_z, d_z));
+        __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(oc_x, oc_x), _mm_mul_ps(oc_y, oc_y)),
+                                         _mm_mul_ps(oc_z, oc_z)), _mm_mul_ps(r, r));
+        __m128 discriminant = _mm_sub_ps(_mm_mul_ps(half_b, half_b), _mm_mul_ps(a, c));
+        __m128 sqrt_discriminant = _mm_sqrt_ps(_mm_max_ps(discriminant, zero));
+        __m128 near_root = _mm_sub_ps(_mm_sub_ps(zero, half_b), sqrt_discriminant);
+        __m128 far_root = _mm_add_ps(_mm_sub_ps(zero, half_b), sqrt_discriminant);
+        __m128 near_ok = _mm_and_ps(_mm_cmpge_ps(near_root, lo), _mm_cmple_ps(near_root, best_t));
+        __m128 far_ok = _mm_and_ps(_mm_cmpge_ps(far_root, lo), _mm_cmple_ps(far_root, best_t));
+        __m128 root = _mm_or_ps(_mm_and_ps(near_ok, near_root), _mm_andnot_ps(near_ok, far_root));
+        __m128i index = _mm_add_epi32(_mm_set1_epi32(i), lane);
+        __m128 in_range = _mm_castsi128_ps(_mm_cmplt_epi32(index, _mm_set1_epi32(first + count)));
+        __m128 hit = _mm_and_ps(_mm_and_ps(_mm_or_ps(near_ok, far_ok), _mm_cmpge_ps(discriminant, zero)), in_range);
+        best_t = _mm_or_ps(_mm_and_ps(hit, root), _mm_andnot_ps(hit, best_t));
+        best_index = _mm_or_si128(_mm_and_si128(_mm_castps_si128(hit), index),
+                                  _mm_andnot_si128(_mm_castps_si128(hit), best_index));
+    }
+
+    alignas(16) float lane_t[4];
+    alignas(16) int lane_index[4];
+    _mm_store_ps(lane_t, best_t);
+    _mm_store_si128((__m128i *) lane_index, best_index);
+    return reduce_sphere_lanes(lane_t, lane_index, 4, a_scalar, t_max);
+}
+
+__attribute__((target("avx2")))
+inline int intersect_spheres_avx2(const sphere_soa_view &spheres, const vec3 &origin, const vec3 &direction,
+                                  int first, int count, float t_min, float &t_max) {
+    const __m256 o_x = _mm256_set1_ps(origin[0]), o_y = _mm256_set1_ps(origin[1]), o_z = _mm256_set1_ps(origin[2]);
+    const __m256 d_x = _mm256_set1_ps(direction[0]), d_y = _mm256_set1_ps(direction[1]);
+    const __m256 d_z = _mm256_set1_ps(direction[2]);
+    const float a_scalar = dot(direction, direction);
+    const __m256 a = _mm256_set1_ps(a_scalar);
+    const __m256 lo = _mm256_set1_ps(t_min * a_scalar);
+    const __m256 zero = _mm256_setzero_ps();
+    __m256 best_t = _mm256_set1_ps(t_max * a_scalar);
+    __m256i best_index = _mm256_set1_epi32(-1);
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+    for (int i = first; i < first + count; i += 8) {
+        __m256 oc_x = _mm256_sub_ps(o_x, _mm256_loadu_ps(&spheres.center_x[i]));
+        __m256 oc_y = _mm256_sub_ps(o_y, _mm256_loadu_ps(&spheres.center_y[i]));
+        __m256 oc_z = _mm256_sub_ps(o_z, _mm256_loadu_ps(&spheres.center_z[i]));
+        __m256 r = _mm256_loadu_ps(&spheres.radius[i]);
+        __m256 half_b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(oc_x, d_x), _mm256_mul_ps(oc_y, d_y)),
+                                      _mm256_mul_ps(oc_z, d_z));
+        __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(oc_x, oc_x), _mm256_mul_ps(oc_y, oc_y)),
+                                               _mm256_mul_ps(oc_z, oc_z)), _mm256_mul_ps(r, r));
+        __m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(half_b, half_b), _mm256_mul_ps(a, c));
+        __m256 sqrt_discriminant = _mm256_sqrt_ps(_mm256_max_ps(discriminant, zero));
+        __m256 near_root = _mm256_sub_ps(_mm256_sub_ps(zero, half_b), sqrt_discriminant);
+        __m256 far_root = _mm256_add_ps(_mm256_sub_ps(zero, half_b), sqrt_discriminant);
+        __m256 near_ok = _mm256_and_ps(_mm256_cmp_ps(near_root, lo, _CMP_GE_OQ),
+                                       _mm256_cmp_ps(near_root, best_t, _CMP_LE_OQ));
+        __m256 far_ok = _mm256_and_ps(_mm256_cmp_ps(far_root, lo, _CMP_GE_OQ),
+                                      _mm256_cmp_ps(far_root, best_t, _CMP_LE_OQ));
+        __m256 root = _mm256_blendv_ps(far_root, near_root, near_ok);
+        __m256i index = _mm256_add_epi32(_mm256_set1_epi32(i), lane);
+        __m256 in_range = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(first + count), index));
+        __m256 hit = _mm256_and_ps(_mm256_and_ps(_mm256_or_ps(near_ok, far_ok),
+                                                 _mm256_cmp_ps(discriminant, zero, _CMP_GE_OQ)), in_range);
+        best_t = _mm256_blendv_ps(best_t, root, hit);
+        best_index = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(best_index),
+                                                          _mm256_castsi256_ps(index), hit));
+    }
+
+    alignas(32) float lane_t[8];
+    alignas(32) int lane_index[8];
+    _mm256_store_ps(lane_t, best_t);
+    _mm256_store_si256((__m256i *) lane_index, best_index);
+    return reduce_sphere_lanes(lane_t, lane_index, 8, a_scalar, t_max);
+}
+
+__attribute__((target("avx512f"), optimize("fp-contract=off")))
+inline int intersect_spheres_avx512(const sphere_soa_view &spheres, const vec3 &origin, const vec3 &direction,
+                                    int first, int count, float t_min, float &t_max) {
+    const __m512 o_x = _mm512_set1_ps(origin[0]), o_y = _mm512_set1_ps(origin[1]), o_z = _mm512_set1_ps(origin[2]);
+    const __m512 d_x = _mm512_set1_ps(direction[0]), d_y = _mm512_set1_ps(direction[1]);
+    const __m512 d_z = _mm512_set1_ps(direction[2]);
+    const float a_scalar = dot(direction, direction);
+    const __m512 a = _mm512_set1_ps(a_scalar);
+    const __m512 lo = _mm512_set1_ps(t_min * a_scalar);
+    const __m512 zero = _mm512_setzero_ps();
+    __m512 best_t = _mm512_set1_ps(t_max * a_scalar);
+    __m512i best_index = _mm512_set1_epi32(-1);
+    const __m512i lane = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+
+    for (int i = first; i < first + count; i += 16) {
+        __m512 oc_x = _mm512_sub_ps(o_x, _mm512_loadu_ps(&spheres.center_x[i]));
+        __m512 oc_y = _mm512_sub_ps(o_y, _mm512_loadu_ps(&spheres.center_y[i]));
+        __m512 oc_z = _mm512_sub_ps(o_z, _mm512_loadu_ps(&spheres.center_z[i]));
+        __m512 r = _mm512_loadu_ps(&spheres.radius[i]);
+        __m512 half_b = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(oc_x, d_x), _mm512_mul_ps(oc_y, d_y)),
+                                      _mm512_mul_ps(oc_z, d_z));
+        __m512 c = _mm512_sub_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(oc_x, oc_x), _mm512_mul_ps(oc_y, oc_y)),
+                                               _mm512_mul_ps(oc_z, oc_z)), _mm512_mul_ps(r, r));
+        __m512 discriminant = _mm512_sub_ps(_mm512_mul_ps(half_b, half_b), _mm512_mul_ps(a, c));
+        __mmask16 real_roots = _mm512_cmp_ps_mask(discriminant, zero, _CMP_GE_OQ);
+        __m512 sqrt_discriminant = _mm512_maskz_sqrt_ps(real_roots, discriminant);
+        __m512 near_root = _mm512_sub_ps(_mm512_sub_ps(zero, half_b), sqrt_discriminant);
+        __m512 far_root = _mm512_add_ps(_mm512_sub_ps(zero, half_b), sqrt_discriminant);
+        __mmask16 near_ok = _mm512_cmp_ps_mask(near_root, lo, _CMP_GE_OQ) &
+                            _mm512_cmp_ps_mask(near_root, best_t, _CMP_LE_OQ);
+        __mmask16 far_ok = _mm512_cmp_ps_mask(far_root, lo, _CMP_GE_OQ) &
+                           _mm512_cmp_ps_mask(far_root, best_t, _CMP_LE_OQ);
+        __m512 root = _mm512_mask_blend_ps(near_ok, far_root, near_root);
+        __m512i index = _mm512_add_epi32(_mm512_set1_epi32(i), lane);
+        __mmask16 in_range = _mm512_cmplt_epi32_mask(index, _mm512_set1_epi32(first + count));
+        __mmask16 hit = (near_ok | far_ok) & real_roots & in_range;
+        best_t = _mm512_mask_blend_ps(hit, best_t, root);
+        best_index = _mm512_mask_blend_epi32(hit, best_index, index);
+    }
+
+    alignas(64) float lane_t[16];
+    alignas(64) int lane_index[16];
+    _mm512_store_ps(lane_t, best_t);
+    _mm512_store_si512(lane_index, best_index);
+    return reduce_sphere_lanes(lane_t, lane_index, 16, a_scalar, t_max);
+}
+
+#endif
+
+inline sphere_kernel select_sphere_kernel(simd_level level) {
+#ifdef RAY_TRACING_X86_SIMD
+    switch (level) {
+        case simd_level::avx512: return intersect_spheres_avx512;
+        case simd_level::avx2: return intersect_spheres_avx2;
+        case simd_level::sse: return intersect_spheres_sse;
+        default: break;
+    }
+#endif
+    return intersect_spheres_scalar;
+}
+
+
+class packed_spheres : public hittable {
+    // A collection of spheres stored as float arrays instead of separate sphere objects.
+    // One call tests a ray against a whole range of them with the widest SIMD kernel the CPU has,
+    // which is how the bvh tests its leaves when the scene is made only of spheres
+public:
+    packed_spheres() : packed_spheres(std::vector<const sphere *>()) {}
+
+    explicit packed_spheres(const std::vector<const sphere *> &list) {
+        for (const sphere *s : list) {
+            soa.center_x.push_back(s->center[0]);
+            soa.center_y.push_back(s->center[1]);
+            soa.center_z.push_back(s->center[2]);
+            soa.radius.push_back(s->radius);
+            materials.push_back(s->mat);
+        }
+        count = int(list.size());
+        // The padding spheres have a NaN radius, so their discriminant is never >= 0 and they are never hit
+        for (int i = 0; i < PACKED_SPHERES_PADDING; i++) {
+            soa.center_x.push_back(0);
+            soa.center_y.push_back(0);
+            soa.center_z.push_back(0);
+            soa.radius.push_back(std::numeric_limits<float>::quiet_NaN());
+        }
+        set_simd_level(detect_simd_level());
+    }
+
+    // Force a narrower kernel, e.g. to compare them, levels the CPU lacks fall back to what it has
+    void set_simd_level(simd_level requested) {
+        level = int(requested) < int(detect_simd_level()) ? requested : detect_simd_level();
+        kernel = select_sphere_kernel(level);
+    }
+
+    simd_level lanes() const { return level; }
+
+    // Closest sphere in [first, first + n) hit with t in [t_min, t_max]; lowers t_max to its t and returns
+    // its index, or returns -1
+    int closest_hit(const ray &r, int first, int n, float t_min, float &t_max) const {
+        RT_STAT(thread_stats().primitive_tests += n);
+        return kernel(view_of(soa), r.origin(), r.direction(), first, n, t_min, t_max);
+    }
+
+    void fill_record(const ray &r, int index, float t, hit_record &record) const {
+        vec3 center(soa.center_x[index], soa.center_y[index], soa.center_z[index]);
+        record.t = t;
+        record.point = r.point_given_parameter(t);
+        record.normal = (record.point - center) / soa.radius[index];
+        record.mat_ptr = materials[index];
+    }
+
+    bool intersect(const ray &r, float t_min, float &t_max, hit_id &id) const override {
+        int index = closest_hit(r, 0, count, t_min, t_max);
+        if (index < 0) {
+            return false;
+        }
+        id.object = this;
+        id.inner = nullptr;
+        id.primitive = uint32_t(index);
+        return true;
+    }
+
+    bool fill_record(const ray &r, const hit_id &id, float t, hit_record &record) const override {
+        fill_record(r, int(id.primitive), t, record);
+        return true;
+    }
+
+    bool bounding_box(aabb &output_box) const override {
+        if (count == 0) {
+            return false;
+        }
+        output_box = aabb();
+        for (int i = 0; i < count; i++) {
+            vec3 center(soa.center_x[i], soa.center_y[i], soa.center_z[i]);
+            vec3 extent(soa.radius[i], soa.radius[i], soa.radius[i]);
+            output_box.expand(aabb(center - extent, center + extent));
+        }
+        return true;
+    }
+
+    sphere_soa soa;
+    std::vector<material *> materials;
+    int count;
+    simd_level level;
+    sphere_kernel kernel;
+};
+
+#endif //RAY_TRACING_PACKED_SPHERES_H
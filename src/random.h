@@ -0,0 +1,48 @@
+
+#ifndef RAY_TRACING_RANDOM_H
+#define RAY_TRACING_RANDOM_H
+
+#include <cstdint>
+
+class pcg32 {
+    // Small, fast random number generator (PCG-XSH-RR by Melissa O'Neill) with 64 bits of state.
+    // Every generator is passed around explicitly, so nothing is shared between threads, and a
+    // generator is fully determined by its (seed, stream) pair. Different streams with the same seed
+    // give independent sequences, which is how every pixel gets its own reproducible random numbers
+public:
+    pcg32() { set_seed(0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL); }
+
+    pcg32(uint64_t seed, uint64_t stream) { set_seed(seed, stream); }
+
+    inline void set_seed(uint64_t seed, uint64_t stream) {
+        state = 0;
+        inc = (stream << 1u) | 1u;
+        next_uint();
+        state += seed;
+        next_uint();
+    }
+
+    inline uint32_t next_uint() {
+        uint64_t old_state = state;
+        state = old_state * 6364136223846793005ULL + inc;
+        uint32_t xor_shifted = uint32_t(((old_state >> 18u) ^ old_state) >> 27u);
+        uint32_t rotation = uint32_t(old_state >> 59u);
+        return (xor_shifted >> rotation) | (xor_shifted << ((-rotation) & 31u));
+    }
+
+    // Uniform float in [0, 1)
+    // Keep the top 24 bits so that the result fits a float exactly and never rounds up to 1
+    inline float next_float() {
+        return (next_uint() >> 8) * (1.0f / 16777216.0f);
+    }
+
+    uint64_t state;
+    uint64_t inc;
+};
+
+// Streams reserved for things other than pixels, kept far above any pixel index
+const uint64_t SCENE_STREAM = 1ULL << 62;
+// Added to the seed of the feature buffers' samplers, to keep them apart from the passes' seeds
+const uint64_t AOV_STREAM = 1ULL << 61;
+
+#endif //RAY_TRACING_RANDOM_H
@@ -0,0 +1,437 @@
+
+#ifndef RAY_TRACING_RENDER_SERVER_H
+#define RAY_TRACING_RENDER_SERVER_H
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "colour_gradient.h"
+
+// Longest request line a socket client may send before the connection is dropped
+const size_t SERVER_MAX_LINE = 1 << 16;
+
+struct resident_scene {
+    // A scene kept in memory from one job to the next with its bvh built: a scene file in one layout, or the
+    // random scene of one seed and layout. A scene file is loaded again when it changes on disk
+    std::unique_ptr<scene_data> loaded;
+    // Owns the random scene, and the objects of a scene file in the objects layout
+    scene_arena arena;
+    hittable *world = nullptr;
+    scene_description description;
+    // Modification time of the scene file when it was loaded
+    struct timespec modified{};
+};
+
+inline std::string json_string(const std::string &text) {
+    std::string quoted = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        } else if ((unsigned char) c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            quoted += escaped;
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+// Three comma separated numbers, as in --lookfrom 13,2,3
+inline bool parse_vec3(const std::string &text, vec3 &v) {
+    char end;
+    return sscanf(text.c_str(), "%f,%f,%f%c", &v[0], &v[1], &v[2], &end) == 3;
+}
+
+class render_server {
+    // Long running renderer that keeps its scenes in memory between jobs, so that a job on a scene it has seen
+    // before only pays for tracing. Requests come one per line, on stdin or over a Unix domain socket, and each
+    // gets one line of JSON back. The requests are:
+    //     render [--option value]...
+    //     load <scene file>
+    //     unload <scene file | random [seed] | all>
+    //     quit
+    // A render job takes the command line options that describe an image (--scene, --output, --width,
+    // --samples, --seed, --crop, --integrator, --denoise and so on, each starting from the server's own
+    // settings), plus camera overrides: --lookfrom x,y,z, --lookat x,y,z, --vup x,y,z, --fov degrees,
+    // --aperture a and --focus-distance d. Without --scene it renders the scene the server was started with,
+    // or failing that the random scene of its seed. The reply comes once the image is written, with the time
+    // spent loading the scene (0 when it was resident) and rendering, and with RT_ENABLE_STATS the ray counts.
+    // It is an error if the image, or a feature buffer written next to it, could not be written.
+    // Sequences (--frames) and worker processes (--workers) are not available to jobs: a sequence moves the
+    // objects of the scene it renders, and forking a process that runs threads is unsafe
+public:
+    // A scene the renderer has loaded from scene_path becomes the first resident scene and the default of jobs
+    inline render_server(colour_gradient &renderer, const std::string &scene_path);
+
+    // Answer requests from stdin on stdout until quit or the end of the input
+    inline bool serve_stdio();
+
+    // Answer requests on a Unix domain socket at path, one connection at a time, until a client sends quit
+    inline bool serve_socket(const std::string &path);
+
+    // Handle one request line, returning the reply. Sets quit on a quit request
+    inline std::string handle(const std::string &line, bool &quit);
+
+private:
+    inline std::string render(const std::vector<std::string> &words);
+
+    // Drop the resident random scenes whose key starts with prefix ("random <seed> <layout>"), returns how many
+    inline size_t unload_random(const std::string &prefix);
+
+    // The resident scene of a scene file, loaded if it is not resident or has changed on disk; or with an
+    // empty path, the random scene of the current seed and layout. Returns nullptr if loading failed
+    inline resident_scene *scene(const std::string &path, bool &was_resident);
+
+    colour_gradient &gradient;
+    std::string default_scene;
+    std::map<std::string, std::unique_ptr<resident_scene>> scenes;
+};
+
+inline bool modified_time(const std::string &path, struct timespec &modified) {
+    struct stat info{};
+    if (stat(path.c_str(), &info) != 0) {
+        return false;
+    }
+    modified = info.st_mtim;
+    return true;
+}
+
+inline render_server::render_server(colour_gradient &renderer, const std::string &scene_path)
+        : gradient(renderer) {
+    std::unique_ptr<resident_scene> first(new resident_scene());
+    if (!gradient.loaded_scene || !modified_time(scene_path, first->modified)) {
+        return;
+    }
+    first->loaded = std::move(gradient.loaded_scene);
+    first->world = first->loaded.get();
+    first->description = gradient.loaded_description;
+    default_scene = scene_path;
+    scenes[scene_path] = std::move(first);
+}
+
+inline resident_scene *render_server::scene(const std::string &path, bool &was_resident) {
+    bool objects = gradient.settings.layout == scene_layout::objects;
+    std::string key = path.empty() ? "random " + std::to_string(gradient.settings.seed) +
+                                     (objects ? " objects" : " data")
+                                   : path + (objects ? " objects" : "");
+    struct timespec modified{};
+    if (!path.empty() && !modified_time(path, modified)) {
+        cerr << "Could not open scene " << path << "\n";
+        return nullptr;
+    }
+    auto found = scenes.find(key);
+    if (found != scenes.end() && found->second->modified.tv_sec == modified.tv_sec &&
+        found->second->modified.tv_nsec == modified.tv_nsec) {
+        was_resident = true;
+        return found->second.get();
+    }
+    was_resident = false;
+    std::unique_ptr<resident_scene> loaded(new resident_scene());
+    if (path.empty()) {
+        loaded->world = gradient.build_random_scene(loaded->arena);
+    } else {
+        loaded->loaded.reset(new scene_data());
+        if (!load_scene(path, *loaded->loaded, loaded->description)) {
+            return nullptr;
+        }
+        loaded->world = objects ? object_world(*loaded->loaded, loaded->arena) : loaded->loaded.get();
+        loaded->modified = modified;
+    }
+    resident_scene *result = loaded.get();
+    scenes[key] = std::move(loaded);
+    return result;
+}
+
+inline size_t render_server::unload_random(const std::string &prefix) {
+    size_t dropped = 0;
+    for (auto it = scenes.begin(); it != scenes.end();) {
+        if (it->first.compare(0, prefix.size(), prefix) == 0) {
+            it = scenes.erase(it);
+            dropped++;
+        } else {
+            ++it;
+        }
+    }
+    return dropped;
+}
+
+inline std::string render_server::handle(const std::string &line, bool &quit) {
+    std::istringstream in(line);
+    std::vector<std::string> words;
+    std::string word;
+    while (in >> word) {
+        words.push_back(word);
+    }
+    quit = false;
+    if (words.empty()) {
+        return "{\"status\": \"error\", \"message\": \"empty request\"}";
+    }
+    if (words[0] == "quit") {
+        quit = true;
+        return "{\"status\": \"ok\"}";
+    }
+    if (words[0] == "render") {
+        return render(words);
+    }
+    if (words[0] == "load" && words.size() == 2) {
+        auto start = chrono::steady_clock::now();
+        bool was_resident;
+        if (!scene(words[1], was_resident)) {
+            return "{\"status\": \"error\", \"message\": " + json_string("could not load " + words[1]) + "}";
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        return "{\"status\": \"ok\", \"scene\": " + json_string(words[1]) + ", \"load_seconds\": " +
+               std::to_string(was_resident ? 0.0 : seconds) + "}";
+    }
+    if (words[0] == "unload" && words.size() == 3 && words[1] == "random") {
+        // The random scene of one seed, in both layouts
+        std::string prefix = "random " + std::to_string((unsigned int) strtoul(words[2].c_str(), nullptr, 10)) + " ";
+        if (unload_random(prefix) == 0) {
+            return "{\"status\": \"error\", \"message\": " +
+                   json_string("the random scene of seed " + words[2] + " is not loaded") + "}";
+        }
+        return "{\"status\": \"ok\"}";
+    }
+    if (words[0] == "unload" && words.size() == 2) {
+        if (words[1] == "all") {
+            scenes.clear();
+        } else if (words[1] == "random") {
+            // Every random scene, whatever its seed or layout, and a scene file that happens to be called random
+            if (unload_random("random ") + scenes.erase(words[1]) + scenes.erase(words[1] + " objects") == 0) {
+                return "{\"status\": \"error\", \"message\": \"no random scene is loaded\"}";
+            }
+        } else if (scenes.erase(words[1]) + scenes.erase(words[1] + " objects") == 0) {
+            return "{\"status\": \"error\", \"message\": " + json_string(words[1] + " is not loaded") + "}";
+        }
+        return "{\"status\": \"ok\"}";
+    }
+    return "{\"status\": \"error\", \"message\": " + json_string("unknown request " + line) + "}";
+}
+
+inline std::string render_server::render(const std::vector<std::string> &words) {
+    // Every job starts from the server's own size, samples and settings, and leaves them as it found them
+    struct restore {
+        render_server &server;
+        int x_pixels, y_pixels, ns;
+        render_settings settings;
+
+        ~restore() {
+            server.gradient.x_pixels = x_pixels;
+            server.gradient.y_pixels = y_pixels;
+            server.gradient.ns = ns;
+            server.gradient.settings = settings;
+            server.gradient.world_override = nullptr;
+        }
+    } restore_after{*this, gradient.x_pixels, gradient.y_pixels, gradient.ns, gradient.settings};
+
+    if (words.size() % 2 != 1) {
+        return "{\"status\": \"error\", \"message\": \"every option needs a value\"}";
+    }
+    // The scene goes first, so that the other options override the size, samples and seed it sets.
+    // The random scene depends on the seed, so it is picked after the options
+    std::string scene_path = default_scene;
+    for (size_t i = 1; i < words.size(); i += 2) {
+        if (words[i] == "--scene") {
+            scene_path = words[i + 1];
+        } else if (words[i] == "--seed" || words[i] == "--scene-layout") {
+            gradient.set_option(words[i], words[i + 1]);
+        }
+    }
+    auto start = chrono::steady_clock::now();
+    bool was_resident = false;
+    resident_scene *resident = scene(scene_path, was_resident);
+    if (!resident) {
+        return "{\"status\": \"error\", \"message\": " + json_string("could not load " + scene_path) + "}";
+    }
+    double load_seconds = was_resident ? 0.0 : chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    const scene_description &description = resident->description;
+    if (description.width > 0) {
+        gradient.x_pixels = description.width;
+        gradient.y_pixels = description.height;
+        gradient.ns = description.samples;
+    }
+    if (description.has_seed) {
+        gradient.settings.seed = description.seed;
+    }
+
+    std::string output = "render.png";
+    camera_settings view = description.view;
+    for (size_t i = 1; i < words.size(); i += 2) {
+        const std::string &name = words[i];
+        const std::string &value = words[i + 1];
+        bool valid = true;
+        if (name == "--scene") {
+            continue;
+        } else if (name == "--output") {
+            output = value;
+        } else if (name == "--lookfrom") {
+            valid = parse_vec3(value, view.lookfrom);
+        } else if (name == "--lookat") {
+            valid = parse_vec3(value, view.lookat);
+        } else if (name == "--vup") {
+            valid = parse_vec3(value, view.vup);
+        } else if (name == "--fov") {
+            view.vertical_fov = float(atof(value.c_str()));
+        } else if (name == "--aperture") {
+            view.aperture = float(atof(value.c_str()));
+        } else if (name == "--focus-distance") {
+            view.focus_dist = float(atof(value.c_str()));
+        } else if (name == "--frames" || name == "--workers") {
+            return "{\"status\": \"error\", \"message\": " + json_string(name + " is not available to jobs") + "}";
+        } else {
+            option_status status = gradient.set_option(name, value);
+            if (status == option_status::unknown) {
+                return "{\"status\": \"error\", \"message\": " + json_string("unknown option " + name) + "}";
+            }
+            valid = status == option_status::applied;
+        }
+        if (!valid) {
+            return "{\"status\": \"error\", \"message\": " + json_string("bad value " + value + " for " + name) + "}";
+        }
+    }
+    gradient.settings.frames = 0;
+    gradient.settings.workers = 0;
+    int x_begin, y_begin, x_end, y_end;
+    if (gradient.x_pixels <= 0 || gradient.y_pixels <= 0 || gradient.ns <= 0 ||
+        !gradient.crop_bounds(x_begin, y_begin, x_end, y_end)) {
+        return "{\"status\": \"error\", \"message\": \"empty image, or crop window outside it\"}";
+    }
+
+    gradient.world_override = resident->world;
+    gradient.view_override = view;
+    auto render_start = chrono::steady_clock::now();
+    if (!gradient.draw_random_scene(output)) {
+        return "{\"status\": \"error\", \"message\": " +
+               json_string("checkpoint " + gradient.settings.checkpoint_path + " is of another render") + "}";
+    }
+    bool written = gradient.wait_for_writes();
+    double render_seconds = chrono::duration<double>(chrono::steady_clock::now() - render_start).count();
+    if (!written) {
+        return "{\"status\": \"error\", \"message\": " + json_string("could not write " + output) + "}";
+    }
+
+    std::ostringstream reply;
+    reply << "{\"status\": \"ok\", \"output\": " << json_string(output)
+          << ", \"scene\": " << json_string(scene_path.empty() ? "random" : scene_path)
+          << ", \"resident\": " << (was_resident ? "true" : "false")
+          << ", \"width\": " << x_end - x_begin << ", \"height\": " << y_end - y_begin
+          << ", \"samples\": " << gradient.ns << ", \"load_seconds\": " << load_seconds
+          << ", \"render_seconds\": " << render_seconds;
+#ifdef RT_ENABLE_STATS
+    render_stats stats = merged_stats();
+    uint64_t rays = stats.primary_rays + stats.secondary_rays;
+    reply << ", \"rays\": " << rays << ", \"rays_per_second\": " << double(rays) / render_seconds;
+#endif
+    reply << "}";
+    return reply.str();
+}
+
+inline bool render_server::serve_stdio() {
+    std::string line;
+    while (std::getline(std::cin, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        bool quit;
+        std::cout << handle(line, quit) << std::endl;
+        if (quit) {
+            break;
+        }
+    }
+    return true;
+}
+
+inline bool render_server::serve_socket(const std::string &path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        cerr << "Socket path " << path << " is too long\n";
+        return false;
+    }
+    strcpy(address.sun_path, path.c_str());
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    // A socket file left behind by a server that did not shut down cleanly would make bind fail
+    unlink(path.c_str());
+    if (listener < 0 || bind(listener, (sockaddr *) &address, sizeof(address)) != 0 || listen(listener, 8) != 0) {
+        cerr << "Could not listen on " << path << ": " << strerror(errno) << "\n";
+        if (listener >= 0) {
+            close(listener);
+        }
+        return false;
+    }
+    cerr << "Listening on " << path << "\n";
+
+    bool quit = false;
+    while (!quit) {
+        int connection = accept(listener, nullptr, nullptr);
+        if (connection < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            cerr << "accept failed: " << strerror(errno) << "\n";
+            break;
+        }
+        // Requests are read in whatever pieces they arrive and answered a whole line at a time.
+        // MSG_NOSIGNAL keeps a client that hangs up early from killing the server with SIGPIPE
+        std::string pending;
+        char buffer[4096];
+        bool open = true;
+        while (open && !quit) {
+            ssize_t n = read(connection, buffer, sizeof(buffer));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            pending.append(buffer, size_t(n));
+            size_t newline;
+            while (!quit && (newline = pending.find('\n')) != std::string::npos) {
+                std::string line = pending.substr(0, newline);
+                pending.erase(0, newline + 1);
+                if (!line.empty() && line.back() == '\r') {
+                    line.pop_back();
+                }
+                if (line.empty() || line[0] == '#') {
+                    continue;
+                }
+                std::string reply = handle(line, quit) + "\n";
+                for (size_t sent = 0; sent < reply.size();) {
+                    ssize_t m = send(connection, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL);
+                    if (m < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    if (m <= 0) {
+                        open = false;
+                        break;
+                    }
+                    sent += size_t(m);
+                }
+            }
+            if (pending.size() > SERVER_MAX_LINE) {
+                cerr << "Dropping a client whose request is longer than " << SERVER_MAX_LINE << " bytes\n";
+                break;
+            }
+        }
+        close(connection);
+    }
+    close(listener);
+    unlink(path.c_str());
+    return true;
+}
+
+#endif //RAY_TRACING_RENDER_SERVER_H
@@ -0,0 +1,85 @@
+
+#ifndef RAY_TRACING_RENDER_SETTINGS_H
+#define RAY_TRACING_RENDER_SETTINGS_H
+
+#include <string>
+
+// How the colour of a camera ray is computed: depth first one path at a time (trace_path),
+// or breadth first over a whole tile of paths with material sorted queues (wavefront_integrator)
+enum class integrator_kind { recursive, wavefront };
+
+// How the scene is stored: as hittable and material objects behind virtual calls, or as the flat
+// typed arrays of scene_data that the recursive integrator can use without any virtual call
+enum class scene_layout { objects, data };
+
+// Where the random numbers of a sample come from: an independent pcg32 stream per sample, or one of the low
+// discrepancy sequences of sampler.h, which spread the samples of a pixel more evenly than independent ones
+enum class sampler_kind { independent, sobol, halton, blue_noise };
+
+// What colour_gradient::set_option() made of an option: taken, not one of its options, or a value it could not use
+enum class option_status { applied, unknown, invalid };
+
+// Part of the image to render, in pixels of the written image: x from its left edge and y from its top row.
+// The camera still frames the whole image, only the pixels inside the window are traced and written
+struct crop_window {
+    int x = 0;
+    int y = 0;
+    // 0 for the whole image
+    int width = 0;
+    int height = 0;
+};
+
+struct render_settings {
+    // Number of worker threads, 0 means one per hardware thread
+    int threads = 0;
+    // Worker processes to hand tiles out to, 0 renders everything in this process with the threads above
+    int workers = 0;
+    // Width and height in pixels of the square tiles handed out to the workers
+    int tile_size = 32;
+    // Seed for the scene and for the random stream of every pixel
+    unsigned int seed = 1;
+    integrator_kind integrator = integrator_kind::recursive;
+    // Sobol reaches the noise of independent sampling in about half the samples, see sampler.h
+    sampler_kind sampler = sampler_kind::sobol;
+    // Bounces after which a path that still hits something is cut off (and contributes nothing)
+    int max_depth = 50;
+    // Bounces after which Russian roulette may end a path early, 0 turns it off. Starting later keeps the
+    // variance close to full length paths in the sky lit scenes, starting earlier saves more rays
+    int roulette_depth = 5;
+    // Sample the scene's lights directly at every diffuse bounce (next event estimation). Off leaves lights
+    // to the paths that happen to hit them, which converges to the same image far more slowly
+    bool light_sampling = true;
+    // Shade every surface as grey lambertian
+    bool matte = false;
+    // Filter the finished image with the edge avoiding denoiser, guided by the feature buffers
+    bool denoise = false;
+    // Write the normal, albedo and depth feature buffers next to the image
+    bool write_aovs = false;
+    // Render this many frames of the scene's animation instead of one image, 0 takes the count from the scene
+    int frames = 0;
+    // Scenes that scene_data cannot express fall back to objects
+    scene_layout layout = scene_layout::data;
+    crop_window crop;
+
+    // Progressive rendering: accumulate a few samples per pixel at a time instead of all at once
+    bool progressive = false;
+    int samples_per_pass = 1;
+    // Passes between preview images, 0 for no previews
+    int preview_every = 8;
+    // Where to save the accumulation buffer, empty for no checkpoints
+    std::string checkpoint_path;
+    // Seconds between checkpoints
+    float checkpoint_interval = 60.0f;
+    // Start from the checkpoint if there is one
+    bool resume = false;
+
+    // Adaptive sampling: after min_spp samples everywhere, keep sampling only the pixels whose relative error
+    // (standard error of the mean over the mean) is above noise_threshold, until they reach max_spp or the
+    // average of ns samples per pixel is spent. max_spp of 0 means four times ns
+    bool adaptive = false;
+    int min_spp = 8;
+    int max_spp = 0;
+    float noise_threshold = 0.02f;
+};
+
+#endif //RAY_TRACING_RENDER_SETTINGS_H
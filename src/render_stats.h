@@ -0,0 +1,191 @@
+
+#ifndef RAY_TRACING_RENDER_STATS_H
+#define RAY_TRACING_RENDER_STATS_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Counters of where a render spends its work. They are only compiled in when RT_ENABLE_STATS is defined
+// (the RT_ENABLE_STATS CMake option), otherwise every RT_STAT(...) expands to nothing and costs nothing.
+// Each thread counts into its own render_stats and the renderer merges them once a frame is done
+#ifdef RT_ENABLE_STATS
+#define RT_STAT(...) do { __VA_ARGS__; } while (0)
+#else
+#define RT_STAT(...) do {} while (0)
+#endif
+
+// Bounce depths past this all land in the last histogram bucket
+const int RENDER_STATS_MAX_DEPTH = 64;
+
+struct render_counters {
+    // The counts of render_stats, in a plain struct that a worker process can send back as it is
+    // Rays traced against the scene, camera rays and bounces, and how many of them hit something
+    uint64_t primary_rays = 0;
+    uint64_t secondary_rays = 0;
+    uint64_t ray_hits = 0;
+    // Occlusion queries towards lights, from next event estimation
+    uint64_t shadow_rays = 0;
+    // Ray against primitive tests (a sphere, or a lane of a SIMD kernel) and ray against bvh node box tests
+    uint64_t primitive_tests = 0;
+    uint64_t node_tests = 0;
+    // Points drawn in the unit ball (diffuse and fuzzy bounces) and on the lens
+    uint64_t unit_sphere_calls = 0;
+    uint64_t unit_disk_calls = 0;
+    // Paths that still hit something when they reached the maximum depth
+    uint64_t paths_cut_off = 0;
+    // Paths ended by Russian roulette
+    uint64_t paths_ended_by_roulette = 0;
+    // Number of paths that ended after each number of bounces
+    uint64_t depth_histogram[RENDER_STATS_MAX_DEPTH + 1] = {};
+
+    void end_path(int depth) {
+        depth_histogram[depth < RENDER_STATS_MAX_DEPTH ? depth : RENDER_STATS_MAX_DEPTH]++;
+    }
+
+    inline void merge_counters(const render_counters &other);
+};
+
+struct render_stats : render_counters {
+    // Wall time spent in each tile, summed over passes, indexed by tile::index
+    std::vector<double> tile_seconds;
+
+    void add_tile_time(int tile, double seconds) {
+        if (tile_seconds.size() <= size_t(tile)) {
+            tile_seconds.resize(size_t(tile) + 1, 0.0);
+        }
+        tile_seconds[tile] += seconds;
+    }
+
+    inline void merge(const render_stats &other);
+
+    // Write the counters as a JSON object, frame_seconds is the wall time of the whole frame
+    inline bool write_json(const std::string &filename, double frame_seconds) const;
+};
+
+inline void render_counters::merge_counters(const render_counters &other) {
+    primary_rays += other.primary_rays;
+    secondary_rays += other.secondary_rays;
+    ray_hits += other.ray_hits;
+    shadow_rays += other.shadow_rays;
+    primitive_tests += other.primitive_tests;
+    node_tests += other.node_tests;
+    unit_sphere_calls += other.unit_sphere_calls;
+    unit_disk_calls += other.unit_disk_calls;
+    paths_cut_off += other.paths_cut_off;
+    paths_ended_by_roulette += other.paths_ended_by_roulette;
+    for (int d = 0; d <= RENDER_STATS_MAX_DEPTH; d++) {
+        depth_histogram[d] += other.depth_histogram[d];
+    }
+}
+
+inline void render_stats::merge(const render_stats &other) {
+    merge_counters(other);
+    for (size_t t = 0; t < other.tile_seconds.size(); t++) {
+        add_tile_time(int(t), other.tile_seconds[t]);
+    }
+}
+
+inline bool render_stats::write_json(const std::string &filename, double frame_seconds) const {
+    FILE *file = fopen(filename.c_str(), "w");
+    if (!file) {
+        return false;
+    }
+    uint64_t rays = primary_rays + secondary_rays;
+    fprintf(file, "{\n  \"frame_seconds\": %.6f,\n  \"rays_per_second\": %.1f,\n", frame_seconds,
+            frame_seconds > 0 ? double(rays) / frame_seconds : 0.0);
+    fprintf(file, "  \"primary_rays\": %llu,\n  \"secondary_rays\": %llu,\n  \"ray_hits\": %llu,\n",
+            (unsigned long long) primary_rays, (unsigned long long) secondary_rays, (unsigned long long) ray_hits);
+    fprintf(file, "  \"shadow_rays\": %llu,\n", (unsigned long long) shadow_rays);
+    fprintf(file, "  \"primitive_tests\": %llu,\n  \"node_tests\": %llu,\n",
+            (unsigned long long) primitive_tests, (unsigned long long) node_tests);
+    fprintf(file, "  \"unit_sphere_calls\": %llu,\n  \"unit_disk_calls\": %llu,\n",
+            (unsigned long long) unit_sphere_calls, (unsigned long long) unit_disk_calls);
+    fprintf(file, "  \"paths_cut_off\": %llu,\n  \"paths_ended_by_roulette\": %llu,\n  \"depth_histogram\": [",
+            (unsigned long long) paths_cut_off, (unsigned long long) paths_ended_by_roulette);
+    // Trailing empty buckets are left out
+    int last = RENDER_STATS_MAX_DEPTH;
+    while (last > 0 && depth_histogram[last] == 0) {
+        last--;
+    }
+    for (int d = 0; d <= last; d++) {
+        fprintf(file, "%s%llu", d ? ", " : "", (unsigned long long) depth_histogram[d]);
+    }
+    fprintf(file, "],\n  \"tile_seconds\": [");
+    for (size_t t = 0; t < tile_seconds.size(); t++) {
+        fprintf(file, "%s%.6f", t ? ", " : "", tile_seconds[t]);
+    }
+    fprintf(file, "]\n}\n");
+    return fclose(file) == 0;
+}
+
+// Where the stats of an image go: its name with the extension replaced, "scene.png" gives "scene.stats.json"
+inline std::string stats_filename(const std::string &image_filename) {
+    size_t dot = image_filename.find_last_of('.');
+    size_t slash = image_filename.find_last_of('/');
+    bool has_extension = dot != std::string::npos && (slash == std::string::npos || dot > slash);
+    return (has_extension ? image_filename.substr(0, dot) : image_filename) + ".stats.json";
+}
+
+// Adds the time between its construction and destruction to a tile, and does nothing without RT_ENABLE_STATS
+struct tile_timer {
+#ifdef RT_ENABLE_STATS
+    explicit tile_timer(int t) : tile(t), start(std::chrono::steady_clock::now()) {}
+    inline ~tile_timer();
+
+    int tile;
+    std::chrono::steady_clock::time_point start;
+#else
+    explicit tile_timer(int) {}
+#endif
+};
+
+// Every thread's counters, kept alive after the thread exits so that nothing is lost before the merge
+inline std::mutex &stats_registry_lock() {
+    static std::mutex lock;
+    return lock;
+}
+
+inline std::vector<std::unique_ptr<render_stats>> &stats_registry() {
+    static std::vector<std::unique_ptr<render_stats>> registry;
+    return registry;
+}
+
+// The calling thread's counters, only that thread writes to them
+inline render_stats &thread_stats() {
+    thread_local render_stats *stats = [] {
+        std::lock_guard<std::mutex> guard(stats_registry_lock());
+        stats_registry().emplace_back(new render_stats());
+        return stats_registry().back().get();
+    }();
+    return *stats;
+}
+
+// Sum of every thread's counters. Only call these while no thread is rendering
+inline render_stats merged_stats() {
+    std::lock_guard<std::mutex> guard(stats_registry_lock());
+    render_stats total;
+    for (const auto &stats : stats_registry()) {
+        total.merge(*stats);
+    }
+    return total;
+}
+
+inline void reset_stats() {
+    std::lock_guard<std::mutex> guard(stats_registry_lock());
+    for (auto &stats : stats_registry()) {
+        *stats = render_stats();
+    }
+}
+
+#ifdef RT_ENABLE_STATS
+inline tile_timer::~tile_timer() {
+    thread_stats().add_tile_time(tile, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+}
+#endif
+
+#endif //RAY_TRACING_RENDER_STATS_H
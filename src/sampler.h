@@ -0,0 +1,386 @@
+
+#ifndef RAY_TRACING_SAMPLER_H
+#define RAY_TRACING_SAMPLER_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "random.h"
+#include "render_settings.h"
+
+// Dimensions of a sample the camera ray uses: two for the position in the pixel and two for the lens
+const uint32_t SAMPLER_CAMERA_DIMENSIONS = 4;
+// Dimensions each bounce owns. The scatter takes up to the first four (three for a point in the unit ball,
+// one to pick between reflection and refraction), Russian roulette the one at SAMPLER_ROULETTE_DIMENSION and
+// next event estimation the three from SAMPLER_LIGHT_DIMENSION (in light.h).
+// Eight keeps every bounce at the start of a block of the four dimensional sobol sequence
+const uint32_t SAMPLER_BOUNCE_DIMENSIONS = 8;
+const uint32_t SAMPLER_ROULETTE_DIMENSION = 4;
+// Width and height of the blue noise mask, which tiles the image
+const int BLUE_NOISE_SIZE = 64;
+// Spread of the gaussian the blue noise mask is built with, in pixels
+const float BLUE_NOISE_SIGMA = 1.5f;
+
+// One prime base per halton dimension, past the last one the halton sampler carries on with pcg32
+const uint32_t HALTON_PRIMES[] = {2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53, 59, 61, 67, 71, 73, 79,
+                                  83, 89, 97, 101, 103, 107, 109, 113, 127, 131, 137, 139, 149, 151, 157, 163, 167,
+                                  173, 179, 181, 191, 193, 197, 199, 211, 223};
+const uint32_t HALTON_DIMENSIONS = sizeof(HALTON_PRIMES) / sizeof(HALTON_PRIMES[0]);
+// Samples per pixel up to which the halton samples stay stratified, the scrambled digits finer than that
+// come from a single random number
+const float HALTON_STRATIFIED_SAMPLES = 4096.0f;
+
+inline uint32_t hash_bits(uint64_t x) {
+    // Finalizer of splitmix64, every bit of x flips about half of the result
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return uint32_t(x);
+}
+
+inline uint32_t hash_bits(uint32_t a, uint32_t b) {
+    return hash_bits((uint64_t(a) << 32) | b);
+}
+
+inline uint32_t reverse_bits(uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+    // Hash in which every bit only depends on the seed and the bits below it (Laine and Karras, with Vegdahl's
+    // constants). On reversed bits that makes it an Owen scramble
+    x ^= x * 0x3d20adeau;
+    x += seed;
+    x *= (seed >> 16) | 1u;
+    x ^= x * 0x05526c56u;
+    x ^= x * 0x53a22864u;
+    return x;
+}
+
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+    // Owen scrambling of the bits of x read as a binary fraction: every bit is flipped or not depending on the
+    // seed and the bits above it
+    return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+inline float bits_to_float(uint32_t bits) {
+    // The top 24 bits as a float in [0, 1), like pcg32::next_float()
+    return (bits >> 8) * (1.0f / 16777216.0f);
+}
+
+struct sobol_directions {
+    // Direction numbers of the first four dimensions of the Sobol sequence, from the primitive polynomials
+    // and initial numbers of Joe and Kuo. Bit i of the index selects column i of a dimension.
+    // The scrambles work on reversed bits, so the columns are also kept XORed together for every value of every
+    // byte of the reversed index, reversed themselves. A sample then takes four lookups instead of a loop over
+    // 32 bits (the shuffled indices use all of them) and no reversals on either side
+    sobol_directions() {
+        const int degree[4] = {0, 1, 2, 3};
+        const uint32_t coefficients[4] = {0, 0, 1, 1};
+        const uint32_t initial[4][3] = {{}, {1}, {1, 3}, {1, 3, 1}};
+        uint32_t columns[4][32];
+        for (int i = 0; i < 32; i++) {
+            columns[0][i] = 1u << (31 - i);
+        }
+        for (int d = 1; d < 4; d++) {
+            int s = degree[d];
+            for (int i = 0; i < 32; i++) {
+                if (i < s) {
+                    columns[d][i] = initial[d][i] << (31 - i);
+                    continue;
+                }
+                uint32_t v = columns[d][i - s] ^ (columns[d][i - s] >> s);
+                for (int k = 1; k < s; k++) {
+                    if ((coefficients[d] >> (s - 1 - k)) & 1u) {
+                        v ^= columns[d][i - k];
+                    }
+                }
+                columns[d][i] = v;
+            }
+        }
+        for (int d = 0; d < 4; d++) {
+            for (int byte = 0; byte < 4; byte++) {
+                for (int value = 0; value < 256; value++) {
+                    uint32_t bits = 0;
+                    for (int bit = 0; bit < 8; bit++) {
+                        if (value & (1 << bit)) {
+                            bits ^= columns[d][31 - (byte * 8 + bit)];
+                        }
+                    }
+                    reversed_bytes[d][byte][value] = reverse_bits(bits);
+                }
+            }
+        }
+    }
+
+    uint32_t reversed_bytes[4][4][256];
+};
+
+inline uint32_t sobol_reversed(uint32_t reversed_index, uint32_t dimension) {
+    // One of the first four dimensions as a 32 bit binary fraction, with the bits of both reversed
+    static const sobol_directions directions;
+    const uint32_t (&bytes)[4][256] = directions.reversed_bytes[dimension];
+    return bytes[0][reversed_index & 0xffu] ^ bytes[1][(reversed_index >> 8) & 0xffu] ^
+           bytes[2][(reversed_index >> 16) & 0xffu] ^ bytes[3][reversed_index >> 24];
+}
+
+inline uint32_t sobol_shuffle(uint32_t index, uint32_t block, uint32_t seed) {
+    // Owen scrambled Sobol padded out to any number of dimensions (Burley, Practical Hash-based Owen Scrambling).
+    // The dimensions go in blocks of four and each block shuffles the sample index with a scramble of its own,
+    // so the blocks are independent of each other while the first 2^k samples of any block still fill every
+    // elementary interval of it. Returns the shuffled index with its bits reversed. The top bit of the block
+    // keeps its seed apart from the dimensions'
+    return laine_karras_permutation(reverse_bits(index), hash_bits(seed, block | 0x80000000u));
+}
+
+inline float sobol_float(uint32_t shuffled_index, uint32_t dimension, uint32_t seed) {
+    // Dimension of the sample at an index shuffled by sobol_shuffle() for the dimension's block
+    uint32_t reversed = sobol_reversed(shuffled_index, dimension % 4);
+    return bits_to_float(reverse_bits(laine_karras_permutation(reversed, hash_bits(seed, dimension))));
+}
+
+inline uint32_t mix_digit(uint32_t x) {
+    // Small 32 bit integer hash (lowbias32 by Chris Wellons)
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+inline float halton_float(uint32_t index, uint32_t dimension, uint32_t seed) {
+    // Radical inverse of the index in the prime base of the dimension, with every digit permuted by a random
+    // affine map (multiply and add mod b) that depends on the seed and the digits before it, the same nested
+    // scramble as for Sobol but in base b. A shift alone would keep consecutive digits next to each other,
+    // which bunches up the first few samples of the high bases. Past the last digit of the index the scrambled
+    // zeros are just random digits, so once they are finer than HALTON_STRATIFIED_SAMPLES strata one number from
+    // the hash fills in the rest of them. Base 2 is the first Sobol dimension
+    uint32_t base = HALTON_PRIMES[dimension];
+    if (base == 2) {
+        return bits_to_float(nested_uniform_scramble(reverse_bits(index), hash_bits(seed, dimension)));
+    }
+    const float inverse_base = 1.0f / float(base);
+    uint32_t state = hash_bits(seed, dimension);
+    float factor = inverse_base;
+    float result = 0;
+    while (index || factor * HALTON_STRATIFIED_SAMPLES >= 1.0f) {
+        uint32_t digit = index % base;
+        index /= base;
+        uint32_t permutation = mix_digit(state);
+        uint32_t multiplier = 1 + (permutation >> 16) % (base - 1);
+        result += float((digit * multiplier + (permutation & 0xffffu)) % base) * factor;
+        state = mix_digit(state ^ digit) + digit;
+        factor *= inverse_base;
+    }
+    result += float(base) * factor * bits_to_float(mix_digit(state));
+    return result < 1.0f ? result : 0x1.fffffep-1f;
+}
+
+class blue_noise_mask {
+    // Tiling square of thresholds from 0 to 1 whose every subset below a threshold is spread out evenly,
+    // without the clumps of white noise: neighbouring pixels get values far apart. Made once with Ulichney's
+    // void and cluster method, which ranks the pixels one at a time by where a gaussian "energy" of the pixels
+    // ranked so far is highest (the tightest cluster) or lowest (the largest void)
+public:
+    inline blue_noise_mask();
+
+    float at(uint32_t x, uint32_t y) const {
+        return values[(y % BLUE_NOISE_SIZE) * BLUE_NOISE_SIZE + x % BLUE_NOISE_SIZE];
+    }
+
+    std::vector<float> values;
+};
+
+inline blue_noise_mask::blue_noise_mask() {
+    const int size = BLUE_NOISE_SIZE;
+    const int count = size * size;
+    // Gaussian of the distance on the torus, by offset
+    std::vector<float> gaussian(count);
+    for (int dy = 0; dy < size; dy++) {
+        for (int dx = 0; dx < size; dx++) {
+            float x = float(dx < size - dx ? dx : size - dx);
+            float y = float(dy < size - dy ? dy : size - dy);
+            gaussian[dy * size + dx] = std::exp(-(x * x + y * y) / (2 * BLUE_NOISE_SIGMA * BLUE_NOISE_SIGMA));
+        }
+    }
+    std::vector<unsigned char> set(count, 0);
+    std::vector<float> energy(count, 0.0f);
+    auto toggle = [&](int p, float sign) {
+        set[p] = sign > 0;
+        int px = p % size, py = p / size;
+        for (int q = 0; q < count; q++) {
+            int dx = (q % size - px + size) % size;
+            int dy = (q / size - py + size) % size;
+            energy[q] += sign * gaussian[dy * size + dx];
+        }
+    };
+    auto tightest_cluster = [&]() {
+        int best = -1;
+        for (int q = 0; q < count; q++) {
+            if (set[q] && (best < 0 || energy[q] > energy[best])) {
+                best = q;
+            }
+        }
+        return best;
+    };
+    auto largest_void = [&]() {
+        int best = -1;
+        for (int q = 0; q < count; q++) {
+            if (!set[q] && (best < 0 || energy[q] < energy[best])) {
+                best = q;
+            }
+        }
+        return best;
+    };
+
+    // Start from a tenth of the pixels at random, then move the point of the tightest cluster into the largest
+    // void until that puts it straight back
+    pcg32 rng(0x5eed, 0);
+    int initial = count / 10;
+    for (int placed = 0; placed < initial;) {
+        int p = int(rng.next_uint() % count);
+        if (!set[p]) {
+            toggle(p, 1.0f);
+            placed++;
+        }
+    }
+    for (;;) {
+        int cluster = tightest_cluster();
+        toggle(cluster, -1.0f);
+        int gap = largest_void();
+        toggle(gap, 1.0f);
+        if (gap == cluster) {
+            break;
+        }
+    }
+
+    // The starting points get the lowest ranks, taking out the tightest cluster each time, then the rest of the
+    // pixels get theirs in the order the largest void fills up
+    std::vector<int> rank(count);
+    std::vector<unsigned char> start_set = set;
+    std::vector<float> start_energy = energy;
+    for (int r = initial - 1; r >= 0; r--) {
+        int cluster = tightest_cluster();
+        toggle(cluster, -1.0f);
+        rank[cluster] = r;
+    }
+    set = start_set;
+    energy = start_energy;
+    for (int r = initial; r < count; r++) {
+        int gap = largest_void();
+        toggle(gap, 1.0f);
+        rank[gap] = r;
+    }
+    values.resize(count);
+    for (int p = 0; p < count; p++) {
+        values[p] = (float(rank[p]) + 0.5f) / float(count);
+    }
+}
+
+inline const blue_noise_mask &blue_noise() {
+    // Built the first time a blue noise sampler asks for it, which takes a few tens of milliseconds
+    static const blue_noise_mask mask;
+    return mask;
+}
+
+class sampler {
+    // Source of the random numbers of one sample of one pixel, passed to everything that samples along its path:
+    // the position in the pixel, the lens, and every bounce. Each next_float() takes the next dimension of the
+    // sample, and start_bounce() jumps to the dimensions a bounce owns, so the same decision gets the same
+    // dimension in every sample of the pixel whatever the path did before it. The low discrepancy kinds need
+    // that: their samples are only spread out evenly dimension by dimension.
+    //   independent  pcg32 stream per sample, plain Monte Carlo
+    //   sobol        Owen scrambled Sobol, padded in blocks of four dimensions, scrambled per pixel
+    //   halton       Halton with nested digit scrambling, scrambled per pixel
+    //   blue_noise   the same Owen scrambled Sobol points in every pixel, each dimension shifted (mod 1) by the
+    //                blue noise mask at an offset of that dimension. At a few samples per pixel the error of
+    //                neighbouring pixels then differs like blue noise, which looks finer and blurs away sooner
+    // The samples of a pixel are spread evenly over consecutive sample indices of one seed. The passes of a
+    // progressive or adaptive render keep the seed and carry on from the index the previous pass stopped at
+    // (colour_gradient::pass_sampling()), so the whole render is one evenly spread sequence. A still image or a
+    // frame of a sequence is a single pass with a seed of its own, and so gets scrambles of its own
+public:
+    sampler() : sampler(sampler_kind::independent, 0, 0, 0, 1, 0) {}
+
+    sampler(sampler_kind sampler_type, uint64_t seed, int x, int y, int width, uint32_t sample_index)
+            : kind(sampler_type), index(sample_index), dimension(0), pixel_x(uint32_t(x)), pixel_y(uint32_t(y)),
+              shuffled_block(UINT32_MAX), shuffled(0) {
+        uint64_t pixel = uint64_t(y) * uint64_t(width) + uint64_t(x);
+        if (kind == sampler_kind::independent || kind == sampler_kind::halton) {
+            rng.set_seed(seed, (uint64_t(sample_index) << 40) | pixel);
+        }
+        scramble = kind == sampler_kind::blue_noise ? hash_bits(seed) : hash_bits(hash_bits(seed), uint32_t(pixel));
+    }
+
+    // Uniform float in [0, 1) from the next dimension
+    inline float next_float();
+
+    // The sample index shuffled for the block of sobol dimensions `block`, kept until the next block
+    uint32_t shuffled_index(uint32_t block) {
+        if (block != shuffled_block) {
+            shuffled_block = block;
+            shuffled = sobol_shuffle(index, block, scramble);
+        }
+        return shuffled;
+    }
+
+    // Carry on from dimension `offset` of the ones bounce `bounce` (0 for the camera ray's hit) owns
+    void start_bounce(int bounce, uint32_t offset = 0) {
+        dimension = SAMPLER_CAMERA_DIMENSIONS + uint32_t(bounce) * SAMPLER_BOUNCE_DIMENSIONS + offset;
+    }
+
+    sampler_kind kind;
+    uint32_t index;
+    uint32_t dimension;
+    uint32_t scramble;
+    uint32_t pixel_x;
+    uint32_t pixel_y;
+    uint32_t shuffled_block;
+    uint32_t shuffled;
+    pcg32 rng;
+};
+
+inline float sampler::next_float() {
+    uint32_t d = dimension++;
+    switch (kind) {
+        case sampler_kind::sobol:
+            return sobol_float(shuffled_index(d / 4), d, scramble);
+        case sampler_kind::halton:
+            return d < HALTON_DIMENSIONS ? halton_float(index, d, scramble) : rng.next_float();
+        case sampler_kind::blue_noise: {
+            // The offset's seed has a bit set that the sobol scrambles' seeds never have, so the two are independent
+            uint32_t offset = hash_bits(scramble, d | 0x40000000u);
+            float value = sobol_float(shuffled_index(d / 4), d, scramble) +
+                          blue_noise().at(pixel_x + (offset & 0xffffu), pixel_y + (offset >> 16));
+            return value < 1.0f ? value : value - 1.0f;
+        }
+        default:
+            return rng.next_float();
+    }
+}
+
+inline bool parse_sampler_kind(const char *name, sampler_kind &kind) {
+    if (strcmp(name, "sobol") == 0) {
+        kind = sampler_kind::sobol;
+    } else if (strcmp(name, "halton") == 0) {
+        kind = sampler_kind::halton;
+    } else if (strcmp(name, "blue-noise") == 0) {
+        kind = sampler_kind::blue_noise;
+    } else if (strcmp(name, "independent") == 0) {
+        kind = sampler_kind::independent;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+#endif //RAY_TRACING_SAMPLER_H
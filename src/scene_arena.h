@@ -0,0 +1,144 @@
+
+#ifndef RAY_TRACING_SCENE_ARENA_H
+#define RAY_TRACING_SCENE_ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Size of the blocks the arena grows by when nothing was reserved, bigger requests get a block of their own
+const size_t SCENE_ARENA_BLOCK_SIZE = 64 * 1024;
+
+class scene_arena {
+    // Bump allocator that owns every primitive and material of a scene. Objects are placed one after the
+    // other in a few large blocks, so a scene built in one go sits contiguously in memory, and the whole
+    // scene is released at once by reset() or the destructor instead of object by object.
+    // Most scene types are trivially destructible and cost nothing to release; the destructors of the
+    // others are recorded when they are created and run in reverse order on release.
+    // Memory is kept across reset(), so rebuilding a scene of the same size allocates nothing new
+public:
+    scene_arena() = default;
+
+    ~scene_arena() { run_destructors(); }
+
+    scene_arena(const scene_arena &) = delete;
+    scene_arena &operator=(const scene_arena &) = delete;
+
+    // Make sure the next `bytes` bytes of allocations fit in a single block
+    inline void reserve(size_t bytes);
+
+    // Construct a T in the arena, it lives until the next reset()
+    template<typename T, typename... Args>
+    T *create(Args &&... args) {
+        T *object = new(allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        if (!std::is_trivially_destructible<T>::value) {
+            destructors.push_back({object, [](void *p) { static_cast<T *>(p)->~T(); }});
+        }
+        return object;
+    }
+
+    // Uninitialised array of n trivially constructible values, such as pointers
+    template<typename T>
+    T *create_array(size_t n) {
+        static_assert(std::is_trivially_destructible<T>::value, "arrays of the arena are never destroyed");
+        return static_cast<T *>(allocate(sizeof(T) * n, alignof(T)));
+    }
+
+    // Destroy everything created so far and rewind to the first block.
+    // Every pointer into the arena is invalid after this
+    inline void reset();
+
+    inline void *allocate(size_t bytes, size_t alignment);
+
+    // Bytes handed out since the last reset, and bytes held in blocks
+    size_t used() const { return used_bytes; }
+    inline size_t capacity() const;
+
+private:
+    struct block {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    struct destructor {
+        void *object;
+        void (*destroy)(void *);
+    };
+
+    inline void next_block(size_t bytes);
+
+    inline void run_destructors();
+
+    std::vector<block> blocks;
+    std::vector<destructor> destructors;
+    // Block being allocated from and the offset of its first free byte
+    size_t current = 0;
+    size_t offset = 0;
+    size_t used_bytes = 0;
+};
+
+inline void *scene_arena::allocate(size_t bytes, size_t alignment) {
+    // Blocks come from new[], which only aligns to alignof(max_align_t), so align the address rather than the offset
+    auto aligned_offset = [this, alignment] {
+        uintptr_t address = reinterpret_cast<uintptr_t>(blocks[current].data.get()) + offset;
+        return offset + size_t((alignment - address % alignment) % alignment);
+    };
+    if (blocks.empty() || aligned_offset() + bytes > blocks[current].size) {
+        // Room for the worst case padding too
+        next_block(bytes + alignment);
+    }
+    size_t start = aligned_offset();
+    offset = start + bytes;
+    used_bytes += bytes;
+    return blocks[current].data.get() + start;
+}
+
+inline void scene_arena::next_block(size_t bytes) {
+    // Move on to the next kept block if the request fits there, otherwise put a new block in its place
+    size_t next = blocks.empty() ? 0 : current + 1;
+    if (next >= blocks.size() || blocks[next].size < bytes) {
+        size_t size = bytes > SCENE_ARENA_BLOCK_SIZE ? bytes : SCENE_ARENA_BLOCK_SIZE;
+        block b{std::unique_ptr<char[]>(new char[size]), size};
+        if (next < blocks.size()) {
+            blocks[next] = std::move(b);
+        } else {
+            blocks.push_back(std::move(b));
+        }
+    }
+    current = next;
+    offset = 0;
+}
+
+inline void scene_arena::reserve(size_t bytes) {
+    if (blocks.empty() || offset + bytes > blocks[current].size) {
+        next_block(bytes);
+    }
+}
+
+inline void scene_arena::run_destructors() {
+    for (size_t i = destructors.size(); i-- > 0;) {
+        destructors[i].destroy(destructors[i].object);
+    }
+    destructors.clear();
+}
+
+inline void scene_arena::reset() {
+    run_destructors();
+    current = 0;
+    offset = 0;
+    used_bytes = 0;
+}
+
+inline size_t scene_arena::capacity() const {
+    size_t total = 0;
+    for (const block &b : blocks) {
+        total += b.size;
+    }
+    return total;
+}
+
+#endif //RAY_TRACING_SCENE_ARENA_H
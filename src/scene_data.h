@@ -0,0 +1,610 @@
+
+#ifndef RAY_TRACING_SCENE_DATA_H
+#define RAY_TRACING_SCENE_DATA_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <vector>
+#include "bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "instance.h"
+#include "light.h"
+#include "material.h"
+#include "packed_spheres.h"
+#include "scene_arena.h"
+#include "transform.h"
+#include "triangle_mesh.h"
+
+// 32 bit handle to a material of a scene_data: the top two bits say which typed array it lives in and the
+// other 30 bits are its index there, so the type can be read off without touching the material
+typedef uint32_t material_id;
+
+inline material_id make_material_id(material_kind kind, uint32_t index) {
+    return (uint32_t(kind) << 30) | index;
+}
+
+inline material_kind material_id_kind(material_id id) {
+    return material_kind(id >> 30);
+}
+
+inline uint32_t material_id_index(material_id id) {
+    return id & 0x3FFFFFFFu;
+}
+
+// Most instances in a leaf of the top level bvh. Testing an instance means walking its mesh's bvh, which costs
+// far more than a node test, so leaves are kept small
+const int INSTANCE_LEAF_SIZE = 2;
+
+// A refit bvh is rebuilt once its node boxes have on average grown to this many times their area at the
+// last build. Scrambling the random scene costs about 30% more box and sphere tests by a growth of 1.4
+const float BVH_REFIT_REBUILD_GROWTH = 1.5f;
+
+struct surface_hit {
+    // Like hit_record, but with the material as an index into the scene's tables rather than a pointer
+    float t;
+    vec3 point;
+    vec3 normal;
+    material_id material;
+    // Index in the scene's light list of the sphere hit, -1 for anything that is not one of its lights
+    int light;
+};
+
+struct mesh_instance {
+    // A copy of one of the scene's meshes: the world to object transform of the copy, which mesh it is and
+    // the material it is drawn with. 56 bytes however large the mesh is
+    affine_transform to_object;
+    uint32_t mesh;
+    material_id material;
+};
+
+class scene_data final : public hittable {
+    // Closed, data oriented version of a scene made of spheres and instances of triangle meshes with lambertian,
+    // metal, dielectric and emissive materials. Emissive spheres are also the scene's lights.
+    // Geometry lives in flat float arrays ordered like the bvh leaves and each material type has its own
+    // contiguous array, so intersect() and scatter() below make no virtual calls and can be inlined into
+    // the integrator. The hittable interface is still implemented on top, for code that wants the virtual API
+public:
+    typedef surface_hit record_type;
+
+    scene_data() = default;
+
+    scene_data(const scene_data &) = delete;
+    scene_data &operator=(const scene_data &) = delete;
+
+    material_id add_lambertian(const vec3 &albedo) {
+        lambertians.emplace_back(albedo);
+        return make_material_id(material_kind::lambertian, uint32_t(lambertians.size() - 1));
+    }
+
+    material_id add_metal(const vec3 &albedo, float fuzz) {
+        metals.emplace_back(albedo, fuzz);
+        return make_material_id(material_kind::metal, uint32_t(metals.size() - 1));
+    }
+
+    material_id add_dielectric(float ref_idx) {
+        dielectrics.emplace_back(ref_idx);
+        return make_material_id(material_kind::dielectric, uint32_t(dielectrics.size() - 1));
+    }
+
+    material_id add_emissive(const vec3 &emit) {
+        emissives.emplace_back(emit);
+        return make_material_id(material_kind::emissive, uint32_t(emissives.size() - 1));
+    }
+
+    void add_sphere(const vec3 &center, float radius, material_id material) {
+        pending.push_back({center, radius, material});
+    }
+
+    // Add a built mesh for instances to be made of. It is not drawn until add_instance() places it.
+    // Returns the index add_instance() knows it by
+    int add_mesh(std::shared_ptr<const triangle_mesh> mesh) {
+        meshes.push_back(std::move(mesh));
+        return int(meshes.size() - 1);
+    }
+
+    // Place a copy of mesh `mesh` with the object to world transform, drawn with material. Copies share the
+    // mesh, so a million copies of a mesh cost a million instances and one mesh. Like spheres, instances are
+    // only put in the (top level) bvh by build(). Returns false for a bad mesh or a transform with no inverse
+    inline bool add_instance(int mesh, const affine_transform &object_to_world, material_id material);
+
+    // Build the bvh over the spheres added so far and lay them out in leaf order, and the same for the instances
+    inline void build();
+
+    // Use a bvh and sphere arrays that live somewhere else, such as a memory mapped scene cache, instead
+    // of building them. storage is kept alive for as long as the scene uses the arrays
+    inline void use_arrays(const bvh_node *node_array, int nodes_in_array, sphere_soa_view sphere_arrays,
+                           const material_id *material_array, int spheres_in_arrays, std::shared_ptr<const void> storage);
+
+    // Move sphere `index`, counted in the order the spheres were added, to a new center. The bvh is only
+    // brought up to date by refit(). Returns false for a scene that uses external arrays or a bad index
+    inline bool move_sphere(int index, const vec3 &center);
+
+    // Grow and shrink the bvh boxes around the spheres where they are now, keeping the tree as it is.
+    // That is far cheaper than a build, but the tree was split for where the spheres used to be, so once
+    // bvh_growth() passes BVH_REFIT_REBUILD_GROWTH it is rebuilt
+    inline void refit();
+
+    // Average over the nodes of their area now relative to their area when the bvh was built, 1 for a fresh
+    // build. Spheres that move together leave it alone, spheres that scatter inflate it
+    inline float bvh_growth() const;
+
+    // Copy a list of spheres with the three built in materials into this scene, then build it.
+    // Returns false and adds nothing if the list holds anything this representation cannot express
+    inline bool add_hittables(hittable **list, int n);
+
+    // Closest hit. The walks only keep the closest sphere or triangle found so far, and its point, normal and
+    // material are worked out once at the end
+    inline bool intersect(const ray &r, float t_min, float t_max, surface_hit &hit) const;
+
+    // Whether anything is hit between t_min and t_max, stopping at the first sphere or triangle found
+    inline bool occluded(const ray &r, float t_min, float t_max) const override;
+
+    // The hittable interface's two phase intersect() is its fallback on hit() below
+    using hittable::intersect;
+
+    inline bool scatter(const ray &r_in, const surface_hit &hit, vec3 &attenuation, ray &scattered, sampler &rng) const;
+
+    // Light the surface that was hit gives off towards r_in's origin, as material::emitted gives it
+    inline vec3 emitted(const ray &r_in, const surface_hit &hit) const;
+
+    // Density and value of scattering towards direction, as material::scatter_value gives them
+    inline bool scatter_value(const surface_hit &hit, const vec3 &direction, vec3 &value, float &pdf) const;
+
+    const light_list *lights() const {
+        return &light_sources;
+    }
+
+    // Albedo of the material that was hit, as material::surface_albedo gives it
+    inline vec3 albedo(const surface_hit &hit) const;
+
+    // Whether the material that was hit is a mirror, as material::specular says
+    inline bool specular(const surface_hit &hit) const;
+
+    // The material object behind an id, for the virtual API
+    inline material *material_pointer(material_id id) const;
+
+    bool hit(const ray &r, float t_min, float t_max, hit_record &record) const override {
+        surface_hit h;
+        if (!intersect(r, t_min, t_max, h)) {
+            return false;
+        }
+        record.t = h.t;
+        record.point = h.point;
+        record.normal = h.normal;
+        record.mat_ptr = material_pointer(h.material);
+        record.light = h.light;
+        return true;
+    }
+
+    bool bounding_box(aabb &output_box) const override {
+        aabb box;
+        bool bounded = node_count > 0;
+        if (bounded) {
+            box = node_data[0].box();
+        }
+        if (!instance_nodes.empty()) {
+            box.expand(instance_nodes[0].box());
+            bounded = true;
+        }
+        output_box = box;
+        return bounded;
+    }
+
+    // What intersect() reads: the flattened bvh, the sphere centers and radii in leaf order with padding
+    // for the SIMD kernels, and the material of each sphere. They point either into the vectors below
+    // (after build()) or into external storage (after use_arrays())
+    const bvh_node *node_data = nullptr;
+    int node_count = 0;
+    sphere_soa_view sphere_view{};
+    const material_id *material_ids = nullptr;
+    int sphere_count = 0;
+
+    // Arrays owned by a built scene
+    std::vector<bvh_node> nodes;
+    sphere_soa spheres;
+    std::vector<material_id> sphere_materials;
+    // Position in the sphere arrays of each sphere, in the order they were added
+    std::vector<int> sphere_slots;
+
+    // Meshes, each stored once however many instances it has, and the instances in the order the leaves of
+    // the top level bvh over them reference them. The meshes' own bvhs are the bottom level
+    std::vector<std::shared_ptr<const triangle_mesh>> meshes;
+    std::vector<mesh_instance> instances;
+    std::vector<bvh_node> instance_nodes;
+
+    // One contiguous array per material type, indexed by material_id_index
+    std::vector<lambertian> lambertians;
+    std::vector<metal> metals;
+    std::vector<dielectric> dielectrics;
+    std::vector<diffuse_light> emissives;
+
+    // The emissive spheres, rebuilt along with the sphere arrays
+    light_list light_sources;
+
+private:
+    struct pending_sphere {
+        vec3 center;
+        float radius;
+        material_id material;
+    };
+
+    inline void build_spheres();
+
+    inline void build_instances();
+
+    inline void build_lights();
+
+    std::vector<pending_sphere> pending;
+    std::shared_ptr<const void> external;
+    // Surface area of every node when the bvh was last built
+    std::vector<float> built_areas;
+    sphere_kernel kernel = select_sphere_kernel(detect_simd_level());
+};
+
+inline void scene_data::build() {
+    build_spheres();
+    build_instances();
+}
+
+inline void scene_data::build_spheres() {
+    std::vector<aabb> boxes;
+    for (const pending_sphere &s : pending) {
+        vec3 extent(s.radius, s.radius, s.radius);
+        boxes.push_back(aabb(s.center - extent, s.center + extent));
+    }
+    int width = int(detect_simd_level());
+    bvh_builder builder(boxes, width > 4 ? width : 4, width);
+    nodes = std::move(builder.nodes);
+
+    spheres = sphere_soa();
+    sphere_materials.clear();
+    sphere_slots.assign(pending.size(), 0);
+    for (int index : builder.order) {
+        const pending_sphere &s = pending[index];
+        sphere_slots[index] = int(sphere_materials.size());
+        spheres.center_x.push_back(s.center[0]);
+        spheres.center_y.push_back(s.center[1]);
+        spheres.center_z.push_back(s.center[2]);
+        spheres.radius.push_back(s.radius);
+        sphere_materials.push_back(s.material);
+    }
+    for (int i = 0; i < PACKED_SPHERES_PADDING; i++) {
+        spheres.center_x.push_back(0);
+        spheres.center_y.push_back(0);
+        spheres.center_z.push_back(0);
+        spheres.radius.push_back(std::numeric_limits<float>::quiet_NaN());
+    }
+    node_data = nodes.data();
+    node_count = int(nodes.size());
+    sphere_view = view_of(spheres);
+    material_ids = sphere_materials.data();
+    sphere_count = int(pending.size());
+    external.reset();
+    built_areas.clear();
+    for (const bvh_node &node : nodes) {
+        built_areas.push_back(node.box().surface_area());
+    }
+    build_lights();
+}
+
+inline void scene_data::build_lights() {
+    // Spheres that give off nothing are left out, they could never be picked
+    light_sources.clear();
+    for (int slot = 0; slot < sphere_count; slot++) {
+        material_id id = material_ids[slot];
+        if (material_id_kind(id) != material_kind::emissive) {
+            continue;
+        }
+        const vec3 &emit = emissives[material_id_index(id)].emit;
+        if (luminance(emit) > 0) {
+            vec3 center(sphere_view.center_x[slot], sphere_view.center_y[slot], sphere_view.center_z[slot]);
+            light_sources.add(slot, center, sphere_view.radius[slot], emit);
+        }
+    }
+    light_sources.finish();
+}
+
+inline bool scene_data::add_instance(int mesh, const affine_transform &object_to_world, material_id material) {
+    mesh_instance copy{};
+    if (mesh < 0 || mesh >= int(meshes.size()) || !object_to_world.invert(copy.to_object)) {
+        return false;
+    }
+    copy.mesh = uint32_t(mesh);
+    copy.material = material;
+    instances.push_back(copy);
+    return true;
+}
+
+inline void scene_data::build_instances() {
+    // The world box of an instance is its mesh's box taken through the object to world transform, which the
+    // instance does not keep, so it is inverted back from the world to object one
+    std::vector<aabb> boxes(instances.size());
+    for (size_t i = 0; i < instances.size(); i++) {
+        affine_transform to_world;
+        aabb mesh_box;
+        if (instances[i].to_object.invert(to_world) && meshes[instances[i].mesh]->bounding_box(mesh_box)) {
+            boxes[i] = to_world.apply(mesh_box);
+        }
+    }
+    bvh_builder builder(boxes, INSTANCE_LEAF_SIZE);
+    std::vector<mesh_instance> ordered(instances.size());
+    for (size_t i = 0; i < instances.size(); i++) {
+        ordered[i] = instances[builder.order[i]];
+    }
+    instances = std::move(ordered);
+    instance_nodes = std::move(builder.nodes);
+}
+
+inline void scene_data::use_arrays(const bvh_node *node_array, int nodes_in_array, sphere_soa_view sphere_arrays,
+                                   const material_id *material_array, int spheres_in_arrays,
+                                   std::shared_ptr<const void> storage) {
+    nodes.clear();
+    spheres = sphere_soa();
+    sphere_materials.clear();
+    sphere_slots.clear();
+    node_data = node_array;
+    node_count = nodes_in_array;
+    sphere_view = sphere_arrays;
+    material_ids = material_array;
+    sphere_count = spheres_in_arrays;
+    external = std::move(storage);
+    build_lights();
+}
+
+inline bool scene_data::add_hittables(hittable **list, int n) {
+    for (int i = 0; i < n; i++) {
+        const sphere *s = dynamic_cast<const sphere *>(list[i]);
+        if (!s || !s->mat || s->mat->kind() == material_kind::other) {
+            return false;
+        }
+    }
+    // Materials shared between spheres stay shared
+    std::map<const material *, material_id> ids;
+    for (int i = 0; i < n; i++) {
+        const sphere *s = static_cast<const sphere *>(list[i]);
+        auto found = ids.find(s->mat);
+        material_id id;
+        if (found != ids.end()) {
+            id = found->second;
+        } else {
+            if (s->mat->kind() == material_kind::lambertian) {
+                id = add_lambertian(static_cast<const lambertian *>(s->mat)->albedo);
+            } else if (s->mat->kind() == material_kind::metal) {
+                const metal *m = static_cast<const metal *>(s->mat);
+                id = add_metal(m->albedo, m->fuzz);
+            } else if (s->mat->kind() == material_kind::emissive) {
+                id = add_emissive(static_cast<const diffuse_light *>(s->mat)->emit);
+            } else {
+                id = add_dielectric(static_cast<const dielectric *>(s->mat)->ref_idx);
+            }
+            ids[s->mat] = id;
+        }
+        add_sphere(s->center, s->radius, id);
+    }
+    build();
+    return true;
+}
+
+inline bool scene_data::move_sphere(int index, const vec3 &center) {
+    if (external || index < 0 || index >= int(sphere_slots.size())) {
+        return false;
+    }
+    pending[index].center = center;
+    int slot = sphere_slots[index];
+    spheres.center_x[slot] = center[0];
+    spheres.center_y[slot] = center[1];
+    spheres.center_z[slot] = center[2];
+    int light = light_sources.find(slot);
+    if (light >= 0) {
+        light_sources.lights[light].center = center;
+    }
+    return true;
+}
+
+inline void scene_data::refit() {
+    if (external || nodes.empty()) {
+        return;
+    }
+    // Children always come after their parent, so walking the array backwards reaches every node
+    // after both of its children
+    for (int i = int(nodes.size()) - 1; i >= 0; i--) {
+        bvh_node &node = nodes[i];
+        aabb box;
+        if (node.count > 0) {
+            for (int s = node.offset; s < node.offset + node.count; s++) {
+                float r = spheres.radius[s];
+                vec3 center(spheres.center_x[s], spheres.center_y[s], spheres.center_z[s]);
+                box.expand(aabb(center - vec3(r, r, r), center + vec3(r, r, r)));
+            }
+        } else {
+            box.expand(nodes[i + 1].box());
+            box.expand(nodes[node.offset].box());
+        }
+        node.set_box(box);
+    }
+    if (bvh_growth() > BVH_REFIT_REBUILD_GROWTH) {
+        build_spheres();
+    }
+}
+
+inline float scene_data::bvh_growth() const {
+    float growth = 0;
+    int counted = 0;
+    for (size_t i = 0; i < built_areas.size(); i++) {
+        if (built_areas[i] > 0) {
+            growth += nodes[i].box().surface_area() / built_areas[i];
+            counted++;
+        }
+    }
+    return counted > 0 ? growth / float(counted) : 1.0f;
+}
+
+inline bool scene_data::intersect(const ray &r, float t_min, float t_max, surface_hit &hit) const {
+    int closest = -1;
+    if (node_count > 0) {
+        traverse_bvh(node_data, r, t_min, t_max, [&](int first, int count, float &t) {
+            RT_STAT(thread_stats().primitive_tests += count);
+            int index = kernel(sphere_view, r.origin(), r.direction(), first, count, t_min, t);
+            if (index < 0) {
+                return false;
+            }
+            closest = index;
+            return true;
+        });
+    }
+    // The closest sphere's t cuts the instance walk short, and an instance hit in front of it takes over.
+    // Each instance leaf moves the ray into its mesh's space and walks the mesh's bvh from there
+    int closest_instance = -1;
+    uint32_t triangle = 0;
+    float b1 = 0, b2 = 0;
+    if (!instance_nodes.empty()) {
+        traverse_bvh(instance_nodes.data(), r, t_min, t_max, [&](int first, int count, float &t) {
+            bool hit_leaf = false;
+            for (int i = first; i < first + count; i++) {
+                const mesh_instance &copy = instances[i];
+                if (meshes[copy.mesh]->intersect(copy.to_object.apply(r), t_min, t, triangle, b1, b2)) {
+                    closest_instance = i;
+                    hit_leaf = true;
+                }
+            }
+            return hit_leaf;
+        });
+    }
+    if (closest_instance >= 0) {
+        const mesh_instance &copy = instances[closest_instance];
+        hit.t = t_max;
+        hit.point = r.point_given_parameter(t_max);
+        hit.normal = unit_vector(copy.to_object.apply_transposed(meshes[copy.mesh]->normal(triangle, b1, b2)));
+        hit.material = copy.material;
+        hit.light = -1;
+        return true;
+    }
+    if (closest < 0) {
+        return false;
+    }
+    // Only the closest sphere gets its point, normal and material worked out
+    vec3 center(sphere_view.center_x[closest], sphere_view.center_y[closest], sphere_view.center_z[closest]);
+    hit.t = t_max;
+    hit.point = r.point_given_parameter(t_max);
+    hit.normal = (hit.point - center) / sphere_view.radius[closest];
+    hit.material = material_ids[closest];
+    hit.light = material_id_kind(hit.material) == material_kind::emissive ? light_sources.find(closest) : -1;
+    return true;
+}
+
+inline bool scene_data::occluded(const ray &r, float t_min, float t_max) const {
+    if (node_count > 0 && traverse_bvh<true>(node_data, r, t_min, t_max, [&](int first, int count, float &t) {
+            RT_STAT(thread_stats().primitive_tests += count);
+            return kernel(sphere_view, r.origin(), r.direction(), first, count, t_min, t) >= 0;
+        })) {
+        return true;
+    }
+    return !instance_nodes.empty() &&
+           traverse_bvh<true>(instance_nodes.data(), r, t_min, t_max, [&](int first, int count, float &t) {
+               for (int i = first; i < first + count; i++) {
+                   const mesh_instance &copy = instances[i];
+                   if (meshes[copy.mesh]->occluded(copy.to_object.apply(r), t_min, t)) {
+                       return true;
+                   }
+               }
+               return false;
+           });
+}
+
+inline bool scene_data::scatter(const ray &r_in, const surface_hit &hit, vec3 &attenuation, ray &scattered,
+                                sampler &rng) const {
+    // Dispatch on the tag in the id, then call the material's own scatter by its qualified name,
+    // which the compiler resolves statically and can inline
+    hit_record record;
+    record.t = hit.t;
+    record.point = hit.point;
+    record.normal = hit.normal;
+    record.mat_ptr = nullptr;
+    uint32_t index = material_id_index(hit.material);
+    switch (material_id_kind(hit.material)) {
+        case material_kind::lambertian:
+            return lambertians[index].lambertian::scatter(r_in, record, attenuation, scattered, rng);
+        case material_kind::metal:
+            return metals[index].metal::scatter(r_in, record, attenuation, scattered, rng);
+        case material_kind::dielectric:
+            return dielectrics[index].dielectric::scatter(r_in, record, attenuation, scattered, rng);
+        default:
+            return false;
+    }
+}
+
+inline vec3 scene_data::emitted(const ray &r_in, const surface_hit &hit) const {
+    if (material_id_kind(hit.material) != material_kind::emissive || dot(r_in.direction(), hit.normal) >= 0) {
+        return vec3(0, 0, 0);
+    }
+    return emissives[material_id_index(hit.material)].emit;
+}
+
+inline bool scene_data::scatter_value(const surface_hit &hit, const vec3 &direction, vec3 &value, float &pdf) const {
+    if (material_id_kind(hit.material) != material_kind::lambertian) {
+        return false;
+    }
+    pdf = lambertian_pdf(hit.normal, direction);
+    value = pdf * lambertians[material_id_index(hit.material)].albedo;
+    return true;
+}
+
+inline vec3 scene_data::albedo(const surface_hit &hit) const {
+    uint32_t index = material_id_index(hit.material);
+    switch (material_id_kind(hit.material)) {
+        case material_kind::lambertian: return lambertians[index].albedo;
+        case material_kind::metal: return metals[index].albedo;
+        default: return vec3(1, 1, 1);
+    }
+}
+
+inline bool scene_data::specular(const surface_hit &hit) const {
+    switch (material_id_kind(hit.material)) {
+        case material_kind::metal: return metals[material_id_index(hit.material)].fuzz == 0;
+        default: return false;
+    }
+}
+
+inline material *scene_data::material_pointer(material_id id) const {
+    uint32_t index = material_id_index(id);
+    switch (material_id_kind(id)) {
+        case material_kind::lambertian: return const_cast<lambertian *>(&lambertians[index]);
+        case material_kind::metal: return const_cast<metal *>(&metals[index]);
+        case material_kind::dielectric: return const_cast<dielectric *>(&dielectrics[index]);
+        case material_kind::emissive: return const_cast<diffuse_light *>(&emissives[index]);
+        default: return nullptr;
+    }
+}
+
+inline hittable *object_world(const scene_data &scene, scene_arena &into) {
+    // The scene in the objects layout: a sphere hittable for each sphere and an instance hittable for each
+    // copy of a mesh, with a bvh over them all as the top level and the meshes' own bvhs below the instances.
+    // The meshes and materials are the scene's own, so it has to outlive the returned world
+    int n = scene.sphere_count + int(scene.instances.size());
+    hittable **list = into.create_array<hittable *>(size_t(n > 0 ? n : 1));
+    int count = 0;
+    for (int slot = 0; slot < scene.sphere_count; slot++) {
+        const sphere_soa_view &v = scene.sphere_view;
+        list[count++] = into.create<sphere>(vec3(v.center_x[slot], v.center_y[slot], v.center_z[slot]),
+                                            v.radius[slot], scene.material_pointer(scene.material_ids[slot]));
+    }
+    for (const mesh_instance &copy : scene.instances) {
+        affine_transform to_world;
+        if (!copy.to_object.invert(to_world)) {
+            continue;
+        }
+        instance *placed = into.create<instance>(scene.meshes[copy.mesh].get(), to_world,
+                                                 scene.material_pointer(copy.material));
+        if (placed->valid()) {
+            list[count++] = placed;
+        }
+    }
+    if (count == 0) {
+        return into.create<hittable_list>(list, 0);
+    }
+    return into.create<bvh>(list, count);
+}
+
+#endif //RAY_TRACING_SCENE_DATA_H
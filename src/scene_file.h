@@ -0,0 +1,551 @@
+
+#ifndef RAY_TRACING_SCENE_FILE_H
+#define RAY_TRACING_SCENE_FILE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "animation.h"
+#include "camera.h"
+#include "mapped_file.h"
+#include "scene_data.h"
+
+// Scenes on disk come in two forms.
+//
+// The text form is one statement per line, a keyword followed by its values, with # starting a comment:
+//     image <width> <height> <samples per pixel>
+//     seed <n>
+//     camera <lookfrom x y z> <lookat x y z> <up x y z> <vertical fov in degrees> <aperture> <focus distance>
+//     material <name> lambertian <r g b>
+//     material <name> metal <r g b> <fuzz>
+//     material <name> dielectric <refractive index>
+//     material <name> light <r g b>
+//     sphere <x y z> <radius> <material name>
+//     mesh <obj file> <material name> [<x y z> <scale>]
+//     instance <obj file> <material name> <transform>...
+//     frames <count>
+//     camera_key <frame> <lookfrom x y z> <lookat x y z> <vertical fov> <aperture> <focus distance>
+//     move <sphere> <frame> <x y z>
+// Materials have to be declared before the spheres that use them. Parsing it builds the bvh. A light material
+// gives off r g b (which can be well above 1) from the outside of whatever it is on and reflects nothing. Spheres
+// with it are the scene's lights, sampled directly at every diffuse bounce; meshes with it glow, but are only
+// found by the rays that happen to bounce into them.
+// A mesh is loaded from a Wavefront OBJ file (see load_obj()), found relative to the scene file, scaled by
+// scale and then moved by x y z if they are given. instance places it with any number of transforms, applied
+// in the order they are written: translate <x y z>, rotate <axis x y z> <degrees>, scale <x y z> and
+// matrix <12 values>, the rows of a 3x4 affine matrix. Each file is loaded once, and every mesh or instance
+// statement naming it adds a copy that shares it. Meshes are not counted by move.
+// frames, camera_key and move make the scene a sequence: the camera follows its keys and each moved sphere,
+// counted from 0 in the order of the sphere statements, follows its own. Sequences are only kept in the text
+// form, a scene cache stores the still scene.
+//
+// The binary form (a scene cache) is the scene_data of a built scene written out as it sits in memory:
+// the flattened bvh, the padded sphere arrays and the material id of every sphere, each section 64 byte
+// aligned. Loading one maps the file and points the scene_data straight at those sections, so nothing is
+// parsed or built. Only the materials are copied out of it, into real objects, since a material object
+// carries a pointer to its virtual table that means nothing in another process. Meshes and instances are not
+// stored, a scene with meshes stays in the text form
+
+struct scene_description {
+    // Everything in a scene file besides the geometry and the materials. 0 means not given
+    camera_settings view;
+    int width = 0;
+    int height = 0;
+    int samples = 0;
+    bool has_seed = false;
+    unsigned int seed = 0;
+    animation motion;
+};
+
+const char SCENE_CACHE_MAGIC[8] = {'R', 'T', 'S', 'C', 'E', 'N', 'E', 'B'};
+const uint32_t SCENE_CACHE_VERSION = 2;
+const uint32_t SCENE_CACHE_BYTE_ORDER = 0x01020304u;
+const uint64_t SCENE_CACHE_ALIGNMENT = 64;
+
+struct lambertian_record {
+    float albedo[3];
+};
+
+struct metal_record {
+    float albedo[3];
+    float fuzz;
+};
+
+struct dielectric_record {
+    float ref_idx;
+};
+
+struct emissive_record {
+    float emit[3];
+};
+
+struct scene_cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    // Sizes of the structs in the file, a cache written by a build that lays them out differently is rejected
+    uint32_t header_size;
+    uint32_t node_size;
+    uint32_t lambertian_size;
+    uint32_t metal_size;
+    uint32_t dielectric_size;
+    uint32_t emissive_size;
+    // Padding spheres after the real ones in each sphere array
+    uint32_t padding;
+
+    int32_t width;
+    int32_t height;
+    int32_t samples;
+    uint32_t has_seed;
+    uint32_t seed;
+    // lookfrom, lookat, up, vertical fov, aperture and focus distance
+    float view[12];
+
+    uint64_t file_size;
+    uint64_t sphere_count;
+    uint64_t node_count;
+    uint64_t lambertian_count;
+    uint64_t metal_count;
+    uint64_t dielectric_count;
+    uint64_t emissive_count;
+    // Byte offsets of the sections from the start of the file
+    uint64_t nodes_offset;
+    uint64_t center_x_offset;
+    uint64_t center_y_offset;
+    uint64_t center_z_offset;
+    uint64_t radius_offset;
+    uint64_t materials_offset;
+    uint64_t lambertians_offset;
+    uint64_t metals_offset;
+    uint64_t dielectrics_offset;
+    uint64_t emissives_offset;
+};
+
+inline bool is_scene_cache(const std::string &path) {
+    char magic[8] = {};
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+    bool cache = fread(magic, 1, sizeof(magic), file) == sizeof(magic) && memcmp(magic, SCENE_CACHE_MAGIC, 8) == 0;
+    fclose(file);
+    return cache;
+}
+
+inline bool load_scene_text(const std::string &path, scene_data &scene, scene_description &description) {
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "Could not open scene " << path << "\n";
+        return false;
+    }
+    std::map<std::string, material_id> materials;
+    // Index in the scene of each mesh file loaded so far
+    std::map<std::string, int> meshes;
+    int spheres = 0;
+    std::string line;
+    int line_number = 0;
+    auto fail = [&](const std::string &message) {
+        std::cerr << path << ":" << line_number << ": " << message << "\n";
+        return false;
+    };
+    while (std::getline(in, line)) {
+        line_number++;
+        size_t comment = line.find('#');
+        if (comment != std::string::npos) {
+            line.erase(comment);
+        }
+        std::istringstream words(line);
+        std::string keyword;
+        if (!(words >> keyword)) {
+            continue;
+        }
+        if (keyword == "image") {
+            if (!(words >> description.width >> description.height >> description.samples) ||
+                description.width <= 0 || description.height <= 0 || description.samples <= 0) {
+                return fail("expected image <width> <height> <samples>");
+            }
+        } else if (keyword == "seed") {
+            if (!(words >> description.seed)) {
+                return fail("expected seed <n>");
+            }
+            description.has_seed = true;
+        } else if (keyword == "camera") {
+            camera_settings &v = description.view;
+            if (!(words >> v.lookfrom >> v.lookat >> v.vup >> v.vertical_fov >> v.aperture >> v.focus_dist)) {
+                return fail("expected camera <lookfrom> <lookat> <up> <fov> <aperture> <focus distance>");
+            }
+        } else if (keyword == "material") {
+            std::string name, type;
+            if (!(words >> name >> type)) {
+                return fail("expected material <name> <type> ...");
+            }
+            vec3 albedo;
+            float value;
+            if (type == "lambertian" && words >> albedo) {
+                materials[name] = scene.add_lambertian(albedo);
+            } else if (type == "metal" && words >> albedo >> value) {
+                materials[name] = scene.add_metal(albedo, value);
+            } else if (type == "dielectric" && words >> value) {
+                materials[name] = scene.add_dielectric(value);
+            } else if (type == "light" && words >> albedo && albedo[0] >= 0 && albedo[1] >= 0 && albedo[2] >= 0) {
+                materials[name] = scene.add_emissive(albedo);
+            } else {
+                return fail("bad material " + name + ", expected lambertian <r g b>, metal <r g b> <fuzz>, "
+                                                     "dielectric <refractive index> or light <r g b>");
+            }
+        } else if (keyword == "sphere") {
+            vec3 center;
+            float radius;
+            std::string name;
+            if (!(words >> center >> radius >> name)) {
+                return fail("expected sphere <x y z> <radius> <material>");
+            }
+            auto found = materials.find(name);
+            if (found == materials.end()) {
+                return fail("unknown material " + name);
+            }
+            scene.add_sphere(center, radius, found->second);
+            spheres++;
+        } else if (keyword == "mesh" || keyword == "instance") {
+            std::string file, name;
+            if (!(words >> file >> name)) {
+                return fail("expected " + keyword + " <obj file> <material> ...");
+            }
+            affine_transform placement = affine_transform::identity();
+            if (keyword == "mesh") {
+                vec3 offset(0, 0, 0);
+                float scale = 1;
+                if (!(words >> std::ws).eof() && (!(words >> offset >> scale) || !(scale > 0))) {
+                    return fail("expected mesh <obj file> <material> <x y z> <scale>, with a positive scale");
+                }
+                placement = affine_transform::translate(offset) * affine_transform::scale(vec3(scale, scale, scale));
+            } else {
+                std::string operation;
+                while (words >> operation) {
+                    affine_transform step{};
+                    vec3 v;
+                    float degrees;
+                    if (operation == "translate" && words >> v) {
+                        step = affine_transform::translate(v);
+                    } else if (operation == "rotate" && words >> v >> degrees && v.squared_length() > 0) {
+                        step = affine_transform::rotate(v, degrees);
+                    } else if (operation == "scale" && words >> v) {
+                        step = affine_transform::scale(v);
+                    } else if (operation == "matrix" && words >> v >> step.m[0][3] >> step.m[1][0] >> step.m[1][1] >>
+                               step.m[1][2] >> step.m[1][3] >> step.m[2][0] >> step.m[2][1] >> step.m[2][2] >>
+                               step.m[2][3]) {
+                        step.m[0][0] = v[0];
+                        step.m[0][1] = v[1];
+                        step.m[0][2] = v[2];
+                    } else {
+                        return fail("bad transform " + operation + ", expected translate <x y z>, rotate <axis x y z> "
+                                    "<degrees>, scale <x y z> or matrix <12 values, row by row>");
+                    }
+                    placement = step * placement;
+                }
+            }
+            auto found = materials.find(name);
+            if (found == materials.end()) {
+                return fail("unknown material " + name);
+            }
+            size_t directory = path.find_last_of('/');
+            if (file[0] != '/' && directory != std::string::npos) {
+                file = path.substr(0, directory + 1) + file;
+            }
+            // Every statement naming the same file gets another instance of the one mesh
+            auto loaded = meshes.find(file);
+            if (loaded == meshes.end()) {
+                std::shared_ptr<triangle_mesh> mesh(new triangle_mesh());
+                if (!load_obj(file, *mesh)) {
+                    return fail("could not load mesh " + file);
+                }
+                loaded = meshes.emplace(file, scene.add_mesh(mesh)).first;
+            }
+            if (!scene.add_instance(loaded->second, placement, found->second)) {
+                return fail("the transform of " + keyword + " cannot be inverted");
+            }
+        } else if (keyword == "frames") {
+            if (!(words >> description.motion.frames) || description.motion.frames <= 0) {
+                return fail("expected frames <count>");
+            }
+        } else if (keyword == "camera_key") {
+            camera_keyframe key{};
+            if (!(words >> key.frame >> key.lookfrom >> key.lookat >> key.vertical_fov >> key.aperture >>
+                        key.focus_dist)) {
+                return fail("expected camera_key <frame> <lookfrom> <lookat> <fov> <aperture> <focus distance>");
+            }
+            description.motion.camera_keys.push_back(key);
+        } else if (keyword == "move") {
+            int object;
+            position_keyframe key{};
+            if (!(words >> object >> key.frame >> key.center)) {
+                return fail("expected move <sphere> <frame> <x y z>");
+            }
+            if (object < 0) {
+                return fail("bad sphere number " + std::to_string(object));
+            }
+            std::vector<object_track> &tracks = description.motion.tracks;
+            auto track = std::find_if(tracks.begin(), tracks.end(),
+                                      [object](const object_track &t) { return t.object == object; });
+            if (track == tracks.end()) {
+                tracks.push_back({object, {}});
+                track = tracks.end() - 1;
+            }
+            track->keys.push_back(key);
+        } else {
+            return fail("unknown statement " + keyword);
+        }
+        std::string extra;
+        if (words >> extra) {
+            return fail("unexpected " + extra);
+        }
+    }
+    for (const object_track &track : description.motion.tracks) {
+        if (track.object >= spheres) {
+            return fail("move of sphere " + std::to_string(track.object) + ", but there are only " +
+                        std::to_string(spheres) + " spheres");
+        }
+    }
+    description.motion.sort_keys();
+    scene.build();
+    return true;
+}
+
+inline bool save_scene_cache(const std::string &path, const scene_data &scene, const scene_description &description) {
+    if (!scene.instances.empty()) {
+        std::cerr << "Scene caches only hold spheres, a scene with meshes has to stay a text scene\n";
+        return false;
+    }
+    scene_cache_header header{};
+    memcpy(header.magic, SCENE_CACHE_MAGIC, sizeof(header.magic));
+    header.version = SCENE_CACHE_VERSION;
+    header.byte_order = SCENE_CACHE_BYTE_ORDER;
+    header.header_size = sizeof(scene_cache_header);
+    header.node_size = sizeof(bvh_node);
+    header.lambertian_size = sizeof(lambertian_record);
+    header.metal_size = sizeof(metal_record);
+    header.dielectric_size = sizeof(dielectric_record);
+    header.emissive_size = sizeof(emissive_record);
+    header.padding = PACKED_SPHERES_PADDING;
+    header.width = description.width;
+    header.height = description.height;
+    header.samples = description.samples;
+    header.has_seed = description.has_seed;
+    header.seed = description.seed;
+    const camera_settings &v = description.view;
+    float view[12] = {v.lookfrom[0], v.lookfrom[1], v.lookfrom[2], v.lookat[0], v.lookat[1], v.lookat[2],
+                      v.vup[0], v.vup[1], v.vup[2], v.vertical_fov, v.aperture, v.focus_dist};
+    memcpy(header.view, view, sizeof(view));
+    header.sphere_count = uint64_t(scene.sphere_count);
+    header.node_count = uint64_t(scene.node_count);
+    header.lambertian_count = scene.lambertians.size();
+    header.metal_count = scene.metals.size();
+    header.dielectric_count = scene.dielectrics.size();
+    header.emissive_count = scene.emissives.size();
+
+    std::vector<lambertian_record> lambertians;
+    for (const lambertian &m : scene.lambertians) {
+        lambertians.push_back({{m.albedo[0], m.albedo[1], m.albedo[2]}});
+    }
+    std::vector<metal_record> metals;
+    for (const metal &m : scene.metals) {
+        metals.push_back({{m.albedo[0], m.albedo[1], m.albedo[2]}, m.fuzz});
+    }
+    std::vector<dielectric_record> dielectrics;
+    for (const dielectric &m : scene.dielectrics) {
+        dielectrics.push_back({m.ref_idx});
+    }
+    std::vector<emissive_record> emissives;
+    for (const diffuse_light &m : scene.emissives) {
+        emissives.push_back({{m.emit[0], m.emit[1], m.emit[2]}});
+    }
+
+    // Lay the sections out one after the other, each starting on an aligned offset
+    struct section {
+        uint64_t *offset;
+        const void *data;
+        size_t bytes;
+    };
+    size_t padded = size_t(scene.sphere_count) + PACKED_SPHERES_PADDING;
+    section sections[] = {
+            {&header.nodes_offset, scene.node_data, sizeof(bvh_node) * size_t(scene.node_count)},
+            {&header.center_x_offset, scene.sphere_view.center_x, sizeof(float) * padded},
+            {&header.center_y_offset, scene.sphere_view.center_y, sizeof(float) * padded},
+            {&header.center_z_offset, scene.sphere_view.center_z, sizeof(float) * padded},
+            {&header.radius_offset, scene.sphere_view.radius, sizeof(float) * padded},
+            {&header.materials_offset, scene.material_ids, sizeof(material_id) * size_t(scene.sphere_count)},
+            {&header.lambertians_offset, lambertians.data(), sizeof(lambertian_record) * lambertians.size()},
+            {&header.metals_offset, metals.data(), sizeof(metal_record) * metals.size()},
+            {&header.dielectrics_offset, dielectrics.data(), sizeof(dielectric_record) * dielectrics.size()},
+            {&header.emissives_offset, emissives.data(), sizeof(emissive_record) * emissives.size()},
+    };
+    uint64_t end = sizeof(scene_cache_header);
+    for (section &s : sections) {
+        *s.offset = (end + SCENE_CACHE_ALIGNMENT - 1) / SCENE_CACHE_ALIGNMENT * SCENE_CACHE_ALIGNMENT;
+        end = *s.offset + s.bytes;
+    }
+    header.file_size = end;
+
+    // Same temporary file and rename as the checkpoints, a reader never maps a half written cache
+    std::string temp_path = path + ".tmp";
+    FILE *file = fopen(temp_path.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    uint64_t written = sizeof(header);
+    const char zeros[SCENE_CACHE_ALIGNMENT] = {};
+    for (const section &s : sections) {
+        ok = ok && fwrite(zeros, 1, *s.offset - written, file) == *s.offset - written;
+        ok = ok && (s.bytes == 0 || fwrite(s.data, 1, s.bytes, file) == s.bytes);
+        written = *s.offset + s.bytes;
+    }
+    ok = fclose(file) == 0 && ok;
+    return ok && rename(temp_path.c_str(), path.c_str()) == 0;
+}
+
+inline bool validate_scene_cache(const scene_cache_header &header, const mapped_file &file) {
+    // Everything the renderer will index with comes from the file, so check that it stays inside it
+    if (header.file_size != file.size || header.padding < uint32_t(PACKED_SPHERES_PADDING) ||
+        header.sphere_count > uint64_t(0x3FFFFFFF) || header.node_count > uint64_t(0x7FFFFFFF) ||
+        (header.node_count == 0) != (header.sphere_count == 0)) {
+        return false;
+    }
+    uint64_t padded = header.sphere_count + header.padding;
+    struct section {
+        uint64_t offset;
+        uint64_t bytes;
+    };
+    section sections[] = {
+            {header.nodes_offset, sizeof(bvh_node) * header.node_count},
+            {header.center_x_offset, sizeof(float) * padded},
+            {header.center_y_offset, sizeof(float) * padded},
+            {header.center_z_offset, sizeof(float) * padded},
+            {header.radius_offset, sizeof(float) * padded},
+            {header.materials_offset, sizeof(material_id) * header.sphere_count},
+            {header.lambertians_offset, sizeof(lambertian_record) * header.lambertian_count},
+            {header.metals_offset, sizeof(metal_record) * header.metal_count},
+            {header.dielectrics_offset, sizeof(dielectric_record) * header.dielectric_count},
+            {header.emissives_offset, sizeof(emissive_record) * header.emissive_count},
+    };
+    for (const section &s : sections) {
+        if (s.offset % SCENE_CACHE_ALIGNMENT != 0 || s.offset < sizeof(scene_cache_header) || s.offset > file.size ||
+            s.bytes > file.size - s.offset) {
+            return false;
+        }
+    }
+
+    // Children come after their parents and leaves stay inside the sphere arrays, which also rules out cycles.
+    // The depth check keeps the traversal stack from overflowing
+    const bvh_node *nodes = reinterpret_cast<const bvh_node *>(file.data + header.nodes_offset);
+    std::vector<uint16_t> depth(header.node_count, 0);
+    for (uint64_t i = 0; i < header.node_count; i++) {
+        const bvh_node &node = nodes[i];
+        if (node.count > 0) {
+            if (node.offset < 0 || uint64_t(node.offset) + node.count > header.sphere_count) {
+                return false;
+            }
+        } else {
+            if (node.offset <= int64_t(i) + 1 || uint64_t(node.offset) >= header.node_count ||
+                depth[i] + 1 >= BVH_STACK_SIZE) {
+                return false;
+            }
+            depth[i + 1] = depth[node.offset] = uint16_t(depth[i] + 1);
+        }
+    }
+
+    const material_id *ids = reinterpret_cast<const material_id *>(file.data + header.materials_offset);
+    for (uint64_t i = 0; i < header.sphere_count; i++) {
+        uint64_t index = material_id_index(ids[i]);
+        switch (material_id_kind(ids[i])) {
+            case material_kind::lambertian: if (index >= header.lambertian_count) return false; break;
+            case material_kind::metal: if (index >= header.metal_count) return false; break;
+            case material_kind::dielectric: if (index >= header.dielectric_count) return false; break;
+            case material_kind::emissive: if (index >= header.emissive_count) return false; break;
+            default: return false;
+        }
+    }
+    return true;
+}
+
+inline bool load_scene_cache(const std::string &path, scene_data &scene, scene_description &description) {
+    std::shared_ptr<mapped_file> file = mapped_file::open(path);
+    if (!file || file->size < sizeof(scene_cache_header)) {
+        std::cerr << "Could not map scene cache " << path << "\n";
+        return false;
+    }
+    const scene_cache_header &header = *reinterpret_cast<const scene_cache_header *>(file->data);
+    if (memcmp(header.magic, SCENE_CACHE_MAGIC, sizeof(header.magic)) != 0 || header.version != SCENE_CACHE_VERSION ||
+        header.byte_order != SCENE_CACHE_BYTE_ORDER || header.header_size != sizeof(scene_cache_header) ||
+        header.node_size != sizeof(bvh_node) || header.lambertian_size != sizeof(lambertian_record) ||
+        header.metal_size != sizeof(metal_record) || header.dielectric_size != sizeof(dielectric_record) ||
+        header.emissive_size != sizeof(emissive_record)) {
+        std::cerr << path << " is not a scene cache of this version, rebuild it from the text scene\n";
+        return false;
+    }
+    if (!validate_scene_cache(header, *file)) {
+        std::cerr << path << " is truncated or corrupt\n";
+        return false;
+    }
+
+    description.width = header.width;
+    description.height = header.height;
+    description.samples = header.samples;
+    description.has_seed = header.has_seed != 0;
+    description.seed = header.seed;
+    const float *v = header.view;
+    description.view.lookfrom = vec3(v[0], v[1], v[2]);
+    description.view.lookat = vec3(v[3], v[4], v[5]);
+    description.view.vup = vec3(v[6], v[7], v[8]);
+    description.view.vertical_fov = v[9];
+    description.view.aperture = v[10];
+    description.view.focus_dist = v[11];
+
+    // Materials are added in file order, so their indices and with them the material ids stay the same
+    const unsigned char *base = file->data;
+    auto lambertians = reinterpret_cast<const lambertian_record *>(base + header.lambertians_offset);
+    for (uint64_t i = 0; i < header.lambertian_count; i++) {
+        const float *a = lambertians[i].albedo;
+        scene.add_lambertian(vec3(a[0], a[1], a[2]));
+    }
+    auto metals = reinterpret_cast<const metal_record *>(base + header.metals_offset);
+    for (uint64_t i = 0; i < header.metal_count; i++) {
+        const float *a = metals[i].albedo;
+        scene.add_metal(vec3(a[0], a[1], a[2]), metals[i].fuzz);
+    }
+    auto dielectrics = reinterpret_cast<const dielectric_record *>(base + header.dielectrics_offset);
+    for (uint64_t i = 0; i < header.dielectric_count; i++) {
+        scene.add_dielectric(dielectrics[i].ref_idx);
+    }
+    auto emissives = reinterpret_cast<const emissive_record *>(base + header.emissives_offset);
+    for (uint64_t i = 0; i < header.emissive_count; i++) {
+        const float *e = emissives[i].emit;
+        scene.add_emissive(vec3(e[0], e[1], e[2]));
+    }
+
+    sphere_soa_view spheres = {reinterpret_cast<const float *>(base + header.center_x_offset),
+                               reinterpret_cast<const float *>(base + header.center_y_offset),
+                               reinterpret_cast<const float *>(base + header.center_z_offset),
+                               reinterpret_cast<const float *>(base + header.radius_offset)};
+    scene.use_arrays(reinterpret_cast<const bvh_node *>(base + header.nodes_offset), int(header.node_count), spheres,
+                     reinterpret_cast<const material_id *>(base + header.materials_offset), int(header.sphere_count),
+                     file);
+    return true;
+}
+
+// Load either form, telling them apart by the magic at the start of the cache
+inline bool load_scene(const std::string &path, scene_data &scene, scene_description &description) {
+    if (is_scene_cache(path)) {
+        return load_scene_cache(path, scene, description);
+    }
+    return load_scene_text(path, scene, description);
+}
+
+#endif //RAY_TRACING_SCENE_FILE_H
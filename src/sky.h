@@ -0,0 +1,26 @@
+
+#ifndef RAY_TRACING_SKY_H
+#define RAY_TRACING_SKY_H
+
+#include "ray.h"
+#include "vec3x8.h"
+
+inline vec3 sky_color(const ray &r) {
+    // Background for rays that escape the scene: a blend from white at the horizon to light blue overhead
+    vec3 unit_direction = unit_vector(r.direction());
+    float t = 0.5 * (unit_direction.y() + 1.0);
+    return (1.0 - t) * vec3(1.0, 1.0, 1.0) + t * vec3(0.5, 0.7, 1.0);
+}
+
+inline vec3x8 sky_color(const vec3x8 &directions) {
+    // sky_color() of eight ray directions at once
+    vec3x8 unit_directions = unit_vector(directions);
+    float8 t, one_minus_t;
+    for (int i = 0; i < PACKET_WIDTH; i++) {
+        t.f[i] = 0.5f * (unit_directions.y[i] + 1.0f);
+        one_minus_t.f[i] = 1.0f - t.f[i];
+    }
+    return one_minus_t * splat(vec3(1.0, 1.0, 1.0)) + t * splat(vec3(0.5, 0.7, 1.0));
+}
+
+#endif //RAY_TRACING_SKY_H
@@ -0,0 +1,164 @@
+
+#ifndef RAY_TRACING_THREAD_POOL_H
+#define RAY_TRACING_THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class thread_pool {
+    // A fixed set of worker threads, each with its own double ended task queue.
+    // A worker pops new work from the back of its own queue, and when that runs dry it steals
+    // from the front of another worker's queue, so uneven tasks (e.g. tiles of glass versus tiles of sky)
+    // still keep every core busy until the very end of the frame
+public:
+    explicit thread_pool(int num_threads) {
+        if (num_threads <= 0) {
+            num_threads = int(std::thread::hardware_concurrency());
+        }
+        if (num_threads <= 0) {
+            num_threads = 1;
+        }
+        for (int i = 0; i < num_threads; i++) {
+            queues.emplace_back(new work_queue());
+        }
+        for (int i = 0; i < num_threads; i++) {
+            workers.emplace_back(&thread_pool::worker_loop, this, i);
+        }
+    }
+
+    ~thread_pool() {
+        {
+            std::lock_guard<std::mutex> guard(state_lock);
+            stopping = true;
+        }
+        work_available.notify_all();
+        for (std::thread &worker : workers) {
+            worker.join();
+        }
+    }
+
+    thread_pool(const thread_pool &) = delete;
+    thread_pool &operator=(const thread_pool &) = delete;
+
+    int size() const { return int(workers.size()); }
+
+    // Index of the calling worker thread in this pool, or -1 if called from outside the pool
+    static int current_worker() { return worker_index(); }
+
+    inline void submit(std::function<void()> task);
+
+    // Block until every task submitted so far has finished
+    inline void wait();
+
+private:
+    struct work_queue {
+        std::mutex lock;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    static int &worker_index() {
+        static thread_local int index = -1;
+        return index;
+    }
+
+    inline bool pop_local(int index, std::function<void()> &task);
+
+    inline bool steal(int thief, std::function<void()> &task);
+
+    inline void worker_loop(int index);
+
+    std::vector<std::unique_ptr<work_queue>> queues;
+    std::vector<std::thread> workers;
+
+    std::mutex state_lock;
+    std::condition_variable work_available;
+    std::condition_variable all_done;
+    // Tasks submitted but not yet finished
+    std::atomic<int> pending{0};
+    // Tasks sitting in some queue, used so idle workers know whether it is worth scanning for work
+    std::atomic<int> queued{0};
+    int next_queue = 0;
+    bool stopping = false;
+};
+
+inline void thread_pool::submit(std::function<void()> task) {
+    // Work spawned by a worker goes on that worker's own queue, otherwise deal tasks out round-robin
+    int index = worker_index();
+    if (index < 0) {
+        std::lock_guard<std::mutex> guard(state_lock);
+        index = next_queue;
+        next_queue = (next_queue + 1) % int(queues.size());
+    }
+    pending++;
+    {
+        std::lock_guard<std::mutex> guard(queues[index]->lock);
+        queues[index]->tasks.push_back(std::move(task));
+    }
+    {
+        // Take the state lock so a worker cannot miss this between checking `queued` and going to sleep
+        std::lock_guard<std::mutex> guard(state_lock);
+        queued++;
+    }
+    work_available.notify_one();
+}
+
+inline void thread_pool::wait() {
+    std::unique_lock<std::mutex> guard(state_lock);
+    all_done.wait(guard, [this] { return pending.load() == 0; });
+}
+
+inline bool thread_pool::pop_local(int index, std::function<void()> &task) {
+    work_queue &queue = *queues[index];
+    std::lock_guard<std::mutex> guard(queue.lock);
+    if (queue.tasks.empty()) {
+        return false;
+    }
+    task = std::move(queue.tasks.back());
+    queue.tasks.pop_back();
+    return true;
+}
+
+inline bool thread_pool::steal(int thief, std::function<void()> &task) {
+    // Visit the other queues starting just after our own so that thieves spread out over the victims
+    int n = int(queues.size());
+    for (int offset = 1; offset < n; offset++) {
+        work_queue &victim = *queues[(thief + offset) % n];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+inline void thread_pool::worker_loop(int index) {
+    worker_index() = index;
+    std::function<void()> task;
+    while (true) {
+        if (pop_local(index, task) || steal(index, task)) {
+            queued--;
+            task();
+            task = nullptr;
+            if (--pending == 0) {
+                std::lock_guard<std::mutex> guard(state_lock);
+                all_done.notify_all();
+            }
+            continue;
+        }
+        std::unique_lock<std::mutex> guard(state_lock);
+        work_available.wait(guard, [this] { return stopping || queued.load() > 0; });
+        if (stopping && queued.load() == 0) {
+            return;
+        }
+    }
+}
+
+#endif //RAY_TRACING_THREAD_POOL_H
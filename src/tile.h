@@ -0,0 +1,38 @@
+
+#ifndef RAY_TRACING_TILE_H
+#define RAY_TRACING_TILE_H
+
+#include <vector>
+
+struct tile {
+    // Half open pixel rectangle [x_begin, x_end) x [y_begin, y_end)
+    int x_begin;
+    int y_begin;
+    int x_end;
+    int y_end;
+    // Position of the tile in the list
+    int index;
+};
+
+inline std::vector<tile> make_tiles(int x_begin, int y_begin, int x_end, int y_end, int tile_size) {
+    // Split the rectangle [x_begin, x_end) x [y_begin, y_end) into square tiles, starting from the top row so that
+    // the picture fills in top down
+    if (tile_size <= 0) {
+        tile_size = 32;
+    }
+    std::vector<tile> tiles;
+    for (int y_top = y_end; y_top > y_begin; y_top -= tile_size) {
+        int y_bottom = y_top - tile_size > y_begin ? y_top - tile_size : y_begin;
+        for (int x_left = x_begin; x_left < x_end; x_left += tile_size) {
+            int x_right = x_left + tile_size < x_end ? x_left + tile_size : x_end;
+            tiles.push_back({x_left, y_bottom, x_right, y_top, int(tiles.size())});
+        }
+    }
+    return tiles;
+}
+
+inline std::vector<tile> make_tiles(int x_pixels, int y_pixels, int tile_size) {
+    return make_tiles(0, 0, x_pixels, y_pixels, tile_size);
+}
+
+#endif //RAY_TRACING_TILE_H
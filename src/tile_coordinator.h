@@ -0,0 +1,425 @@
+
+#ifndef RAY_TRACING_TILE_COORDINATOR_H
+#define RAY_TRACING_TILE_COORDINATOR_H
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <vector>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "accumulation_buffer.h"
+#include "render_stats.h"
+#include "tile.h"
+
+// Times a tile may take down a worker before the coordinator gives up on workers for it and renders it itself
+const int COORDINATOR_MAX_TILE_ATTEMPTS = 3;
+
+// A worker that has not sent back its tile this long after it got it is taken to be hung, and is lost like one
+// that died. It is a long time for one tile, so that only a worker that is stuck runs into it
+const int COORDINATOR_TILE_TIMEOUT_MS = 120000;
+
+struct tile_request {
+    // The tile and the pass to render. A tile index of -1 tells the worker to exit.
+    // If has_active is set, one byte per pixel of the tile follows, row by row from y_begin: the adaptive mask
+    int32_t index;
+    int32_t x_begin;
+    int32_t y_begin;
+    int32_t x_end;
+    int32_t y_end;
+    int32_t samples;
+    uint64_t pass;
+    uint32_t has_active;
+    uint32_t pad;
+};
+
+struct tile_pixel {
+    // What a worker sends back for each pixel of a tile, row by row from y_begin
+    float sum[3];
+    pixel_stats stats;
+};
+
+struct tile_counters {
+    // With RT_ENABLE_STATS, what the worker counted while rendering a tile follows its pixels, so that the
+    // stats of a render with workers cover the whole image
+    render_counters counters;
+    double seconds;
+};
+
+// Read or write exactly `bytes` bytes, false if the other end went away first. With a timeout, reading also
+// gives up once no data has come for that many milliseconds
+inline bool read_exactly(int fd, void *data, size_t bytes, int timeout_ms = -1) {
+    char *p = static_cast<char *>(data);
+    while (bytes > 0) {
+        if (timeout_ms >= 0) {
+            pollfd waiting{fd, POLLIN, 0};
+            int ready = poll(&waiting, 1, timeout_ms);
+            if (ready < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ready <= 0) {
+                return false;
+            }
+        }
+        ssize_t n = recv(fd, p, bytes, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        bytes -= size_t(n);
+    }
+    return true;
+}
+
+inline bool write_exactly(int fd, const void *data, size_t bytes) {
+    // MSG_NOSIGNAL, so writing to a dead worker is an error instead of a SIGPIPE
+    const char *p = static_cast<const char *>(data);
+    while (bytes > 0) {
+        ssize_t n = send(fd, p, bytes, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        bytes -= size_t(n);
+    }
+    return true;
+}
+
+class tile_coordinator {
+    // Renders passes by handing their tiles out to worker processes, one tile at a time per worker, over a
+    // socket pair each. Workers are forked from the renderer once the scene and the camera are set up, so
+    // they share them without any copying, and they render a tile into a buffer of their own and send back
+    // the float sums and statistics of its pixels, which are merged here.
+    // A worker that dies (its socket closes mid tile), or hangs for COORDINATOR_TILE_TIMEOUT_MS, is killed and
+    // reaped and its tile goes back in the queue for the workers that are left. It is not replaced: forking
+    // again here would fork a renderer whose other threads (the image writer, a thread pool) are running.
+    // A tile that has taken down COORDINATOR_MAX_TILE_ATTEMPTS workers, or any tile once no worker is left, is
+    // rendered by the coordinator itself.
+    // Since every pixel draws from its own random stream, the image is the same as a single process render
+public:
+    // render(t, pass, samples, active, buffer) adds the samples of one tile to buffer, the same way
+    // colour_gradient::render_tile does. It runs in the workers and, for tiles no worker could finish, here
+    typedef std::function<void(const tile &, uint64_t, int, const std::vector<unsigned char> *,
+                               accumulation_buffer &)> tile_renderer;
+
+    tile_coordinator(int worker_count, int w, int h, tile_renderer render_tile)
+            : width(w), height(h), render(std::move(render_tile)) {
+        for (int i = 0; i < worker_count; i++) {
+            worker_slot slot;
+            if (!start_worker(slot)) {
+                std::cerr << "Could not start a render worker\n";
+            }
+            workers.push_back(slot);
+        }
+    }
+
+    ~tile_coordinator() {
+        tile_request quit{};
+        quit.index = -1;
+        for (worker_slot &w : workers) {
+            if (w.fd >= 0) {
+                write_exactly(w.fd, &quit, sizeof(quit));
+                close(w.fd);
+                waitpid(w.pid, nullptr, 0);
+            }
+        }
+    }
+
+    tile_coordinator(const tile_coordinator &) = delete;
+    tile_coordinator &operator=(const tile_coordinator &) = delete;
+
+    int live_workers() const {
+        int live = 0;
+        for (const worker_slot &w : workers) {
+            live += w.fd >= 0;
+        }
+        return live;
+    }
+
+    // Add one pass over these tiles to accumulated, with active masking pixels like render_pass does
+    inline void render_pass(const std::vector<tile> &tiles, uint64_t pass, int samples,
+                            const std::vector<unsigned char> *active, accumulation_buffer &accumulated);
+
+private:
+    struct worker_slot {
+        pid_t pid = -1;
+        int fd = -1;
+        // Index into the pass's tiles of the tile this worker is rendering, -1 when idle
+        int busy = -1;
+        // When the worker is given up on if its tile has not come back
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    inline bool start_worker(worker_slot &slot);
+
+    inline void worker_loop(int fd);
+
+    inline void lose_worker(worker_slot &slot, std::deque<int> &queue, std::vector<int> &attempts);
+
+    inline bool send_tile(worker_slot &slot, const tile &t, uint64_t pass, int samples,
+                          const std::vector<unsigned char> *active);
+
+    inline bool receive_tile(worker_slot &slot, const tile &t, accumulation_buffer &accumulated);
+
+    int width;
+    int height;
+    tile_renderer render;
+    std::vector<worker_slot> workers;
+};
+
+inline bool tile_coordinator::start_worker(worker_slot &slot) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        return false;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if (pid == 0) {
+        // The child only keeps its own end of its own socket. It leaves with _exit, since the destructors of
+        // what it inherited (the thread pool, the image writer) would wait for threads that were not forked
+        close(fds[0]);
+        for (const worker_slot &w : workers) {
+            if (w.fd >= 0) {
+                close(w.fd);
+            }
+        }
+        worker_loop(fds[1]);
+        _exit(0);
+    }
+    close(fds[1]);
+    slot.pid = pid;
+    slot.fd = fds[0];
+    slot.busy = -1;
+    return true;
+}
+
+inline void tile_coordinator::worker_loop(int fd) {
+    // The worker starts with a copy of the renderer's counters, only what it counts from here on is sent back
+    RT_STAT(reset_stats());
+    accumulation_buffer buffer(width, height);
+    std::vector<unsigned char> active;
+    std::vector<tile_pixel> pixels;
+    tile_request request{};
+    while (read_exactly(fd, &request, sizeof(request)) && request.index >= 0) {
+        tile t{request.x_begin, request.y_begin, request.x_end, request.y_end, request.index};
+        if (t.x_begin < 0 || t.y_begin < 0 || t.x_end > width || t.y_end > height ||
+            t.x_begin >= t.x_end || t.y_begin >= t.y_end) {
+            break;
+        }
+        size_t tile_pixels = size_t(t.x_end - t.x_begin) * size_t(t.y_end - t.y_begin);
+        if (request.has_active) {
+            std::vector<unsigned char> mask(tile_pixels);
+            if (!read_exactly(fd, mask.data(), mask.size())) {
+                break;
+            }
+            // Only the tile's own part of the mask is ever read, so it is simply overwritten tile by tile
+            active.resize(buffer.sum.size());
+            size_t i = 0;
+            for (int y = t.y_begin; y < t.y_end; y++) {
+                for (int x = t.x_begin; x < t.x_end; x++) {
+                    active[buffer.index(x, y)] = mask[i++];
+                }
+            }
+        }
+#ifdef RT_ENABLE_STATS
+        auto start = std::chrono::steady_clock::now();
+#endif
+        render(t, request.pass, request.samples, request.has_active ? &active : nullptr, buffer);
+
+        // Send the tile and clear it, so the next request for the same pixels starts from zero
+        pixels.resize(tile_pixels);
+        size_t i = 0;
+        for (int y = t.y_begin; y < t.y_end; y++) {
+            for (int x = t.x_begin; x < t.x_end; x++) {
+                size_t index = buffer.index(x, y);
+                pixels[i].sum[0] = buffer.sum[index][0];
+                pixels[i].sum[1] = buffer.sum[index][1];
+                pixels[i].sum[2] = buffer.sum[index][2];
+                pixels[i].stats = buffer.stats[index];
+                buffer.sum[index] = vec3(0, 0, 0);
+                buffer.stats[index] = pixel_stats();
+                i++;
+            }
+        }
+        if (!write_exactly(fd, &request.index, sizeof(request.index)) ||
+            !write_exactly(fd, pixels.data(), pixels.size() * sizeof(tile_pixel))) {
+            break;
+        }
+#ifdef RT_ENABLE_STATS
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        tile_counters counted{thread_stats(), seconds};
+        thread_stats() = render_stats();
+        if (!write_exactly(fd, &counted, sizeof(counted))) {
+            break;
+        }
+#endif
+    }
+    close(fd);
+}
+
+inline bool tile_coordinator::send_tile(worker_slot &slot, const tile &t, uint64_t pass, int samples,
+                                        const std::vector<unsigned char> *active) {
+    tile_request request{};
+    request.index = t.index;
+    request.x_begin = t.x_begin;
+    request.y_begin = t.y_begin;
+    request.x_end = t.x_end;
+    request.y_end = t.y_end;
+    request.samples = samples;
+    request.pass = pass;
+    request.has_active = active != nullptr;
+    if (!write_exactly(slot.fd, &request, sizeof(request))) {
+        return false;
+    }
+    if (active) {
+        std::vector<unsigned char> mask;
+        for (int y = t.y_begin; y < t.y_end; y++) {
+            for (int x = t.x_begin; x < t.x_end; x++) {
+                mask.push_back((*active)[size_t(height - 1 - y) * width + x]);
+            }
+        }
+        return write_exactly(slot.fd, mask.data(), mask.size());
+    }
+    return true;
+}
+
+inline bool tile_coordinator::receive_tile(worker_slot &slot, const tile &t, accumulation_buffer &accumulated) {
+    // Read the whole tile before merging any of it, a worker that dies half way contributes nothing
+    int32_t index;
+    std::vector<tile_pixel> pixels(size_t(t.x_end - t.x_begin) * size_t(t.y_end - t.y_begin));
+    if (!read_exactly(slot.fd, &index, sizeof(index), COORDINATOR_TILE_TIMEOUT_MS) || index != t.index ||
+        !read_exactly(slot.fd, pixels.data(), pixels.size() * sizeof(tile_pixel), COORDINATOR_TILE_TIMEOUT_MS)) {
+        return false;
+    }
+#ifdef RT_ENABLE_STATS
+    // Counted into the coordinator's own thread, which merged_stats() then adds up with the rest
+    tile_counters counted;
+    if (!read_exactly(slot.fd, &counted, sizeof(counted), COORDINATOR_TILE_TIMEOUT_MS)) {
+        return false;
+    }
+    thread_stats().merge_counters(counted.counters);
+    thread_stats().add_tile_time(t.index, counted.seconds);
+#endif
+    size_t i = 0;
+    for (int y = t.y_begin; y < t.y_end; y++) {
+        for (int x = t.x_begin; x < t.x_end; x++) {
+            size_t target = accumulated.index(x, y);
+            accumulated.sum[target] += vec3(pixels[i].sum[0], pixels[i].sum[1], pixels[i].sum[2]);
+            accumulated.stats[target].merge(pixels[i].stats);
+            i++;
+        }
+    }
+    return true;
+}
+
+inline void tile_coordinator::lose_worker(worker_slot &slot, std::deque<int> &queue, std::vector<int> &attempts) {
+    // Put its tile back and reap it, killing it first in case it is hung rather than dead
+    if (slot.busy >= 0) {
+        attempts[slot.busy]++;
+        queue.push_front(slot.busy);
+    }
+    close(slot.fd);
+    kill(slot.pid, SIGKILL);
+    waitpid(slot.pid, nullptr, 0);
+    std::cerr << "Render worker " << slot.pid << " was lost, " << live_workers() - 1 << " left\n";
+    slot.fd = -1;
+    slot.busy = -1;
+}
+
+inline void tile_coordinator::render_pass(const std::vector<tile> &tiles, uint64_t pass, int samples,
+                                          const std::vector<unsigned char> *active,
+                                          accumulation_buffer &accumulated) {
+    std::deque<int> queue;
+    for (int i = 0; i < int(tiles.size()); i++) {
+        queue.push_back(i);
+    }
+    std::vector<int> attempts(tiles.size(), 0);
+    size_t finished = 0;
+    std::vector<pollfd> polled;
+    std::vector<worker_slot *> polled_workers;
+
+    while (finished < tiles.size()) {
+        // Tiles that keep killing workers, and everything once there are no workers left, are rendered here
+        while (!queue.empty() && (live_workers() == 0 || attempts[queue.front()] >= COORDINATOR_MAX_TILE_ATTEMPTS)) {
+            render(tiles[queue.front()], pass, samples, active, accumulated);
+            queue.pop_front();
+            finished++;
+        }
+
+        for (worker_slot &w : workers) {
+            if (w.fd >= 0 && w.busy < 0 && !queue.empty()) {
+                int next = queue.front();
+                queue.pop_front();
+                w.busy = next;
+                w.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(COORDINATOR_TILE_TIMEOUT_MS);
+                if (!send_tile(w, tiles[next], pass, samples, active)) {
+                    lose_worker(w, queue, attempts);
+                }
+            }
+        }
+
+        // Wait until a worker answers or the earliest deadline passes
+        polled.clear();
+        polled_workers.clear();
+        auto now = std::chrono::steady_clock::now();
+        auto first_deadline = now + std::chrono::milliseconds(COORDINATOR_TILE_TIMEOUT_MS);
+        for (worker_slot &w : workers) {
+            if (w.fd >= 0 && w.busy >= 0) {
+                polled.push_back({w.fd, POLLIN, 0});
+                polled_workers.push_back(&w);
+                first_deadline = std::min(first_deadline, w.deadline);
+            }
+        }
+        if (polled.empty()) {
+            continue;
+        }
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(first_deadline - now).count();
+        if (poll(polled.data(), polled.size(), int(wait > 0 ? wait : 0) + 1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "poll failed, restarting the render workers\n";
+            for (worker_slot *w : polled_workers) {
+                lose_worker(*w, queue, attempts);
+            }
+            continue;
+        }
+        now = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < polled.size(); i++) {
+            worker_slot &w = *polled_workers[i];
+            if (polled[i].revents == 0) {
+                if (now >= w.deadline) {
+                    std::cerr << "Render worker " << w.pid << " did not send back its tile in "
+                              << COORDINATOR_TILE_TIMEOUT_MS / 1000 << " seconds\n";
+                    lose_worker(w, queue, attempts);
+                }
+                continue;
+            }
+            if (receive_tile(w, tiles[w.busy], accumulated)) {
+                w.busy = -1;
+                finished++;
+            } else {
+                lose_worker(w, queue, attempts);
+            }
+        }
+    }
+}
+
+#endif //RAY_TRACING_TILE_COORDINATOR_H
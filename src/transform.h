@@ -0,0 +1,118 @@
+
+#ifndef RAY_TRACING_TRANSFORM_H
+#define RAY_TRACING_TRANSFORM_H
+
+#include <cmath>
+#include "aabb.h"
+#include "ray.h"
+
+struct affine_transform {
+    // 3x4 matrix: a linear part in the first three columns and a translation in the last, applied as
+    // m * (x, y, z, 1). 48 bytes, the bottom row of a 4x4 affine matrix is always 0 0 0 1 and is left out
+    float m[3][4];
+
+    static affine_transform identity() {
+        return {{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}}};
+    }
+
+    static affine_transform translate(const vec3 &offset) {
+        return {{{1, 0, 0, offset[0]}, {0, 1, 0, offset[1]}, {0, 0, 1, offset[2]}}};
+    }
+
+    static affine_transform scale(const vec3 &factors) {
+        return {{{factors[0], 0, 0, 0}, {0, factors[1], 0, 0}, {0, 0, factors[2], 0}}};
+    }
+
+    // Rotation by degrees about an axis through the origin, anticlockwise looking down the axis
+    static affine_transform rotate(const vec3 &axis, float degrees) {
+        vec3 a = unit_vector(axis);
+        float radians = degrees * float(M_PI) / 180;
+        float c = std::cos(radians);
+        float s = std::sin(radians);
+        float k = 1 - c;
+        return {{{c + a[0] * a[0] * k, a[0] * a[1] * k - a[2] * s, a[0] * a[2] * k + a[1] * s, 0},
+                 {a[1] * a[0] * k + a[2] * s, c + a[1] * a[1] * k, a[1] * a[2] * k - a[0] * s, 0},
+                 {a[2] * a[0] * k - a[1] * s, a[2] * a[1] * k + a[0] * s, c + a[2] * a[2] * k, 0}}};
+    }
+
+    vec3 apply_point(const vec3 &p) const {
+        return vec3(m[0][0] * p[0] + m[0][1] * p[1] + m[0][2] * p[2] + m[0][3],
+                    m[1][0] * p[0] + m[1][1] * p[1] + m[1][2] * p[2] + m[1][3],
+                    m[2][0] * p[0] + m[2][1] * p[1] + m[2][2] * p[2] + m[2][3]);
+    }
+
+    vec3 apply_vector(const vec3 &v) const {
+        return vec3(m[0][0] * v[0] + m[0][1] * v[1] + m[0][2] * v[2],
+                    m[1][0] * v[0] + m[1][1] * v[1] + m[1][2] * v[2],
+                    m[2][0] * v[0] + m[2][1] * v[1] + m[2][2] * v[2]);
+    }
+
+    // The linear part transposed times v. On the world to object transform this takes an object space normal
+    // to world space, as the inverse transpose of the object to world transform does
+    vec3 apply_transposed(const vec3 &v) const {
+        return vec3(m[0][0] * v[0] + m[1][0] * v[1] + m[2][0] * v[2],
+                    m[0][1] * v[0] + m[1][1] * v[1] + m[2][1] * v[2],
+                    m[0][2] * v[0] + m[1][2] * v[1] + m[2][2] * v[2]);
+    }
+
+    // The same ray in the space this transforms to. The direction is not renormalised, so a point at t on
+    // the new ray is the image of the point at t on the old one and hit distances carry over unchanged
+    ray apply(const ray &r) const {
+        return ray(apply_point(r.origin()), apply_vector(r.direction()));
+    }
+
+    // Box around the image of box, from its eight corners
+    aabb apply(const aabb &box) const {
+        aabb result;
+        for (int corner = 0; corner < 8; corner++) {
+            vec3 p(corner & 1 ? box.maximum[0] : box.minimum[0], corner & 2 ? box.maximum[1] : box.minimum[1],
+                   corner & 4 ? box.maximum[2] : box.minimum[2]);
+            result.expand(apply_point(p));
+        }
+        return result;
+    }
+
+    float determinant() const {
+        return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+               m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    }
+
+    // Returns false, leaving inverse alone, if the linear part cannot be inverted
+    bool invert(affine_transform &inverse) const {
+        float det = determinant();
+        if (!(std::fabs(det) > 0) || !std::isfinite(det)) {
+            return false;
+        }
+        float inv = 1 / det;
+        affine_transform r{};
+        r.m[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * inv;
+        r.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv;
+        r.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv;
+        r.m[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * inv;
+        r.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv;
+        r.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv;
+        r.m[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * inv;
+        r.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv;
+        r.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv;
+        vec3 t = r.apply_vector(vec3(m[0][3], m[1][3], m[2][3]));
+        r.m[0][3] = -t[0];
+        r.m[1][3] = -t[1];
+        r.m[2][3] = -t[2];
+        inverse = r;
+        return true;
+    }
+};
+
+// a after b: points go through b first
+inline affine_transform operator*(const affine_transform &a, const affine_transform &b) {
+    affine_transform r{};
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) {
+            r.m[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] + a.m[i][2] * b.m[2][j];
+        }
+        r.m[i][3] += a.m[i][3];
+    }
+    return r;
+}
+
+#endif //RAY_TRACING_TRANSFORM_H
@@ -0,0 +1,545 @@
+
+#ifndef RAY_TRACING_TRIANGLE_MESH_H
+#define RAY_TRACING_TRIANGLE_MESH_H
+
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "bvh.h"
+#include "hittable.h"
+#include "mapped_file.h"
+
+// Most triangles in a leaf of a mesh bvh. A triangle test costs a few box tests, so leaves stay small,
+// and the count has to fit the 4 bits a quantized node keeps for it
+const int MESH_LEAF_SIZE = 4;
+// Quantized nodes keep their offset in 26 bits, so a mesh can have this many nodes. A bvh has fewer than two
+// nodes per triangle, which leaves room for 32 million triangles
+const uint64_t MESH_MAX_NODES = 1ull << 26;
+// Number of steps of the grid the quantized boxes snap to, along each axis of the mesh's bounds
+const int MESH_QUANTIZATION_STEPS = 65535;
+
+struct quantized_bvh_node {
+    // 16 bytes, half a bvh_node. The box is stored in steps of a grid laid over the whole mesh, rounded outwards
+    // so that it holds everything the exact box held, and offset, leaf count and split axis share 32 bits.
+    // Rays are moved into grid units before the walk (see triangle_mesh::intersect), which leaves their t as
+    // it was, so the boxes are tested without being decoded back into world space
+    uint16_t lower[3];
+    uint16_t upper[3];
+    // offset << 6 | count << 2 | axis, with offset and count meaning what they mean in a bvh_node
+    uint32_t packed;
+
+    bool box_hit(const vec3 &origin, const vec3 &inv_direction, float t_min, float t_max) const {
+        aabb box(vec3(lower[0], lower[1], lower[2]), vec3(upper[0], upper[1], upper[2]));
+        return box.hit(origin, inv_direction, t_min, t_max);
+    }
+    int primitives() const { return int((packed >> 2) & 15u); }
+    int link() const { return int(packed >> 6); }
+    int split_axis() const { return int(packed & 3u); }
+};
+
+// Unit vector in 32 bits: folded onto an octahedron and then flattened onto a square, 16 bits per coordinate.
+// Off by less than 0.01 degrees, and a third of the size of three floats
+inline uint32_t encode_normal(const vec3 &n) {
+    float sum = std::fabs(n[0]) + std::fabs(n[1]) + std::fabs(n[2]);
+    if (!(sum > 0)) {
+        return encode_normal(vec3(0, 0, 1));
+    }
+    float x = n[0] / sum;
+    float y = n[1] / sum;
+    if (n[2] < 0) {
+        float folded_x = (1 - std::fabs(y)) * (x < 0 ? -1.0f : 1.0f);
+        y = (1 - std::fabs(x)) * (y < 0 ? -1.0f : 1.0f);
+        x = folded_x;
+    }
+    uint32_t qx = uint32_t(std::lround((x * 0.5f + 0.5f) * 65535.0f));
+    uint32_t qy = uint32_t(std::lround((y * 0.5f + 0.5f) * 65535.0f));
+    return qx | (qy << 16);
+}
+
+inline vec3 decode_normal(uint32_t code) {
+    float x = float(code & 0xFFFFu) * (2.0f / 65535.0f) - 1;
+    float y = float(code >> 16) * (2.0f / 65535.0f) - 1;
+    float z = 1 - std::fabs(x) - std::fabs(y);
+    if (z < 0) {
+        float folded_x = (1 - std::fabs(y)) * (x < 0 ? -1.0f : 1.0f);
+        y = (1 - std::fabs(x)) * (y < 0 ? -1.0f : 1.0f);
+        x = folded_x;
+    }
+    return unit_vector(vec3(x, y, z));
+}
+
+struct watertight_ray {
+    // Per ray setup of the watertight ray/triangle test of Woop, Benthin and Wald: the axis the ray is longest
+    // along becomes z, and a shear turns the ray into the +z axis through the origin. After that the test is
+    // three 2D edge functions at the origin, which two triangles sharing an edge always agree on, so a ray
+    // can never slip through the crack between them
+    explicit watertight_ray(const ray &r) : origin(r.origin()) {
+        vec3 d = r.direction();
+        kz = std::fabs(d[1]) > std::fabs(d[0]) ? 1 : 0;
+        kz = std::fabs(d[2]) > std::fabs(d[kz]) ? 2 : kz;
+        kx = kz == 2 ? 0 : kz + 1;
+        ky = kx == 2 ? 0 : kx + 1;
+        // Keep the winding of the triangles as it was when z points backwards
+        if (d[kz] < 0) {
+            int temp = kx;
+            kx = ky;
+            ky = temp;
+        }
+        shear_x = d[kx] / d[kz];
+        shear_y = d[ky] / d[kz];
+        shear_z = 1.0f / d[kz];
+    }
+
+    vec3 origin;
+    int kx, ky, kz;
+    float shear_x, shear_y, shear_z;
+};
+
+// Two sided test of the triangle p0 p1 p2 against the ray. On a hit between t_min and t_max, t is set and
+// b1, b2 are the barycentric weights of p1 and p2
+inline bool intersect_triangle(const watertight_ray &w, const float *p0, const float *p1, const float *p2,
+                               float t_min, float t_max, float &t, float &b1, float &b2) {
+    float az = p0[w.kz] - w.origin[w.kz];
+    float bz = p1[w.kz] - w.origin[w.kz];
+    float cz = p2[w.kz] - w.origin[w.kz];
+    float ax = p0[w.kx] - w.origin[w.kx] - w.shear_x * az;
+    float ay = p0[w.ky] - w.origin[w.ky] - w.shear_y * az;
+    float bx = p1[w.kx] - w.origin[w.kx] - w.shear_x * bz;
+    float by = p1[w.ky] - w.origin[w.ky] - w.shear_y * bz;
+    float cx = p2[w.kx] - w.origin[w.kx] - w.shear_x * cz;
+    float cy = p2[w.ky] - w.origin[w.ky] - w.shear_y * cz;
+
+    float u = cx * by - cy * bx;
+    float v = ax * cy - ay * cx;
+    float e = bx * ay - by * ax;
+    // An edge function of exactly 0 means the ray grazes an edge, where float rounding could let both triangles
+    // of the edge miss. Products of floats are exact in double, so working the three out again there settles it
+    if (u == 0 || v == 0 || e == 0) {
+        u = float(double(cx) * double(by) - double(cy) * double(bx));
+        v = float(double(ax) * double(cy) - double(ay) * double(cx));
+        e = float(double(bx) * double(ay) - double(by) * double(ax));
+    }
+    if ((u < 0 || v < 0 || e < 0) && (u > 0 || v > 0 || e > 0)) {
+        return false;
+    }
+    float determinant = u + v + e;
+    if (determinant == 0) {
+        return false;
+    }
+    float scaled_t = u * (w.shear_z * az) + v * (w.shear_z * bz) + e * (w.shear_z * cz);
+    float inv_determinant = 1.0f / determinant;
+    float hit_t = scaled_t * inv_determinant;
+    if (!(hit_t > t_min && hit_t < t_max)) {
+        return false;
+    }
+    t = hit_t;
+    b1 = v * inv_determinant;
+    b2 = e * inv_determinant;
+    return true;
+}
+
+
+class triangle_mesh : public hittable {
+    // Indexed triangle mesh with its own bvh. Vertices are shared between the triangles that use them: one
+    // array of positions, an optional array of normals packed into 32 bits each, and three 32 bit indices
+    // per triangle. build() sorts the index triples into the order of the bvh leaves, so leaves point
+    // straight at their triangles without an order array, and stores the bvh as 16 byte quantized nodes.
+    // A typical closed mesh with normals then takes about 35 bytes per triangle all together.
+    // The normal is the face's, pointing the way the corners go round anticlockwise, or interpolated
+    // from the vertex normals when the mesh has them. Triangles are hit from both sides
+public:
+    triangle_mesh() = default;
+
+    triangle_mesh(const triangle_mesh &) = delete;
+    triangle_mesh &operator=(const triangle_mesh &) = delete;
+
+    // Drop the geometry and the bvh, keeping the material
+    void clear() {
+        std::vector<float>().swap(positions);
+        std::vector<uint32_t>().swap(normals);
+        std::vector<uint32_t>().swap(indices);
+        std::vector<quantized_bvh_node>().swap(nodes);
+        bounds = aabb();
+    }
+
+    uint32_t add_vertex(const vec3 &position) {
+        positions.push_back(position[0]);
+        positions.push_back(position[1]);
+        positions.push_back(position[2]);
+        return uint32_t(positions.size() / 3 - 1);
+    }
+
+    uint32_t add_vertex(const vec3 &position, const vec3 &normal) {
+        normals.push_back(encode_normal(normal));
+        return add_vertex(position);
+    }
+
+    void add_triangle(uint32_t a, uint32_t b, uint32_t c) {
+        indices.push_back(a);
+        indices.push_back(b);
+        indices.push_back(c);
+    }
+
+    // Build the bvh over the triangles added so far. Returns false, leaving the mesh empty, for a mesh
+    // whose bvh would not fit the quantized nodes or whose indices point past its vertices
+    inline bool build();
+
+    // Closest hit along the ray between t_min and t_max. On a hit t_max is lowered to it and the triangle
+    // and the barycentric weights of its second and third corner are set, for normal()
+    inline bool intersect(const ray &r, float t_min, float &t_max, uint32_t &triangle, float &b1, float &b2) const;
+
+    inline vec3 normal(uint32_t triangle, float b1, float b2) const;
+
+    // Whether any triangle is hit between t_min and t_max, stopping at the first one found
+    bool occluded(const ray &r, float t_min, float t_max) const override {
+        uint32_t triangle;
+        float b1, b2;
+        return walk<true>(r, t_min, t_max, triangle, b1, b2);
+    }
+
+    bool intersect(const ray &r, float t_min, float &t_max, hit_id &id) const override {
+        uint32_t triangle;
+        float b1, b2;
+        if (!intersect(r, t_min, t_max, triangle, b1, b2)) {
+            return false;
+        }
+        id.object = this;
+        id.inner = nullptr;
+        id.primitive = triangle;
+        id.b1 = b1;
+        id.b2 = b2;
+        return true;
+    }
+
+    bool fill_record(const ray &r, const hit_id &id, float t, hit_record &record) const override {
+        record.t = t;
+        record.point = r.point_given_parameter(t);
+        record.normal = normal(id.primitive, id.b1, id.b2);
+        record.mat_ptr = mat;
+        return true;
+    }
+
+    bool bounding_box(aabb &output_box) const override {
+        if (nodes.empty()) {
+            return false;
+        }
+        output_box = bounds;
+        return true;
+    }
+
+    size_t triangle_count() const { return indices.size() / 3; }
+
+    // Bytes held by the vertex, index and node arrays
+    size_t memory_bytes() const {
+        return positions.capacity() * sizeof(float) + normals.capacity() * sizeof(uint32_t) +
+               indices.capacity() * sizeof(uint32_t) + nodes.capacity() * sizeof(quantized_bvh_node);
+    }
+
+    // x y z of each vertex
+    std::vector<float> positions;
+    // Packed normal of each vertex, see encode_normal(), or empty for a mesh drawn with its face normals
+    std::vector<uint32_t> normals;
+    // Corners of each triangle, in leaf order after build()
+    std::vector<uint32_t> indices;
+    std::vector<quantized_bvh_node> nodes;
+    aabb bounds;
+    // World position of grid point 0 and the size of one grid step along each axis
+    vec3 grid_origin;
+    vec3 grid_step;
+    // Material for the hittable interface, scene_data keeps its own material id for each mesh
+    material *mat = nullptr;
+
+private:
+    // The walk behind intersect() and occluded(), see traverse_bvh()
+    template<bool AnyHit>
+    inline bool walk(const ray &r, float t_min, float &t_max, uint32_t &triangle, float &b1, float &b2) const;
+};
+
+inline bool triangle_mesh::build() {
+    size_t triangles = triangle_count();
+    size_t vertices = positions.size() / 3;
+    // Check the arrays before any of them is indexed, and say which check failed
+    std::string problem;
+    if (indices.size() % 3 != 0) {
+        problem = std::to_string(indices.size()) + " corner indices do not make whole triangles";
+    } else if (!normals.empty() && normals.size() != vertices) {
+        problem = std::to_string(normals.size()) + " normals do not match the vertices";
+    } else if (2 * uint64_t(triangles) >= MESH_MAX_NODES) {
+        problem = "meshes are limited to " + std::to_string(MESH_MAX_NODES / 2) + " triangles";
+    }
+    for (size_t i = 0; problem.empty() && i < indices.size(); i++) {
+        if (indices[i] >= vertices) {
+            problem = "triangle " + std::to_string(i / 3) + " uses vertex " + std::to_string(indices[i]) +
+                      ", past the last one";
+        }
+    }
+    if (!problem.empty()) {
+        std::cerr << "Cannot build a mesh of " << triangles << " triangles over " << vertices << " vertices, "
+                  << problem << "\n";
+        clear();
+        return false;
+    }
+
+    std::vector<aabb> boxes(triangles);
+    for (size_t i = 0; i < triangles; i++) {
+        for (int corner = 0; corner < 3; corner++) {
+            const float *p = &positions[3 * size_t(indices[3 * i + corner])];
+            boxes[i].expand(vec3(p[0], p[1], p[2]));
+        }
+    }
+    bvh_builder builder(boxes, MESH_LEAF_SIZE);
+    std::vector<aabb>().swap(boxes);
+
+    std::vector<uint32_t> ordered(indices.size());
+    for (size_t i = 0; i < triangles; i++) {
+        size_t from = 3 * size_t(builder.order[i]);
+        ordered[3 * i] = indices[from];
+        ordered[3 * i + 1] = indices[from + 1];
+        ordered[3 * i + 2] = indices[from + 2];
+    }
+    indices = std::move(ordered);
+
+    // The grid reaches one step past the bounds on every side, so boxes rounded outwards never get clamped.
+    // Flat axes borrow the step of the longest one
+    nodes.clear();
+    if (builder.nodes.empty()) {
+        return true;
+    }
+    bounds = builder.nodes[0].box();
+    vec3 extent = bounds.max() - bounds.min();
+    float longest = std::max(extent[0], std::max(extent[1], extent[2]));
+    for (int a = 0; a < 3; a++) {
+        float length = extent[a] > 0 ? extent[a] : (longest > 0 ? longest : 1.0f);
+        grid_step[a] = length / float(MESH_QUANTIZATION_STEPS - 2);
+        grid_origin[a] = bounds.minimum[a] - grid_step[a];
+    }
+    nodes.resize(builder.nodes.size());
+    for (size_t i = 0; i < builder.nodes.size(); i++) {
+        const bvh_node &node = builder.nodes[i];
+        quantized_bvh_node &q = nodes[i];
+        for (int a = 0; a < 3; a++) {
+            double lower = std::floor((double(node.lower[a]) - grid_origin[a]) / grid_step[a]) - 1;
+            double upper = std::ceil((double(node.upper[a]) - grid_origin[a]) / grid_step[a]) + 1;
+            q.lower[a] = uint16_t(std::min(std::max(lower, 0.0), double(MESH_QUANTIZATION_STEPS)));
+            q.upper[a] = uint16_t(std::min(std::max(upper, 0.0), double(MESH_QUANTIZATION_STEPS)));
+        }
+        q.packed = (uint32_t(node.offset) << 6) | (uint32_t(node.count) << 2) | node.axis;
+    }
+    return true;
+}
+
+inline bool triangle_mesh::intersect(const ray &r, float t_min, float &t_max, uint32_t &triangle, float &b1,
+                                     float &b2) const {
+    return walk<false>(r, t_min, t_max, triangle, b1, b2);
+}
+
+template<bool AnyHit>
+inline bool triangle_mesh::walk(const ray &r, float t_min, float &t_max, uint32_t &triangle, float &b1,
+                                float &b2) const {
+    if (nodes.empty()) {
+        return false;
+    }
+    // The same ray in grid units: it passes the same points at the same t, so the walk prunes with world t
+    vec3 o = r.origin();
+    vec3 d = r.direction();
+    ray grid_ray(vec3((o[0] - grid_origin[0]) / grid_step[0], (o[1] - grid_origin[1]) / grid_step[1],
+                      (o[2] - grid_origin[2]) / grid_step[2]),
+                 vec3(d[0] / grid_step[0], d[1] / grid_step[1], d[2] / grid_step[2]));
+    watertight_ray w(r);
+    bool found = false;
+    traverse_bvh<AnyHit>(nodes.data(), grid_ray, t_min, t_max, [&](int first, int count, float &t) {
+        RT_STAT(thread_stats().primitive_tests += count);
+        bool hit_leaf = false;
+        for (int i = first; i < first + count; i++) {
+            const uint32_t *corner = &indices[3 * size_t(i)];
+            if (intersect_triangle(w, &positions[3 * size_t(corner[0])], &positions[3 * size_t(corner[1])],
+                                   &positions[3 * size_t(corner[2])], t_min, t, t, b1, b2)) {
+                triangle = uint32_t(i);
+                hit_leaf = true;
+                if (AnyHit) {
+                    break;
+                }
+            }
+        }
+        found = found || hit_leaf;
+        return hit_leaf;
+    });
+    return found;
+}
+
+inline vec3 triangle_mesh::normal(uint32_t triangle, float b1, float b2) const {
+    const uint32_t *corner = &indices[3 * size_t(triangle)];
+    if (!normals.empty()) {
+        vec3 n = (1 - b1 - b2) * decode_normal(normals[corner[0]]) + b1 * decode_normal(normals[corner[1]]) +
+                 b2 * decode_normal(normals[corner[2]]);
+        if (n.squared_length() > 0) {
+            return unit_vector(n);
+        }
+    }
+    const float *p0 = &positions[3 * size_t(corner[0])];
+    const float *p1 = &positions[3 * size_t(corner[1])];
+    const float *p2 = &positions[3 * size_t(corner[2])];
+    vec3 e1(p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2]);
+    vec3 e2(p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2]);
+    return unit_vector(cross(e1, e2));
+}
+
+
+// Read the v, vn and f statements of a Wavefront OBJ file into mesh and build it. Faces with more than three
+// corners are split into a fan, corners can be written v, v/vt, v/vt/vn or v//vn, and negative indices count
+// back from the last vertex. Everything else (texture coordinates, groups, materials) is skipped. The mesh keeps
+// its vertex normals only if every corner of every face has one. Problems are reported on cerr with the line
+// they are on
+inline bool load_obj(const std::string &path, triangle_mesh &mesh) {
+    std::shared_ptr<mapped_file> file = mapped_file::open(path);
+    if (!file) {
+        std::cerr << "Could not open mesh " << path << "\n";
+        return false;
+    }
+    // Read straight from the mapping: a multi million triangle file is hundreds of megabytes, and going
+    // through lines and string streams would take longer than building the bvh
+    const char *p = reinterpret_cast<const char *>(file->data);
+    const char *end = p + file->size;
+    int line_number = 1;
+    auto fail = [&](const std::string &message) {
+        std::cerr << path << ":" << line_number << ": " << message << "\n";
+        mesh.clear();
+        return false;
+    };
+    auto skip_blanks = [&]() {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+            p++;
+        }
+    };
+    auto read_float = [&](float &value) {
+        skip_blanks();
+        if (p < end && *p == '+') {
+            p++;
+        }
+        std::from_chars_result result = std::from_chars(p, end, value);
+        p = result.ptr;
+        return result.ec == std::errc();
+    };
+    // An OBJ index, 1 based or negative, turned into a 0 based one. Fails on 0 and on anything out of range
+    auto read_index = [&](int64_t count, int64_t &index) {
+        std::from_chars_result result = std::from_chars(p, end, index);
+        p = result.ptr;
+        if (result.ec != std::errc() || index == 0) {
+            return false;
+        }
+        index = index < 0 ? count + index : index - 1;
+        return index >= 0 && index < count;
+    };
+
+    std::vector<float> file_positions;
+    std::vector<float> file_normals;
+    // Corners as (position, normal) pairs, -1 for a corner without a normal
+    std::vector<int64_t> corners;
+    std::vector<int64_t> face;
+    bool every_corner_has_normal = true;
+    while (p < end) {
+        skip_blanks();
+        const char *word = p;
+        while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
+            p++;
+        }
+        std::string keyword(word, p);
+        if (keyword == "v" || keyword == "vn") {
+            float x, y, z;
+            if (!read_float(x) || !read_float(y) || !read_float(z)) {
+                return fail("expected " + keyword + " <x> <y> <z>");
+            }
+            std::vector<float> &target = keyword == "v" ? file_positions : file_normals;
+            target.push_back(x);
+            target.push_back(y);
+            target.push_back(z);
+            // v may carry a w or a colour after the position, which is skipped along with the rest of the line
+        } else if (keyword == "f") {
+            face.clear();
+            while (true) {
+                skip_blanks();
+                if (p >= end || *p == '\n' || *p == '#') {
+                    break;
+                }
+                int64_t position, unused, normal = -1;
+                if (!read_index(int64_t(file_positions.size() / 3), position)) {
+                    return fail("bad vertex index in face");
+                }
+                if (p < end && *p == '/') {
+                    p++;
+                    if (p < end && *p != '/' && !read_index(INT64_MAX, unused)) {
+                        return fail("bad texture coordinate index in face");
+                    }
+                    if (p < end && *p == '/') {
+                        p++;
+                        if (!read_index(int64_t(file_normals.size() / 3), normal)) {
+                            return fail("bad normal index in face");
+                        }
+                    }
+                }
+                if (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
+                    return fail("bad face corner");
+                }
+                every_corner_has_normal = every_corner_has_normal && normal >= 0;
+                face.push_back(position);
+                face.push_back(normal);
+            }
+            if (face.size() < 6) {
+                return fail("face with fewer than three corners");
+            }
+            for (size_t i = 2; i < face.size() / 2; i++) {
+                corners.insert(corners.end(), {face[0], face[1], face[2 * i - 2], face[2 * i - 1], face[2 * i],
+                                               face[2 * i + 1]});
+            }
+        }
+        while (p < end && *p != '\n') {
+            p++;
+        }
+        if (p < end) {
+            p++;
+            line_number++;
+        }
+    }
+
+    mesh.clear();
+    auto position_of = [&](int64_t position) {
+        const float *v = &file_positions[3 * size_t(position)];
+        return vec3(v[0], v[1], v[2]);
+    };
+    if (!every_corner_has_normal) {
+        size_t count = file_positions.size() / 3;
+        mesh.positions.reserve(3 * count);
+        for (size_t i = 0; i < count; i++) {
+            mesh.add_vertex(position_of(int64_t(i)));
+        }
+        mesh.indices.reserve(corners.size() / 2);
+        for (size_t i = 0; i < corners.size(); i += 2) {
+            mesh.indices.push_back(uint32_t(corners[i]));
+        }
+    } else {
+        // A mesh vertex is a position with a normal, and corners that share both share the vertex
+        std::unordered_map<uint64_t, uint32_t> vertices;
+        mesh.indices.reserve(corners.size() / 2);
+        for (size_t i = 0; i < corners.size(); i += 2) {
+            uint64_t key = (uint64_t(corners[i]) << 32) | uint64_t(corners[i + 1]);
+            auto found = vertices.find(key);
+            if (found == vertices.end()) {
+                const float *n = &file_normals[3 * size_t(corners[i + 1])];
+                uint32_t vertex = mesh.add_vertex(position_of(corners[i]), vec3(n[0], n[1], n[2]));
+                found = vertices.emplace(key, vertex).first;
+            }
+            mesh.indices.push_back(found->second);
+        }
+    }
+    if (mesh.indices.empty()) {
+        std::cerr << path << ": no faces in mesh\n";
+        return false;
+    }
+    return mesh.build();
+}
+
+#endif //RAY_TRACING_TRIANGLE_MESH_H
@@ -6,15 +6,173 @@
 #ifndef RAY_TRACING_vec3_H
 #define RAY_TRACING_vec3_H
 
-class vec3 {
-public:
-    vec3() = default;
+// A vec3 is four floats, x y z and a padding lane, 16 byte aligned, so that a whole vector sits in one SSE or
+// NEON register and each operator is one instruction over all four lanes instead of three scalar ones.
+// Constructors set the padding lane to 0. Lane wise operators may leave something else there (0 / 0 after
+// a division), which is harmless: dot(), length() and the other reductions only ever read the first three.
+// Without SSE or NEON the lanes are a plain array and the same operators loop over them
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define RAY_TRACING_VEC3_SSE 1
+typedef __m128 vec3_lanes;
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define RAY_TRACING_VEC3_NEON 1
+typedef float32x4_t vec3_lanes;
+#else
+struct vec3_lanes {
+    float f[4];
+};
+#endif
 
-    vec3(float e0, float e1, float e2) {
-        e[0] = e0;
-        e[1] = e1;
-        e[2] = e2;
+// Lane wise building blocks the operators below are written in, one version per instruction set
+#if defined(RAY_TRACING_VEC3_SSE)
+inline vec3_lanes lanes_set(float x, float y, float z) { return _mm_setr_ps(x, y, z, 0); }
+inline vec3_lanes lanes_splat(float t) { return _mm_set1_ps(t); }
+inline vec3_lanes lanes_add(vec3_lanes a, vec3_lanes b) { return _mm_add_ps(a, b); }
+inline vec3_lanes lanes_sub(vec3_lanes a, vec3_lanes b) { return _mm_sub_ps(a, b); }
+inline vec3_lanes lanes_mul(vec3_lanes a, vec3_lanes b) { return _mm_mul_ps(a, b); }
+inline vec3_lanes lanes_div(vec3_lanes a, vec3_lanes b) { return _mm_div_ps(a, b); }
+// Where a lane of a is NaN these return the lane of b, so a NaN never replaces a real bound
+inline vec3_lanes lanes_min(vec3_lanes a, vec3_lanes b) { return _mm_min_ps(a, b); }
+inline vec3_lanes lanes_max(vec3_lanes a, vec3_lanes b) { return _mm_max_ps(a, b); }
+// Lanes of a where b < 0, lanes of c elsewhere
+inline vec3_lanes lanes_select_negative(vec3_lanes b, vec3_lanes a, vec3_lanes c) {
+    vec3_lanes negative = _mm_cmplt_ps(b, _mm_setzero_ps());
+    return _mm_or_ps(_mm_and_ps(negative, a), _mm_andnot_ps(negative, c));
+}
+inline vec3_lanes lanes_negate(vec3_lanes a) { return _mm_xor_ps(a, _mm_set1_ps(-0.0f)); }
+inline vec3_lanes lanes_cross(vec3_lanes a, vec3_lanes b) {
+    vec3_lanes a_yzx = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1));
+    vec3_lanes b_yzx = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 2, 1));
+    vec3_lanes c = _mm_sub_ps(_mm_mul_ps(a, b_yzx), _mm_mul_ps(a_yzx, b));
+    return _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1));
+}
+// x + y + z, added in that order so that the result is the same as the scalar sum
+inline float lanes_sum3(vec3_lanes a) {
+    vec3_lanes y = _mm_shuffle_ps(a, a, _MM_SHUFFLE(1, 1, 1, 1));
+    vec3_lanes z = _mm_movehl_ps(a, a);
+    return _mm_cvtss_f32(_mm_add_ss(_mm_add_ss(a, y), z));
+}
+inline float lanes_min3(vec3_lanes a) {
+    vec3_lanes m = _mm_min_ss(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(1, 1, 1, 1)));
+    return _mm_cvtss_f32(_mm_min_ss(m, _mm_movehl_ps(a, a)));
+}
+inline float lanes_max3(vec3_lanes a) {
+    vec3_lanes m = _mm_max_ss(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(1, 1, 1, 1)));
+    return _mm_cvtss_f32(_mm_max_ss(m, _mm_movehl_ps(a, a)));
+}
+// x y z from memory, reading exactly three floats
+inline vec3_lanes lanes_load3(const float *p) {
+    vec3_lanes xy = _mm_castpd_ps(_mm_load_sd(reinterpret_cast<const double *>(p)));
+    return _mm_movelh_ps(xy, _mm_load_ss(p + 2));
+}
+// Estimate of 1 / sqrt(d) to 12 bits, sharpened by one Newton-Raphson step to about 22
+inline float lanes_rsqrt(float d) {
+    vec3_lanes x = _mm_set_ss(d);
+    vec3_lanes r = _mm_rsqrt_ss(x);
+    vec3_lanes half_x_r2 = _mm_mul_ss(_mm_mul_ss(_mm_set_ss(0.5f), x), _mm_mul_ss(r, r));
+    return _mm_cvtss_f32(_mm_mul_ss(r, _mm_sub_ss(_mm_set_ss(1.5f), half_x_r2)));
+}
+#elif defined(RAY_TRACING_VEC3_NEON)
+inline vec3_lanes lanes_set(float x, float y, float z) {
+    float values[4] = {x, y, z, 0};
+    return vld1q_f32(values);
+}
+inline vec3_lanes lanes_splat(float t) { return vdupq_n_f32(t); }
+inline vec3_lanes lanes_add(vec3_lanes a, vec3_lanes b) { return vaddq_f32(a, b); }
+inline vec3_lanes lanes_sub(vec3_lanes a, vec3_lanes b) { return vsubq_f32(a, b); }
+inline vec3_lanes lanes_mul(vec3_lanes a, vec3_lanes b) { return vmulq_f32(a, b); }
+inline vec3_lanes lanes_div(vec3_lanes a, vec3_lanes b) {
+#if defined(__aarch64__)
+    return vdivq_f32(a, b);
+#else
+    float x[4], y[4];
+    vst1q_f32(x, a);
+    vst1q_f32(y, b);
+    for (int i = 0; i < 4; i++) {
+        x[i] /= y[i];
     }
+    return vld1q_f32(x);
+#endif
+}
+inline vec3_lanes lanes_min(vec3_lanes a, vec3_lanes b) { return vbslq_f32(vcltq_f32(a, b), a, b); }
+inline vec3_lanes lanes_max(vec3_lanes a, vec3_lanes b) { return vbslq_f32(vcgtq_f32(a, b), a, b); }
+inline vec3_lanes lanes_select_negative(vec3_lanes b, vec3_lanes a, vec3_lanes c) {
+    return vbslq_f32(vcltq_f32(b, vdupq_n_f32(0)), a, c);
+}
+inline vec3_lanes lanes_negate(vec3_lanes a) { return vnegq_f32(a); }
+inline vec3_lanes lanes_cross(vec3_lanes a, vec3_lanes b) {
+    float x[4], y[4];
+    vst1q_f32(x, a);
+    vst1q_f32(y, b);
+    return lanes_set(x[1] * y[2] - x[2] * y[1], x[2] * y[0] - x[0] * y[2], x[0] * y[1] - x[1] * y[0]);
+}
+inline float lanes_sum3(vec3_lanes a) {
+    return vgetq_lane_f32(a, 0) + vgetq_lane_f32(a, 1) + vgetq_lane_f32(a, 2);
+}
+inline float lanes_min3(vec3_lanes a) {
+    float m = vgetq_lane_f32(a, 0) < vgetq_lane_f32(a, 1) ? vgetq_lane_f32(a, 0) : vgetq_lane_f32(a, 1);
+    return m < vgetq_lane_f32(a, 2) ? m : vgetq_lane_f32(a, 2);
+}
+inline float lanes_max3(vec3_lanes a) {
+    float m = vgetq_lane_f32(a, 0) > vgetq_lane_f32(a, 1) ? vgetq_lane_f32(a, 0) : vgetq_lane_f32(a, 1);
+    return m > vgetq_lane_f32(a, 2) ? m : vgetq_lane_f32(a, 2);
+}
+inline vec3_lanes lanes_load3(const float *p) { return lanes_set(p[0], p[1], p[2]); }
+inline float lanes_rsqrt(float d) {
+    float32x2_t x = vdup_n_f32(d);
+    float32x2_t r = vrsqrte_f32(x);
+    r = vmul_f32(r, vrsqrts_f32(vmul_f32(x, r), r));
+    return vget_lane_f32(r, 0);
+}
+#else
+inline vec3_lanes lanes_set(float x, float y, float z) { return {{x, y, z, 0}}; }
+inline vec3_lanes lanes_splat(float t) { return {{t, t, t, t}}; }
+#define RAY_TRACING_LANE_LOOP(expression) \
+    vec3_lanes r; \
+    for (int i = 0; i < 4; i++) { \
+        r.f[i] = expression; \
+    } \
+    return r;
+inline vec3_lanes lanes_add(vec3_lanes a, vec3_lanes b) { RAY_TRACING_LANE_LOOP(a.f[i] + b.f[i]) }
+inline vec3_lanes lanes_sub(vec3_lanes a, vec3_lanes b) { RAY_TRACING_LANE_LOOP(a.f[i] - b.f[i]) }
+inline vec3_lanes lanes_mul(vec3_lanes a, vec3_lanes b) { RAY_TRACING_LANE_LOOP(a.f[i] * b.f[i]) }
+inline vec3_lanes lanes_div(vec3_lanes a, vec3_lanes b) { RAY_TRACING_LANE_LOOP(a.f[i] / b.f[i]) }
+inline vec3_lanes lanes_min(vec3_lanes a, vec3_lanes b) { RAY_TRACING_LANE_LOOP(a.f[i] < b.f[i] ? a.f[i] : b.f[i]) }
+inline vec3_lanes lanes_max(vec3_lanes a, vec3_lanes b) { RAY_TRACING_LANE_LOOP(a.f[i] > b.f[i] ? a.f[i] : b.f[i]) }
+inline vec3_lanes lanes_select_negative(vec3_lanes b, vec3_lanes a, vec3_lanes c) {
+    RAY_TRACING_LANE_LOOP(b.f[i] < 0 ? a.f[i] : c.f[i])
+}
+inline vec3_lanes lanes_negate(vec3_lanes a) { RAY_TRACING_LANE_LOOP(-a.f[i]) }
+#undef RAY_TRACING_LANE_LOOP
+inline vec3_lanes lanes_cross(vec3_lanes a, vec3_lanes b) {
+    return lanes_set(a.f[1] * b.f[2] - a.f[2] * b.f[1], a.f[2] * b.f[0] - a.f[0] * b.f[2],
+                     a.f[0] * b.f[1] - a.f[1] * b.f[0]);
+}
+inline float lanes_sum3(vec3_lanes a) { return a.f[0] + a.f[1] + a.f[2]; }
+inline float lanes_min3(vec3_lanes a) {
+    float m = a.f[0] < a.f[1] ? a.f[0] : a.f[1];
+    return m < a.f[2] ? m : a.f[2];
+}
+inline float lanes_max3(vec3_lanes a) {
+    float m = a.f[0] > a.f[1] ? a.f[0] : a.f[1];
+    return m > a.f[2] ? m : a.f[2];
+}
+inline vec3_lanes lanes_load3(const float *p) { return lanes_set(p[0], p[1], p[2]); }
+inline float lanes_rsqrt(float d) { return 1.0f / std::sqrt(d); }
+#endif
+
+class alignas(16) vec3 {
+public:
+    vec3() : v(lanes_splat(0)) {}
+
+    vec3(float e0, float e1, float e2) : v(lanes_set(e0, e1, e2)) {}
+
+    explicit vec3(vec3_lanes lanes) : v(lanes) {}
+
+    // x y z from three consecutive floats, such as a bvh node's box or a mesh's vertex array
+    static vec3 load(const float *p) { return vec3(lanes_load3(p)); }
 
     // Vector components can be referred to as x,y,z for distance or r,g,b for colours
     inline float x() const { return e[0]; }
@@ -25,7 +183,7 @@ public:
     inline float b() const { return e[2]; }
 
     inline const vec3 &operator+() const { return *this; }
-    inline const vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
+    inline const vec3 operator-() const { return vec3(lanes_negate(v)); }
     inline float operator[](int i) const { return e[i]; }
     inline float &operator[](int i) { return e[i]; };
 
@@ -39,18 +197,21 @@ public:
 
     // Magnitude equation of a 3D vector
     inline float length() const {
-        return sqrt(e[0] * e[0] + e[1] * e[1] + e[2] * e[2]);
+        return std::sqrt(squared_length());
     }
 
     // Magnitude squared
     inline float squared_length() const {
-        return e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
+        return lanes_sum3(lanes_mul(v, v));
     }
 
     inline void make_unit_vector();
 
-    float e[3];
-
+    // The same four floats seen as a register or as an array
+    union {
+        vec3_lanes v;
+        float e[4];
+    };
 };
 
 inline std::istream &operator>>(std::istream &is, vec3 &t) {
@@ -63,98 +224,90 @@ inline std::ostream &operator<<(std::ostream &os, const vec3 &t) {
     return os;
 }
 
+// Scaled by one reciprocal square root instead of divided by the length, see lanes_rsqrt()
 inline void vec3::make_unit_vector() {
-    float k = 1.0 / sqrt(e[0] * e[0] + e[1] * e[1] + e[2] * e[2]);
-    e[0] *= k;
-    e[1] *= k;
-    e[2] *= k;
+    v = lanes_mul(v, lanes_splat(lanes_rsqrt(squared_length())));
 }
 
 // Vector addition
 inline vec3 operator+(const vec3 &v1, const vec3 &v2) {
-    return vec3(v1.e[0] + v2.e[0], v1.e[1] + v2.e[1], v1.e[2] + v2.e[2]);
+    return vec3(lanes_add(v1.v, v2.v));
 }
 // Vector subtraction
 inline vec3 operator-(const vec3 &v1, const vec3 &v2) {
-    return vec3(v1.e[0] - v2.e[0], v1.e[1] - v2.e[1], v1.e[2] - v2.e[2]);
+    return vec3(lanes_sub(v1.v, v2.v));
 }
 // Element-wise multiplication
 inline vec3 operator*(const vec3 &v1, const vec3 &v2) {
-    return vec3(v1.e[0] * v2.e[0], v1.e[1] * v2.e[1], v1.e[2] * v2.e[2]);
+    return vec3(lanes_mul(v1.v, v2.v));
 }
 // Element-wise division
 inline vec3 operator/(const vec3 &v1, const vec3 &v2) {
-    return vec3(v1.e[0] / v2.e[0], v1.e[1] / v2.e[1], v1.e[2] / v2.e[2]);
+    return vec3(lanes_div(v1.v, v2.v));
 }
 // Scalar multiplication - scalar in front
 inline vec3 operator*(float t, const vec3 &v) {
-    return vec3(t * v.e[0], t * v.e[1], t * v.e[2]);
+    return vec3(lanes_mul(lanes_splat(t), v.v));
 }
 // Scalar multiplication - vector in front
 inline vec3 operator*(const vec3 &v, float t) {
-    return vec3(t * v.e[0], t * v.e[1], t * v.e[2]);
+    return vec3(lanes_mul(lanes_splat(t), v.v));
 }
 // Scalar division
 inline vec3 operator/(vec3 v, float t) {
-    return vec3(v.e[0]/t, v.e[1]/t, v.e[2]/t);
+    return vec3(lanes_div(v.v, lanes_splat(t)));
 }
 // Dot product
 inline float dot(const vec3 &v1, const vec3 &v2) {
-    return v1.e[0] * v2.e[0] + v1.e[1] * v2.e[1] + v1.e[2] * v2.e[2];
+    return lanes_sum3(lanes_mul(v1.v, v2.v));
 }
 // Cross product
 inline vec3 cross(const vec3 & v1, const vec3 &v2) {
-    return vec3( (v1.e[1] * v2.e[2] - v1.e[2] * v2.e[1]),
-                 (-(v1.e[0] * v2.e[2] - v1.e[2] * v2.e[0])),
-                 (v1.e[0] * v2.e[1] - v1.e[1] * v2.e[0]));
+    return vec3(lanes_cross(v1.v, v2.v));
+}
+// Element-wise minimum and maximum, keeping the lane of v2 where v1 is NaN
+inline vec3 min_components(const vec3 &v1, const vec3 &v2) {
+    return vec3(lanes_min(v1.v, v2.v));
+}
+inline vec3 max_components(const vec3 &v1, const vec3 &v2) {
+    return vec3(lanes_max(v1.v, v2.v));
 }
 
-inline vec3 & vec3::operator+=(const vec3 &v) {
-    e[0] += v.e[0];
-    e[1] += v.e[1];
-    e[2] += v.e[2];
+inline vec3 & vec3::operator+=(const vec3 &v2) {
+    v = lanes_add(v, v2.v);
     return *this;
 }
 
-inline vec3 & vec3::operator-=(const vec3 &v) {
-    e[0] -= v.e[0];
-    e[1] -= v.e[1];
-    e[2] -= v.e[2];
+inline vec3 & vec3::operator-=(const vec3 &v2) {
+    v = lanes_sub(v, v2.v);
     return *this;
 }
 
-inline vec3 & vec3::operator*=(const vec3 &v) {
-    e[0] *= v.e[0];
-    e[1] *= v.e[1];
-    e[2] *= v.e[2];
+inline vec3 & vec3::operator*=(const vec3 &v2) {
+    v = lanes_mul(v, v2.v);
     return *this;
 }
 
-inline vec3 & vec3::operator/=(const vec3 &v) {
-    e[0] /= v.e[0];
-    e[1] /= v.e[1];
-    e[2] /= v.e[2];
+inline vec3 & vec3::operator/=(const vec3 &v2) {
+    v = lanes_div(v, v2.v);
     return *this;
 }
 
 inline vec3 & vec3::operator*=(const float t) {
-    e[0] *= t;
-    e[1] *= t;
-    e[2] *= t;
+    v = lanes_mul(v, lanes_splat(t));
     return *this;
 }
 
 inline vec3 & vec3::operator/=(const float t) {
     float k = 1.0/t;
 
-    e[0] *= k;
-    e[1] *= k;
-    e[2] *= k;
+    v = lanes_mul(v, lanes_splat(k));
     return *this;
 }
 
 inline vec3 unit_vector(vec3 v) {
-    return (v / v.length());
+    v.make_unit_vector();
+    return v;
 }
 
 #endif //RAY_TRACING_vec3_H
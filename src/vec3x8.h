@@ -0,0 +1,110 @@
+
+#ifndef RAY_TRACING_VEC3X8_H
+#define RAY_TRACING_VEC3X8_H
+
+#include <cmath>
+#include "vec3.h"
+
+// Number of rays or vectors packet code handles at once
+const int PACKET_WIDTH = 8;
+
+struct alignas(32) float8 {
+    float f[PACKET_WIDTH];
+
+    static float8 splat(float t) {
+        float8 r;
+        for (int i = 0; i < PACKET_WIDTH; i++) {
+            r.f[i] = t;
+        }
+        return r;
+    }
+};
+
+struct alignas(32) vec3x8 {
+    // Eight vectors stored as three arrays, all the x's, then all the y's, then all the z's. Every operator is
+    // a fixed length loop over the lanes, which the compiler turns into one 8 wide AVX instruction or two
+    // 4 wide SSE / NEON ones per component, whatever the target has. Unused lanes of a partly filled packet
+    // are computed along with the others and ignored by whoever reads the result
+    float x[PACKET_WIDTH];
+    float y[PACKET_WIDTH];
+    float z[PACKET_WIDTH];
+
+    vec3 get(int lane) const { return vec3(x[lane], y[lane], z[lane]); }
+
+    void set(int lane, const vec3 &v) {
+        x[lane] = v[0];
+        y[lane] = v[1];
+        z[lane] = v[2];
+    }
+};
+
+inline vec3x8 operator+(const vec3x8 &a, const vec3x8 &b) {
+    vec3x8 r;
+    for (int i = 0; i < PACKET_WIDTH; i++) {
+        r.x[i] = a.x[i] + b.x[i];
+        r.y[i] = a.y[i] + b.y[i];
+        r.z[i] = a.z[i] + b.z[i];
+    }
+    return r;
+}
+
+inline vec3x8 operator-(const vec3x8 &a, const vec3x8 &b) {
+    vec3x8 r;
+    for (int i = 0; i < PACKET_WIDTH; i++) {
+        r.x[i] = a.x[i] - b.x[i];
+        r.y[i] = a.y[i] - b.y[i];
+        r.z[i] = a.z[i] - b.z[i];
+    }
+    return r;
+}
+
+// Element-wise multiplication
+inline vec3x8 operator*(const vec3x8 &a, const vec3x8 &b) {
+    vec3x8 r;
+    for (int i = 0; i < PACKET_WIDTH; i++) {
+        r.x[i] = a.x[i] * b.x[i];
+        r.y[i] = a.y[i] * b.y[i];
+        r.z[i] = a.z[i] * b.z[i];
+    }
+    return r;
+}
+
+// Each lane scaled by its own factor
+inline vec3x8 operator*(const float8 &t, const vec3x8 &a) {
+    vec3x8 r;
+    for (int i = 0; i < PACKET_WIDTH; i++) {
+        r.x[i] = t.f[i] * a.x[i];
+        r.y[i] = t.f[i] * a.y[i];
+        r.z[i] = t.f[i] * a.z[i];
+    }
+    return r;
+}
+
+// The same vector in every lane
+inline vec3x8 splat(const vec3 &v) {
+    vec3x8 r;
+    for (int i = 0; i < PACKET_WIDTH; i++) {
+        r.x[i] = v[0];
+        r.y[i] = v[1];
+        r.z[i] = v[2];
+    }
+    return r;
+}
+
+inline float8 dot(const vec3x8 &a, const vec3x8 &b) {
+    float8 r;
+    for (int i = 0; i < PACKET_WIDTH; i++) {
+        r.f[i] = a.x[i] * b.x[i] + a.y[i] * b.y[i] + a.z[i] * b.z[i];
+    }
+    return r;
+}
+
+inline vec3x8 unit_vector(const vec3x8 &a) {
+    float8 scale = dot(a, a);
+    for (int i = 0; i < PACKET_WIDTH; i++) {
+        scale.f[i] = 1.0f / std::sqrt(scale.f[i]);
+    }
+    return scale * a;
+}
+
+#endif //RAY_TRACING_VEC3X8_H
@@ -0,0 +1,279 @@
+
+#ifndef RAY_TRACING_WAVEFRONT_H
+#define RAY_TRACING_WAVEFRONT_H
+
+#include <algorithm>
+#include <limits>
+#include <type_traits>
+#include <vector>
+#include "accumulation_buffer.h"
+#include "camera.h"
+#include "hittable.h"
+#include "integrator.h"
+#include "light.h"
+#include "material.h"
+#include "render_settings.h"
+#include "render_stats.h"
+#include "scene_data.h"
+#include "sky.h"
+#include "tile.h"
+
+struct wavefront_path {
+    ray r;
+    // Product of the attenuations picked up so far, what a colour found at the end of the path is scaled by
+    vec3 throughput;
+    sampler rng;
+    // Which entry of the sample arrays this path contributes to
+    int sample;
+    int depth;
+    // Density the last bounce picked r's direction with, 0 if light sampling could not have picked it too
+    float scatter_pdf;
+};
+
+struct wavefront_shadow {
+    // A shadow ray of next event estimation, and the light it adds to its sample if nothing is in the way
+    ray r;
+    float t_max;
+    vec3 light;
+    int sample;
+};
+
+struct wavefront_hit {
+    hit_record record;
+    int path;
+};
+
+class wavefront_integrator {
+    // Breadth first alternative to the depth first trace_path, with the same depth limit, Russian roulette and
+    // light sampling. All camera rays of a tile are generated up front, then every bounce runs as separate
+    // stages over the whole batch: intersect every path, group the hits by material type, shade each group in
+    // its own loop with the concrete scatter (no virtual call), trace the shadow rays the shading queued, and
+    // compact the paths that carry on into the next queue.
+    // Each stage runs one kind of work over many rays, which keeps its code and data hot
+public:
+    inline void render_tile(const tile &t, int x_pixels, int y_pixels, const camera &cam, hittable *world,
+                            uint64_t seed, uint32_t first_sample, int samples, accumulation_buffer &accumulated,
+                            const std::vector<unsigned char> *active, const render_settings &settings);
+
+private:
+    inline void intersect(hittable *world);
+
+    inline void shade_sky();
+
+    inline void sort_by_material();
+
+    template<typename M>
+    inline void shade(size_t begin, size_t end, const render_settings &settings);
+
+    inline void trace_shadows(hittable *world);
+
+    std::vector<wavefront_path> paths;
+    std::vector<wavefront_path> next_paths;
+    std::vector<wavefront_hit> hits;
+    std::vector<wavefront_hit> sorted_hits;
+    std::vector<wavefront_shadow> shadows;
+    // The scene's lights, null when it has none to sample
+    const light_list *lights = nullptr;
+    // Paths that missed everything in the last intersect()
+    std::vector<int> missed;
+    std::vector<vec3> radiance;
+    std::vector<size_t> sample_pixel;
+    // Where each material kind starts in sorted_hits, with one extra entry for the end
+    size_t group_start[int(material_kind::other) + 2];
+};
+
+inline void wavefront_integrator::render_tile(const tile &t, int x_pixels, int y_pixels, const camera &cam,
+                                              hittable *world, uint64_t seed, uint32_t first_sample, int samples,
+                                              accumulation_buffer &accumulated,
+                                              const std::vector<unsigned char> *active,
+                                              const render_settings &settings) {
+    // Generate every camera ray of the tile. Each path carries the sampler of its sample, since it no longer
+    // runs to completion before the next sample of the same pixel starts
+    paths.clear();
+    radiance.clear();
+    sample_pixel.clear();
+    const scene_data *data = dynamic_cast<const scene_data *>(world);
+    lights = settings.light_sampling && data && !data->lights()->empty() ? data->lights() : nullptr;
+    for (int y_ind = t.y_end - 1; y_ind >= t.y_begin; y_ind--) {
+        for (int x_ind = t.x_begin; x_ind < t.x_end; x_ind++) {
+            size_t index = accumulated.index(x_ind, y_ind);
+            if (active && !(*active)[index]) {
+                continue;
+            }
+            for (int s = 0; s < samples; s++) {
+                wavefront_path path;
+                path.rng = sampler(settings.sampler, seed, x_ind, y_ind, x_pixels, first_sample + uint32_t(s));
+                float u = float(x_ind + path.rng.next_float()) / float(x_pixels);
+                float v = float(y_ind + path.rng.next_float()) / float(y_pixels);
+                path.r = cam.get_ray(u, v, path.rng);
+                path.throughput = vec3(1, 1, 1);
+                path.sample = int(radiance.size());
+                path.depth = 0;
+                path.scatter_pdf = 0;
+                paths.push_back(path);
+                radiance.push_back(vec3(0, 0, 0));
+                sample_pixel.push_back(index);
+            }
+        }
+    }
+
+    while (!paths.empty()) {
+        intersect(world);
+        shade_sky();
+        sort_by_material();
+        next_paths.clear();
+        shade<lambertian>(group_start[int(material_kind::lambertian)], group_start[int(material_kind::lambertian) + 1],
+                          settings);
+        shade<metal>(group_start[int(material_kind::metal)], group_start[int(material_kind::metal) + 1], settings);
+        shade<dielectric>(group_start[int(material_kind::dielectric)], group_start[int(material_kind::dielectric) + 1],
+                          settings);
+        shade<diffuse_light>(group_start[int(material_kind::emissive)], group_start[int(material_kind::emissive) + 1],
+                             settings);
+        shade<material>(group_start[int(material_kind::other)], group_start[int(material_kind::other) + 1], settings);
+        trace_shadows(world);
+        paths.swap(next_paths);
+    }
+
+    for (size_t i = 0; i < radiance.size(); i++) {
+        accumulated.sum[sample_pixel[i]] += radiance[i];
+        accumulated.stats[sample_pixel[i]].add(luminance(radiance[i]));
+    }
+}
+
+inline void wavefront_integrator::intersect(hittable *world) {
+    // Paths that miss everything are set aside for shade_sky() and end here
+    hits.clear();
+    missed.clear();
+    for (int i = 0; i < int(paths.size()); i++) {
+        wavefront_hit hit;
+        RT_STAT(if (paths[i].depth == 0) thread_stats().primary_rays++; else thread_stats().secondary_rays++);
+        if (world->hit(paths[i].r, 0.001, std::numeric_limits<float>::max(), hit.record)) {
+            RT_STAT(thread_stats().ray_hits++);
+            hit.path = i;
+            hits.push_back(hit);
+        } else {
+            RT_STAT(thread_stats().end_path(paths[i].depth));
+            missed.push_back(i);
+        }
+    }
+}
+
+inline void wavefront_integrator::shade_sky() {
+    // Missed paths pick up the sky PACKET_WIDTH at a time. The last packet repeats its final path in the lanes
+    // that are left over, and only the filled lanes are added
+    for (size_t begin = 0; begin < missed.size(); begin += PACKET_WIDTH) {
+        int filled = int(std::min(missed.size() - begin, size_t(PACKET_WIDTH)));
+        vec3x8 directions, throughputs;
+        for (int lane = 0; lane < PACKET_WIDTH; lane++) {
+            const wavefront_path &path = paths[missed[begin + std::min(lane, filled - 1)]];
+            directions.set(lane, path.r.direction());
+            throughputs.set(lane, path.throughput);
+        }
+        vec3x8 colours = throughputs * sky_color(directions);
+        for (int lane = 0; lane < filled; lane++) {
+            radiance[paths[missed[begin + lane]].sample] += colours.get(lane);
+        }
+    }
+}
+
+inline void wavefront_integrator::sort_by_material() {
+    // Counting sort on the material kind, which keeps the hits of each kind in path order
+    const int kinds = int(material_kind::other) + 1;
+    size_t counts[kinds] = {};
+    for (const wavefront_hit &hit : hits) {
+        counts[int(hit.record.mat_ptr->kind())]++;
+    }
+    group_start[0] = 0;
+    for (int k = 0; k < kinds; k++) {
+        group_start[k + 1] = group_start[k] + counts[k];
+    }
+    size_t next[kinds];
+    for (int k = 0; k < kinds; k++) {
+        next[k] = group_start[k];
+    }
+    sorted_hits.resize(hits.size());
+    for (const wavefront_hit &hit : hits) {
+        sorted_hits[next[int(hit.record.mat_ptr->kind())]++] = hit;
+    }
+}
+
+template<typename M>
+inline void wavefront_integrator::shade(size_t begin, size_t end, const render_settings &settings) {
+    // The qualified M:: calls are resolved at compile time, so for the concrete materials they can be inlined,
+    // anything else (M = material) goes through the virtual calls.
+    // Paths that are absorbed, too deep or lose at Russian roulette contribute nothing more and are dropped
+    // from the queue
+    const bool virtual_calls = std::is_same<M, material>::value;
+    for (size_t i = begin; i < end; i++) {
+        const wavefront_hit &hit = sorted_hits[i];
+        wavefront_path &path = paths[hit.path];
+        const M *mat = static_cast<const M *>(hit.record.mat_ptr);
+        auto scatter_value = [&](const vec3 &direction, vec3 &value, float &pdf) {
+            return virtual_calls ? mat->scatter_value(hit.record, direction, value, pdf)
+                                 : mat->M::scatter_value(hit.record, direction, value, pdf);
+        };
+        if constexpr (virtual_calls || std::is_same<M, diffuse_light>::value) {
+            vec3 emitted = virtual_calls ? mat->emitted(path.r, hit.record) : mat->M::emitted(path.r, hit.record);
+            if (emitted[0] > 0 || emitted[1] > 0 || emitted[2] > 0) {
+                float weight = path.scatter_pdf > 0 && hit.record.light >= 0
+                               ? power_heuristic(path.scatter_pdf, lights->pdf(path.r.origin(), hit.record.light))
+                               : 1.0f;
+                radiance[path.sample] += weight * path.throughput * emitted;
+            }
+        }
+        if (path.depth >= settings.max_depth) {
+            RT_STAT(thread_stats().paths_cut_off++; thread_stats().end_path(path.depth));
+            continue;
+        }
+        if (lights) {
+            path.rng.start_bounce(path.depth, SAMPLER_LIGHT_DIMENSION);
+            wavefront_shadow shadow;
+            shadow.light = sample_direct_light(*lights, hit.record.point, scatter_value, path.rng, shadow.r,
+                                               shadow.t_max);
+            if (shadow.light[0] > 0 || shadow.light[1] > 0 || shadow.light[2] > 0) {
+                shadow.light *= path.throughput;
+                shadow.sample = path.sample;
+                shadows.push_back(shadow);
+            }
+        }
+        path.rng.start_bounce(path.depth);
+        ray scattered;
+        vec3 attenuation;
+        bool scatters;
+        if constexpr (std::is_same<M, material>::value) {
+            scatters = mat->scatter(path.r, hit.record, attenuation, scattered, path.rng);
+        } else {
+            scatters = mat->M::scatter(path.r, hit.record, attenuation, scattered, path.rng);
+        }
+        if (!scatters) {
+            RT_STAT(thread_stats().end_path(path.depth));
+            continue;
+        }
+        wavefront_path next = path;
+        next.r = scattered;
+        next.throughput *= attenuation;
+        next.depth++;
+        vec3 value;
+        if (!lights || !scatter_value(scattered.direction(), value, next.scatter_pdf)) {
+            next.scatter_pdf = 0;
+        }
+        if (!russian_roulette(next.throughput, next.depth, settings, next.rng)) {
+            RT_STAT(thread_stats().paths_ended_by_roulette++; thread_stats().end_path(next.depth));
+            continue;
+        }
+        next_paths.push_back(next);
+    }
+}
+
+inline void wavefront_integrator::trace_shadows(hittable *world) {
+    // The shadow rays of every path shaded in this bounce, one occlusion query each
+    for (const wavefront_shadow &shadow : shadows) {
+        RT_STAT(thread_stats().shadow_rays++);
+        if (!world->occluded(shadow.r, 0.001, shadow.t_max)) {
+            radiance[shadow.sample] += shadow.light;
+        }
+    }
+    shadows.clear();
+}
+
+#endif //RAY_TRACING_WAVEFRONT_H